@@ -0,0 +1,228 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum LogLevel {
+    LOG_DEBUG = 0,   // per-request events
+    LOG_INFO = 1,    // connections, startup and shutdown
+    LOG_WARN = 2,
+    LOG_ERROR = 3
+};
+
+// Events below this level are compiled out entirely, e.g.
+// g++ -DLOG_COMPILE_LEVEL=1 drops every per-request log call.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+#if defined(__GNUC__)
+#define LOG_PRINTF_FORMAT(fmt, args) __attribute__((format(printf, fmt, args)))
+#else
+#define LOG_PRINTF_FORMAT(fmt, args)
+#endif
+
+inline bool parseLogLevel(const std::string& name, LogLevel& level) {
+    if (name == "debug") level = LOG_DEBUG;
+    else if (name == "info") level = LOG_INFO;
+    else if (name == "warn") level = LOG_WARN;
+    else if (name == "error") level = LOG_ERROR;
+    else return false;
+    return true;
+}
+
+// Asynchronous logger. Producers format straight into a slot of a bounded
+// lock-free MPSC ring (one sequence number per record, no heap allocation,
+// no lock); a background thread turns the records into lines and writes
+// them to stdout in batches. When the ring is full the record is dropped
+// and counted rather than stalling the caller.
+class AsyncLogger {
+public:
+    static const size_t RECORD_COUNT = 2048;   // power of two
+    static const size_t TEXT_SIZE = 240;
+
+    AsyncLogger() {
+        for (size_t i = 0; i < RECORD_COUNT; i++) {
+            records_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~AsyncLogger() {
+        stop();
+    }
+
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (flusher_.joinable()) {
+            return;
+        }
+        stopping_ = false;
+        flusher_ = std::thread([this]() { flushLoop(); });
+    }
+
+    // Drains everything queued so far and joins the flusher
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!flusher_.joinable()) {
+                return;
+            }
+            stopping_ = true;
+        }
+        wakeup_.notify_one();
+        flusher_.join();
+    }
+
+    void setLevel(LogLevel level) {
+        level_.store(level, std::memory_order_relaxed);
+    }
+
+    bool isEnabled(LogLevel level) const {
+        return level >= level_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t droppedCount() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+    void write(LogLevel level, const char* format, ...) LOG_PRINTF_FORMAT(3, 4) {
+        size_t position = enqueuePos_.load(std::memory_order_relaxed);
+        Record* record = nullptr;
+
+        while (true) {
+            record = &records_[position & (RECORD_COUNT - 1)];
+            size_t sequence = record->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+            if (diff == 0) {
+                if (enqueuePos_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                position = enqueuePos_.load(std::memory_order_relaxed);
+            }
+        }
+
+        record->timestamp = std::time(nullptr);
+        record->level = level;
+        va_list args;
+        va_start(args, format);
+        std::vsnprintf(record->text, sizeof(record->text), format, args);
+        va_end(args);
+        record->sequence.store(position + 1, std::memory_order_release);
+
+        // Only nudge the flusher when the ring is filling up; otherwise it
+        // wakes on its own timer and writes a whole batch at once
+        if (position - dequeuePos_.load(std::memory_order_relaxed) > RECORD_COUNT / 2) {
+            wakeup_.notify_one();
+        }
+    }
+
+private:
+    struct Record {
+        std::atomic<size_t> sequence;
+        std::time_t timestamp;
+        LogLevel level;
+        char text[TEXT_SIZE];
+    };
+
+    static const int FLUSH_INTERVAL_MS = 50;
+    static const size_t BATCH_BUFFER_SIZE = 64 * 1024;
+
+    // Returns false when the ring is empty (single consumer)
+    bool drainOne(char* buffer, size_t& used, std::time_t& cachedSecond, char* cachedStamp) {
+        size_t position = dequeuePos_.load(std::memory_order_relaxed);
+        Record& record = records_[position & (RECORD_COUNT - 1)];
+        if (record.sequence.load(std::memory_order_acquire) != position + 1) {
+            return false;
+        }
+
+        // localtime/strftime only run once per distinct second
+        if (record.timestamp != cachedSecond) {
+            cachedSecond = record.timestamp;
+            std::strftime(cachedStamp, 32, "%Y-%m-%d %H:%M:%S", std::localtime(&cachedSecond));
+        }
+
+        int written = std::snprintf(buffer + used, BATCH_BUFFER_SIZE - used, "[%s] %s\n", cachedStamp, record.text);
+        if (written > 0) {
+            used += std::min(static_cast<size_t>(written), BATCH_BUFFER_SIZE - used - 1);
+        }
+
+        record.sequence.store(position + RECORD_COUNT, std::memory_order_release);
+        dequeuePos_.store(position + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void flushLoop() {
+        static char buffer[BATCH_BUFFER_SIZE];
+        char cachedStamp[32] = "";
+        std::time_t cachedSecond = -1;
+        uint64_t reportedDrops = 0;
+
+        while (true) {
+            size_t used = 0;
+            // Leave room for one full line so snprintf never truncates mid-batch
+            while (used + TEXT_SIZE + 64 < BATCH_BUFFER_SIZE &&
+                   drainOne(buffer, used, cachedSecond, cachedStamp)) {
+            }
+
+            uint64_t drops = droppedCount();
+            if (drops != reportedDrops && used + 64 < BATCH_BUFFER_SIZE) {
+                used += std::snprintf(buffer + used, BATCH_BUFFER_SIZE - used,
+                                      "[log] %llu records dropped\n",
+                                      static_cast<unsigned long long>(drops - reportedDrops));
+                reportedDrops = drops;
+            }
+
+            if (used > 0) {
+                std::fwrite(buffer, 1, used, stdout);
+                std::fflush(stdout);
+                continue;   // there may be more queued behind a full batch
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (stopping_) {
+                break;
+            }
+            wakeup_.wait_for(lock, std::chrono::milliseconds(FLUSH_INTERVAL_MS));
+        }
+    }
+
+    Record records_[RECORD_COUNT];
+    alignas(64) std::atomic<size_t> enqueuePos_{0};
+    alignas(64) std::atomic<size_t> dequeuePos_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<LogLevel> level_{LOG_DEBUG};
+
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::thread flusher_;
+    bool stopping_ = false;
+};
+
+inline AsyncLogger eventLog;
+
+// The level check comes first, so filtered events never format anything
+// and events below LOG_COMPILE_LEVEL are removed by the compiler
+#define LOG_EVENT(level, ...)                                              \
+    do {                                                                   \
+        if ((level) >= LOG_COMPILE_LEVEL && eventLog.isEnabled(level)) {   \
+            eventLog.write((level), __VA_ARGS__);                          \
+        }                                                                  \
+    } while (0)
+
+#endif
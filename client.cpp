@@ -1,25 +1,10 @@
-#ifdef _WIN32
-#define PLATFORM_WINDOWS 1
-#else
-#define PLATFORM_WINDOWS 0
-#endif
-
-#if PLATFORM_WINDOWS
-#include <windows.h>
-#include <io.h>
-#include <fcntl.h>
-#define open _open
-#define read _read
-#define write _write
-#define close _close
-#define lseek _lseek
-#define fsync _commit
-#else
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <dirent.h>
-#endif
+#include "ipc_common.h"
+#include "ipc_client.h"
+#include "latency_histogram.h"
+#include "ipc_registry.h"
+#include "ipc_net.h"
+#include "request_trace.h"
+#include "cpu_affinity.h"
 
 #include <iostream>
 #include <string>
@@ -31,85 +16,210 @@
 #include <vector>
 #include <algorithm>
 #include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+
+std::atomic<bool>& running = clientRunning;
+
+// The interactive client has one session; each benchmark thread has its own
+ClientSession session;
+
+// Server commands in Opcode order; error, timeout, crash and invalid
+// simulate failures
+const char* const serverCommands[OP_COUNT] = {"ping", "stats", "error", "timeout", "crash", "invalid"};
 
-struct Message {
-    int status;
-    int client_id;
-    char data[256];
+// Transport settings (see parseArguments)
+TransportMode transportMode = TRANSPORT_MMAP;
+bool syncWrites = false;
+
+// How autoConnectToServer() chooses among running servers
+enum SelectionPolicy {
+    SELECT_P2C,      // less loaded of two random servers (default)
+    SELECT_LEAST,    // least loaded of all servers
+    SELECT_NEWEST    // highest server number
 };
 
-const char* SERVER_FILE_PREFIX = "ipc_server_";
-std::atomic<bool> running{true};
-int currentClientId = 0;
+SelectionPolicy selectionPolicy = SELECT_P2C;
+
+// CPUs for the client's threads (--cpus), round robin; empty = not pinned
+std::vector<int> clientCpus;
+
+// Remote gateway (host:port) to send commands to instead of a local server
+std::string gatewayAddress;
+
+// Benchmark settings (see parseArguments)
+enum BenchMode {
+    BENCH_CLOSED,   // next request goes out when the previous one is answered
+    BENCH_OPEN      // requests go out on a fixed schedule
+};
+
+bool benchEnabled = false;
+int benchThreads = 1;
+bool benchThreadsSet = false;   // --threads given; a replay defaults to one thread per recorded client
+int benchRequests = 1000;   // per thread
+int benchRate = 0;          // requests per second per thread, 0 = unpaced
+BenchMode benchMode = BENCH_CLOSED;
+int benchBatch = 1;         // pings per frame, 1 = one Message per ping
+int benchPipeline = 1;      // pings in flight per thread (IpcClient), 1 = synchronous
+bool benchReactor = false;  // all clients as coroutines on one thread (C++20 builds)
+bool benchBinary = true;    // binary requests if the server speaks them
+std::string benchServerFile;
+
+// Replay settings (see parseArguments)
+std::string replayFile;    // trace written by the server's --capture, empty = no replay
+double replaySpeed = 1.0;  // 1 = original timing, 2 = twice as fast, 0 = as fast as possible
 
 void signalHandler(int signum) {
     std::cout << "\nClient: Shutting down..." << std::endl;
     running = false;
 }
 
-bool readMessage(int fd, Message& msg) {
-    if (lseek(fd, 0, SEEK_SET) == -1) {
-        return false;
+// Function to parse command line options
+bool parseArguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        
+        if (arg.rfind("--transport=", 0) == 0) {
+            if (!parseTransportMode(arg.substr(strlen("--transport=")), transportMode)) {
+                std::cerr << "Client: Unknown transport: " << arg << std::endl;
+                return false;
+            }
+        } else if (arg == "--fsync") {
+            syncWrites = true;
+        } else if (arg.rfind("--wait=", 0) == 0) {
+            if (!parseWaitMode(arg.substr(strlen("--wait=")), waitPolicy.mode)) {
+                std::cerr << "Client: Unknown wait mode: " << arg << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--spin-us=", 0) == 0) {
+            waitPolicy.spinUs = std::atoi(arg.c_str() + strlen("--spin-us="));
+            if (waitPolicy.spinUs < 0 || waitPolicy.spinUs > 1000000) {
+                std::cerr << "Client: Spin time must be between 0 and 1000000 us" << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--priority=", 0) == 0) {
+            if (!parsePriority(arg.substr(strlen("--priority=")), requestPriority)) {
+                std::cerr << "Client: Unknown priority: " << arg << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--cpus=", 0) == 0) {
+            if (!parseCpuList(arg.substr(strlen("--cpus=")), clientCpus)) {
+                std::cerr << "Client: CPU list must look like 0-3,8 (CPUs below " << MAX_CPUS << ")" << std::endl;
+                return false;
+            }
+        } else if (arg == "--select=p2c") {
+            selectionPolicy = SELECT_P2C;
+        } else if (arg == "--select=least") {
+            selectionPolicy = SELECT_LEAST;
+        } else if (arg == "--select=newest") {
+            selectionPolicy = SELECT_NEWEST;
+        } else if (arg == "--bench") {
+            benchEnabled = true;
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            benchThreads = std::atoi(arg.c_str() + strlen("--threads="));
+            benchThreadsSet = true;
+        } else if (arg.rfind("--requests=", 0) == 0) {
+            benchRequests = std::atoi(arg.c_str() + strlen("--requests="));
+        } else if (arg.rfind("--rate=", 0) == 0) {
+            benchRate = std::atoi(arg.c_str() + strlen("--rate="));
+        } else if (arg == "--mode=closed") {
+            benchMode = BENCH_CLOSED;
+        } else if (arg == "--mode=open") {
+            benchMode = BENCH_OPEN;
+        } else if (arg.rfind("--batch=", 0) == 0) {
+            benchBatch = std::atoi(arg.c_str() + strlen("--batch="));
+        } else if (arg == "--reactor") {
+            benchReactor = true;
+        } else if (arg.rfind("--pipeline=", 0) == 0) {
+            benchPipeline = std::atoi(arg.c_str() + strlen("--pipeline="));
+        } else if (arg == "--protocol=binary") {
+            benchBinary = true;
+        } else if (arg == "--protocol=text") {
+            benchBinary = false;
+        } else if (arg.rfind("--replay=", 0) == 0) {
+            replayFile = arg.substr(strlen("--replay="));
+        } else if (arg.rfind("--speed=", 0) == 0) {
+            replaySpeed = std::strtod(arg.c_str() + strlen("--speed="), nullptr);
+            if (!(replaySpeed >= 0 && replaySpeed <= 1000)) {
+                std::cerr << "Client: Replay speed must be between 0 (as fast as possible) and 1000" << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--server=", 0) == 0) {
+            benchServerFile = arg.substr(strlen("--server="));
+        } else if (arg.rfind("--gateway=", 0) == 0) {
+            gatewayAddress = arg.substr(strlen("--gateway="));
+            std::string host;
+            int port = 0;
+            if (PLATFORM_WINDOWS || !parseHostPort(gatewayAddress, host, port)) {
+                std::cerr << "Client: Bad gateway address (or no network support): " << arg << std::endl;
+                return false;
+            }
+        } else {
+            std::cerr << "Usage: client [--transport=mmap|file|shm|uring] [--fsync] [--select=p2c|least|newest]"
+                      << " [--wait=block|hybrid|spin] [--spin-us=N] [--priority=high|normal|bulk] [--cpus=LIST]"
+                      << " [--gateway=HOST[:PORT]]"
+                      << std::endl;
+            std::cerr << "       client --bench [--threads=N] [--requests=M] [--rate=R]"
+                      << " [--mode=closed|open] [--batch=K] [--pipeline=P] [--reactor] [--protocol=binary|text] [--server=ipc_server_N.bin]"
+                      << std::endl;
+            std::cerr << "       client --replay=FILE [--speed=S] [--threads=N] [--server=ipc_server_N.bin]" << std::endl;
+            return false;
+        }
     }
     
-    int r = read(fd, &msg, sizeof(Message));
-    if (r == -1) {
+    if (benchThreads < 1 || benchThreads > 1024 || benchRequests < 1 || benchRate < 0 ||
+        benchBatch < 1 || benchBatch > static_cast<int>(BATCH_MAX_ENTRIES)) {
+        std::cerr << "Client: Benchmark needs 1-1024 threads, at least one request, a non-negative rate"
+                  << " and a batch size of 1-" << BATCH_MAX_ENTRIES << std::endl;
         return false;
     }
-    
-    if (r == 0) {
-        std::memset(&msg, 0, sizeof(Message));
-        return true;
+    if (benchPipeline < 1 || benchPipeline > RESPONSE_RING_DEPTH || (benchPipeline > 1 && benchBatch > 1)) {
+        std::cerr << "Client: Benchmark pipeline depth must be 1-" << RESPONSE_RING_DEPTH
+                  << " and cannot be combined with batches" << std::endl;
+        return false;
     }
-    
-    return (r == sizeof(Message));
-}
-
-bool writeMessage(int fd, Message& msg) {
-    if (lseek(fd, 0, SEEK_SET) == -1) {
+    if (benchReactor && (!IPC_HAVE_COROUTINES || benchBatch > 1 || benchPipeline > 1)) {
+        std::cerr << "Client: --reactor needs a build with C++20 coroutines and cannot be combined with"
+                  << " batches or pipelining" << std::endl;
         return false;
     }
-    
-    int w = write(fd, &msg, sizeof(Message));
-    if (w == -1) {
+    if (!gatewayAddress.empty() && (benchBatch > 1 || benchReactor || !benchServerFile.empty())) {
+        std::cerr << "Client: --gateway cannot be combined with batches, --reactor or --server" << std::endl;
         return false;
     }
-    
-    fsync(fd);
-    return (w == sizeof(Message));
+    if (!replayFile.empty() && (benchEnabled || benchBatch > 1 || benchPipeline > 1 || benchReactor ||
+                                !gatewayAddress.empty())) {
+        std::cerr << "Client: --replay cannot be combined with --bench, batches, pipelining, --reactor or --gateway"
+                  << std::endl;
+        return false;
+    }
+    if (benchEnabled && benchMode == BENCH_OPEN && benchRate == 0) {
+        std::cerr << "Client: Open-loop benchmark needs --rate=R" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Function to open a server file with the selected transport
+bool openServerChannel(const std::string& filename, IpcChannel& channel) {
+    return openServerFile(filename, channel, transportMode, syncWrites);
 }
 
 // Function to find all server files
 std::vector<std::string> findServerFiles() {
     std::vector<std::string> serverFiles;
     
-#if !PLATFORM_WINDOWS
-    DIR* dir = opendir(".");
-    if (dir) {
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != nullptr) {
-            std::string filename = entry->d_name;
-            if (filename.find(SERVER_FILE_PREFIX) == 0 && 
-                filename.find(".bin") != std::string::npos) {
-                serverFiles.push_back(filename);
-            }
+    for (const std::string& filename : listSharedFiles(transportMode)) {
+        if (filename.find(SERVER_FILE_PREFIX) == 0 && 
+            filename.find(".bin") != std::string::npos) {
+            serverFiles.push_back(filename);
         }
-        closedir(dir);
-    }
-#else
-    WIN32_FIND_DATA findFileData;
-    HANDLE hFind = FindFirstFile("*", &findFileData);
-    if (hFind != INVALID_HANDLE_VALUE) {
-        do {
-            std::string filename = findFileData.cFileName;
-            if (filename.find(SERVER_FILE_PREFIX) == 0 && 
-                filename.find(".bin") != std::string::npos) {
-                serverFiles.push_back(filename);
-            }
-        } while (FindNextFile(hFind, &findFileData) != 0);
-        FindClose(hFind);
     }
-#endif
     
     // Sort by number in filename
     std::sort(serverFiles.begin(), serverFiles.end(), [](const std::string& a, const std::string& b) {
@@ -132,112 +242,179 @@ std::vector<std::string> findServerFiles() {
 
 // Function to check server availability
 bool checkServerAvailability(const std::string& filename) {
-    int fd = open(filename.c_str(), O_RDWR);
-    if (fd == -1) {
+    IpcChannel channel;
+    if (!openServerChannel(filename, channel)) {
         return false;
     }
     
-    Message msg{};
-    bool available = false;
+    bool available = isServerAlive(channel);
     
-    if (readMessage(fd, msg)) {
-        available = (msg.status == 0 || msg.status == 2);
+    closeChannel(channel);
+    return available;
+}
+
+// Load a server publishes in its header
+struct ServerLoad {
+    int queueDepth = 0;
+    int inFlight = 0;
+    int latencyUs = 0;
+    int clientCount = 0;
+};
+
+// Function to read a server's load; false if it is not available
+bool readServerLoad(const std::string& filename, ServerLoad& load) {
+    IpcChannel channel;
+    if (!openServerChannel(filename, channel)) {
+        return false;
     }
     
-    close(fd);
+    bool available = isServerAlive(channel) &&
+                     loadWord(channel, QUEUE_DEPTH_OFFSET, load.queueDepth) &&
+                     loadWord(channel, IN_FLIGHT_OFFSET, load.inFlight) &&
+                     loadWord(channel, LATENCY_US_OFFSET, load.latencyUs) &&
+                     loadWord(channel, CLIENT_COUNT_OFFSET, load.clientCount);
+    
+    closeChannel(channel);
     return available;
 }
 
-// Function for automatic connection
-std::string autoConnectToServer() {
-    std::vector<std::string> serverFiles = findServerFiles();
-    std::vector<std::string> availableServers;
+// Outstanding work decides first; between idle servers the one with fewer
+// registered clients wins, since sessions are long-lived
+bool isLessLoaded(const ServerLoad& a, const ServerLoad& b) {
+    int busyA = a.queueDepth + a.inFlight;
+    int busyB = b.queueDepth + b.inFlight;
+    if (busyA != busyB) return busyA < busyB;
+    if (a.clientCount != b.clientCount) return a.clientCount < b.clientCount;
+    return a.latencyUs < b.latencyUs;
+}
+
+// Function to pick the least loaded of `candidates`; empty if none is available
+std::string leastLoadedServer(const std::vector<std::string>& candidates) {
+    std::string best;
+    ServerLoad bestLoad;
     
-    for (const auto& file : serverFiles) {
-        if (checkServerAvailability(file)) {
-            availableServers.push_back(file);
+    for (const auto& file : candidates) {
+        ServerLoad load;
+        if (readServerLoad(file, load) && (best.empty() || isLessLoaded(load, bestLoad))) {
+            best = file;
+            bestLoad = load;
         }
     }
-    
-    if (availableServers.empty()) {
-        std::cout << "No servers available." << std::endl;
-        return "";
+    return best;
+}
+
+// Function to read the NUMA node a server published; -1 if it did not
+// place itself or is not available
+int readServerNode(const std::string& filename) {
+    IpcChannel channel;
+    if (!openServerChannel(filename, channel)) {
+        return -1;
     }
     
-    // If only one server - connect to it
-    if (availableServers.size() == 1) {
-        return availableServers[0];
+    int node = -1;
+    if (!isServerAlive(channel) || !loadWord(channel, NUMA_NODE_OFFSET, node)) {
+        node = -1;
     }
     
-    // If multiple servers - connect to the latest one (with highest number)
-    return availableServers[0]; // Already sorted descending
+    closeChannel(channel);
+    return node;
 }
 
-// Function to check connection
-bool isConnectedToServer(const std::string& filename) {
-    int fd = open(filename.c_str(), O_RDWR);
-    if (fd == -1) {
-        return false;
+// Function to keep the candidates on NUMA node `node`, in their order.
+// Empty if none of them is there.
+std::vector<std::string> serversOnNode(const std::vector<std::string>& candidates, int node) {
+    std::vector<std::string> local;
+    if (node < 0 || candidates.size() < 2) {
+        return local;
     }
+    for (const auto& file : candidates) {
+        if (readServerNode(file) == node) {
+            local.push_back(file);
+        }
+    }
+    return local;
+}
+
+// Function to choose a server among `candidates` (sorted newest first).
+// Servers on the calling thread's NUMA node come first: a request to a
+// server on the other socket crosses the interconnect on the way there
+// and back. The policy picks among those, or among all if none is local.
+std::string selectServer(const std::vector<std::string>& allCandidates) {
+    std::vector<std::string> local = serversOnNode(allCandidates, currentNumaNode());
+    const std::vector<std::string>& candidates = local.empty() ? allCandidates : local;
     
-    Message msg{};
-    bool connected = false;
-    
-    if (readMessage(fd, msg) && msg.status == 0) {
-        Message testMsg{};
-        testMsg.status = 1;
-        testMsg.client_id = currentClientId;
-        std::strcpy(testMsg.data, "ping");
-        
-        if (writeMessage(fd, testMsg)) {
-            auto start = std::chrono::steady_clock::now();
-            
-            while (running) {
-                if (!readMessage(fd, msg)) {
-                    break;
-                }
-                
-                if (msg.status == 2) {
-                    connected = true;
-                    break;
-                }
-                
-                auto now = std::chrono::steady_clock::now();
-                if (std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count() > 500) {
-                    break;
-                }
-                
-                std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            }
-            
-            if (connected) {
-                msg.status = 0;
-                msg.client_id = currentClientId;
-                std::memset(msg.data, 0, sizeof(msg.data));
-                writeMessage(fd, msg);
+    if (selectionPolicy == SELECT_NEWEST) {
+        for (const auto& file : candidates) {
+            if (checkServerAvailability(file)) {
+                return file;
             }
         }
+        return "";
+    }
+    
+    if (selectionPolicy == SELECT_LEAST || candidates.size() <= 2) {
+        return leastLoadedServer(candidates);
+    }
+    
+    // Power of two choices: compare two random servers. Close to least
+    // loaded, but clients connecting together don't all pick the same one.
+    thread_local std::mt19937 random(std::random_device{}());
+    std::uniform_int_distribution<size_t> pick(0, candidates.size() - 1);
+    size_t first = pick(random);
+    size_t second = pick(random);
+    while (second == first) {
+        second = pick(random);
+    }
+    
+    std::string chosen = leastLoadedServer({candidates[first], candidates[second]});
+    return chosen.empty() ? leastLoadedServer(candidates) : chosen;
+}
+
+// Function for automatic connection
+std::string autoConnectToServer() {
+    std::vector<std::string> candidates;
+    
+    // With a registry the live servers come from one read of its table;
+    // the directory scan is only the fallback without one
+    IpcChannel registry;
+    if (openRegistry(registry, transportMode, false)) {
+        for (int number : liveServers(registry)) {
+            candidates.push_back(std::string(SERVER_FILE_PREFIX) + std::to_string(number) + ".bin");
+        }
+        closeChannel(registry);
+    } else {
+        candidates = findServerFiles();
     }
     
-    close(fd);
-    return connected;
+    std::string selected = selectServer(candidates);
+    if (selected.empty()) {
+        std::cout << "No servers available." << std::endl;
+    }
+    return selected;
 }
 
-// Function to display status
-void showConnectionStatus(const std::string& currentFile) {
+// Function to display status. Liveness comes from the server's heartbeat
+// in the header, so checking it sends no request.
+void showConnectionStatus(const std::string& currentFile, IpcChannel& channel) {
     if (currentFile.empty()) {
         std::cout << "Not connected to any server." << std::endl;
     } else {
         std::cout << "Connected to: " << currentFile << std::endl;
-        std::cout << "Client ID: " << (currentClientId > 0 ? std::to_string(currentClientId) : "not assigned") << std::endl;
+        std::cout << "Client ID: " << (session.clientId > 0 ? std::to_string(session.clientId) : "not assigned") << std::endl;
+        std::cout << "Response channel: " << (session.replyChannel > 0 ? std::to_string(session.replyChannel) : "shared slots") << std::endl;
         
-        if (!isConnectedToServer(currentFile)) {
+        if (!isServerAlive(channel)) {
             std::cout << "NO CONNECTED" << std::endl;
+        } else {
+            validateSession(channel, session);
+            if (session.clientId == 0) {
+                std::cout << "Session expired, a new one opens with the next request." << std::endl;
+            }
         }
     }
 }
 
-std::string getInputFromUser(const std::string& currentFile) {
+std::string getInputFromUser(const std::string& currentFile, IpcChannel& channel) {
     std::string input;
     while (true) {
         std::cout << "\nEnter command: ";
@@ -259,7 +436,7 @@ std::string getInputFromUser(const std::string& currentFile) {
         }
         
         if (lowerInput == "status") {
-            showConnectionStatus(currentFile);
+            showConnectionStatus(currentFile, channel);
             continue;
         }
         
@@ -271,8 +448,8 @@ std::string getInputFromUser(const std::string& currentFile) {
             return "DISCONNECT";
         }
         
-        if (lowerInput != "ping") {
-            std::cout << "Error: Only 'ping' is accepted." << std::endl;
+        if (std::find(std::begin(serverCommands), std::end(serverCommands), lowerInput) == std::end(serverCommands)) {
+            std::cout << "Error: Unknown command. Try ping, stats, error, timeout, crash or invalid." << std::endl;
             continue;
         }
         
@@ -285,20 +462,684 @@ std::string getInputFromUser(const std::string& currentFile) {
     }
 }
 
-int main() {
+// Function to open the interactive session and report the assigned ID
+void beginInteractiveSession(IpcChannel& channel) {
+    if (openSession(channel, session, 5000) == REQUEST_OK) {
+        std::cout << "Server assigned Client ID: " << session.clientId << std::endl;
+    } else {
+        std::cout << "Failed to open a session, retrying with the next request." << std::endl;
+    }
+}
+
+// Function to pin client thread `index` (benchmark and replay threads,
+// or the interactive one) to its --cpus entry, round robin
+void placeClientThread(size_t index) {
+    if (!clientCpus.empty() && !pinCurrentThread({clientCpus[index % clientCpus.size()]})) {
+        std::cerr << "Client: Cannot pin thread " << index << " to CPU " << clientCpus[index % clientCpus.size()]
+                  << std::endl;
+    }
+}
+
+// Results of one benchmark thread
+struct BenchResult {
+    LatencyHistogram latency;   // nanoseconds
+    uint64_t ok = 0;
+    uint64_t busy = 0;
+    uint64_t timeouts = 0;
+    uint64_t failed = 0;
+    bool connected = false;
+    std::string server;
+    // When the last request completed; teardown (joining threads, closing
+    // the session) is left out of the elapsed time
+    std::chrono::steady_clock::time_point finished{};
+};
+
+// Function to count the outcome of one round of `count` pings, `rejected`
+// of them refused by the server
+void recordOutcome(BenchResult& result, RequestResult outcome, int count, int rejected,
+                   std::chrono::steady_clock::time_point measuredFrom) {
+    switch (outcome) {
+        case REQUEST_OK: {
+            uint64_t latency = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - measuredFrom).count());
+            // Every ping of a batch waited for the whole round
+            for (int k = 0; k < count - rejected; k++) {
+                result.latency.record(latency);
+            }
+            result.ok += count - rejected;
+            result.failed += rejected;
+            break;
+        }
+        case REQUEST_BUSY:
+            result.busy += count;
+            break;
+        case REQUEST_TIMEOUT:
+            result.timeouts += count;
+            break;
+        default:
+            result.failed += count;
+            break;
+    }
+}
+
+// Function to run one benchmark client: its own channel and session, then
+// `benchRequests` pings. In open-loop mode latency is measured from the
+// scheduled send time, so a stalled server also shows up in the requests
+// that queued up behind it instead of just pausing the clock.
+void runBenchThread(const std::string& requestedFile, BenchResult& result) {
+    // Without --server every client picks its own server, like independent
+    // interactive clients would
+    std::string filename = requestedFile.empty() ? autoConnectToServer() : requestedFile;
+    IpcChannel channel;
+    if (filename.empty() || !openServerChannel(filename, channel)) {
+        return;
+    }
+    result.server = filename;
+    
+    // Open the session first so the timed requests all use the private channel
+    ClientSession client;
+    if (openSession(channel, client, 5000) != REQUEST_OK) {
+        closeChannel(channel);
+        return;
+    }
+    result.connected = true;
+    Message msg{};
+    
+    // With --batch=K every round sends K pings in batch frames, and the
+    // schedule advances by K requests per round
+    std::chrono::nanoseconds interval(benchRate > 0 ? 1000000000LL * benchBatch / benchRate : 0);
+    auto scheduled = std::chrono::steady_clock::now();
+    std::vector<std::string> commands;
+    std::vector<std::string> responses;
+    bool binary = benchBinary && client.protocol >= PROTOCOL_BINARY;
+    const std::string pingCommand = binary ? std::string(1, static_cast<char>(OP_PING)) : "ping";
+    
+    for (int i = 0; i < benchRequests && running; i += benchBatch) {
+        if (benchRate > 0) {
+            std::this_thread::sleep_until(scheduled);
+        }
+        auto sent = std::chrono::steady_clock::now();
+        auto measuredFrom = (benchMode == BENCH_OPEN) ? scheduled : sent;
+        scheduled += interval;
+        
+        int count = std::min(benchBatch, benchRequests - i);
+        RequestResult outcome;
+        int rejected = 0;
+        
+        if (benchBatch > 1) {
+            commands.assign(count, pingCommand);
+            outcome = exchangeBatch(channel, client, commands, responses, rejected, 5000, binary);
+        } else if (binary) {
+            outcome = exchangeBinary(channel, client, OP_PING, std::string_view(), msg, 5000);
+            if (outcome == REQUEST_OK) {
+                rejected = (msg.result == RESULT_OK) ? 0 : 1;
+                releaseMessageBody(channel, msg);
+            }
+        } else {
+            msg = Message{};
+            setMessageText(channel, msg, "ping");
+            outcome = exchangeMessage(channel, client, msg, 5000);
+            if (outcome == REQUEST_OK) {
+                releaseMessageBody(channel, msg);
+            }
+        }
+        
+        recordOutcome(result, outcome, count, rejected, measuredFrom);
+        
+        // A timeout can cost the session (e.g. server restart); open a new one
+        if (client.clientId == 0) {
+            openSession(channel, client, 5000);
+        }
+    }
+    
+    result.finished = std::chrono::steady_clock::now();
+    closeChannel(channel);
+}
+
+// Function to run one pipelined benchmark client: up to `benchPipeline`
+// pings in flight through an IpcClient, each timed from its own send (or
+// scheduled send) to its completion
+void runPipelinedBenchThread(const std::string& requestedFile, BenchResult& result) {
+    std::string filename = requestedFile.empty() ? autoConnectToServer() : requestedFile;
+    IpcClient client;
+    if (filename.empty() || !client.connect(filename, transportMode, syncWrites)) {
+        return;
+    }
+    result.server = filename;
+    result.connected = true;
+    bool binary = benchBinary && client.session().protocol >= PROTOCOL_BINARY;
+    
+    // Completions run on the client's receiver thread
+    std::mutex resultLock;
+    std::mutex windowLock;
+    std::condition_variable windowChanged;
+    int inFlight = 0;
+    
+    std::chrono::nanoseconds interval(benchRate > 0 ? 1000000000LL / benchRate : 0);
+    auto scheduled = std::chrono::steady_clock::now();
+    
+    for (int i = 0; i < benchRequests && running; i++) {
+        {
+            std::unique_lock<std::mutex> lock(windowLock);
+            windowChanged.wait(lock, [&]() { return inFlight < benchPipeline; });
+            inFlight++;
+        }
+        if (benchRate > 0) {
+            std::this_thread::sleep_until(scheduled);
+        }
+        auto sent = std::chrono::steady_clock::now();
+        auto measuredFrom = (benchMode == BENCH_OPEN) ? scheduled : sent;
+        scheduled += interval;
+        
+        auto done = [&, measuredFrom](IpcResponse& response) {
+            {
+                std::lock_guard<std::mutex> lock(resultLock);
+                if (response.status == REQUEST_OK && response.result == RESULT_OK) {
+                    result.latency.record(static_cast<uint64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - measuredFrom).count()));
+                    result.ok++;
+                } else if (response.status == REQUEST_BUSY) {
+                    result.busy++;
+                } else if (response.status == REQUEST_TIMEOUT) {
+                    result.timeouts++;
+                } else {
+                    result.failed++;
+                }
+            }
+            std::lock_guard<std::mutex> lock(windowLock);
+            inFlight--;
+            windowChanged.notify_one();
+        };
+        
+        if (binary) {
+            client.send(OP_PING, std::string_view(), done, 5000);
+        } else {
+            client.sendText("ping", done, 5000);
+        }
+    }
+    
+    client.drain();
+    result.finished = std::chrono::steady_clock::now();
+    client.close();
+}
+
+#if !PLATFORM_WINDOWS
+// Function to run one benchmark client through the gateway: its own TCP
+// connection with up to `benchPipeline` pings in flight, matched back to
+// their send time by sequence
+void runGatewayBenchThread(const std::string& /*requestedFile*/, BenchResult& result) {
+    std::string host;
+    int port = 0;
+    parseHostPort(gatewayAddress, host, port);
+    GatewayClient client;
+    if (!client.connect(host, port)) {
+        return;
+    }
+    result.server = gatewayAddress;
+    result.connected = true;
+    
+    std::unordered_map<int, std::chrono::steady_clock::time_point> inFlight;   // sequence -> measured from
+    std::chrono::nanoseconds interval(benchRate > 0 ? 1000000000LL / benchRate : 0);
+    auto scheduled = std::chrono::steady_clock::now();
+    int sent = 0;
+    
+    while (running && (sent < benchRequests || !inFlight.empty())) {
+        if (sent < benchRequests && static_cast<int>(inFlight.size()) < benchPipeline) {
+            if (benchRate > 0) {
+                std::this_thread::sleep_until(scheduled);
+            }
+            auto measuredFrom = (benchMode == BENCH_OPEN) ? scheduled : std::chrono::steady_clock::now();
+            scheduled += interval;
+            
+            uint32_t sequence = benchBinary ? client.send(OP_PING) : client.sendText("ping");
+            if (sequence == 0) {
+                break;
+            }
+            inFlight[static_cast<int>(sequence)] = measuredFrom;
+            sent++;
+            continue;
+        }
+        
+        IpcResponse response = client.receive();
+        auto found = inFlight.find(response.sequence);
+        if (found == inFlight.end()) {
+            if (!client.isConnected()) {
+                break;
+            }
+            continue;
+        }
+        recordOutcome(result, response.status, 1, response.result == RESULT_OK ? 0 : 1, found->second);
+        inFlight.erase(found);
+    }
+    
+    // Requests lost with the connection
+    result.failed += inFlight.size() + static_cast<uint64_t>(benchRequests - sent);
+    result.finished = std::chrono::steady_clock::now();
+}
+#endif
+
+#if IPC_HAVE_COROUTINES
+// Function to run one benchmark client as a coroutine (--reactor): the
+// same rounds as runBenchThread, one ping each, with every wait a
+// co_await so one thread drives all clients
+Task<void> runBenchSession(Reactor& reactor, IpcChannel& channel, BenchResult& result) {
+    ClientSession client;
+    if (co_await asyncOpenSession(reactor, channel, client, 5000) != REQUEST_OK) {
+        co_return;
+    }
+    result.connected = true;
+    Message msg{};
+    
+    std::chrono::nanoseconds interval(benchRate > 0 ? 1000000000LL / benchRate : 0);
+    auto scheduled = std::chrono::steady_clock::now();
+    bool binary = benchBinary && client.protocol >= PROTOCOL_BINARY;
+    
+    for (int i = 0; i < benchRequests && running; i++) {
+        if (benchRate > 0) {
+            co_await reactor.sleepUntil(scheduled);
+        }
+        auto sent = std::chrono::steady_clock::now();
+        auto measuredFrom = (benchMode == BENCH_OPEN) ? scheduled : sent;
+        scheduled += interval;
+        
+        RequestResult outcome;
+        int rejected = 0;
+        if (binary) {
+            outcome = co_await asyncExchangeBinary(reactor, channel, client, OP_PING, std::string_view(), msg, 5000);
+            if (outcome == REQUEST_OK) {
+                rejected = (msg.result == RESULT_OK) ? 0 : 1;
+            }
+        } else {
+            msg = Message{};
+            setMessageText(channel, msg, "ping");
+            outcome = co_await asyncExchangeMessage(reactor, channel, client, msg, 5000);
+        }
+        if (outcome == REQUEST_OK) {
+            releaseMessageBody(channel, msg);
+        }
+        recordOutcome(result, outcome, 1, rejected, measuredFrom);
+        
+        if (client.clientId == 0) {
+            co_await asyncOpenSession(reactor, channel, client, 5000);
+        }
+    }
+    result.finished = std::chrono::steady_clock::now();
+}
+
+// Function to run every benchmark client on one reactor thread. Clients
+// on the same server share its mapping.
+void runReactorBench(const std::string& requestedFile, std::vector<BenchResult>& results) {
+    std::map<std::string, IpcChannel> channels;
+    Reactor reactor(running);
+    
+    for (auto& result : results) {
+        std::string filename = requestedFile.empty() ? autoConnectToServer() : requestedFile;
+        if (filename.empty()) {
+            continue;
+        }
+        if (channels.find(filename) == channels.end() && !openServerChannel(filename, channels[filename])) {
+            channels.erase(filename);
+            continue;
+        }
+        result.server = filename;
+        reactor.spawn(runBenchSession(reactor, channels[filename], result));
+    }
+    reactor.run();
+    
+    for (auto& entry : channels) {
+        closeChannel(entry.second);
+    }
+}
+#endif
+
+// Function to measure a benchmark (or replay) run from `start` to the
+// last request any thread completed
+double benchElapsed(const std::vector<BenchResult>& results, std::chrono::steady_clock::time_point start) {
+    auto finished = start;
+    for (const auto& result : results) {
+        finished = std::max(finished, result.finished);
+    }
+    return std::chrono::duration<double>(finished - start).count();
+}
+
+// Function to print the combined report of the benchmark (or replay)
+// threads. Returns the exit code: 0 if every thread connected and some
+// requests were answered.
+int printBenchReport(const std::vector<BenchResult>& results, double elapsed) {
+    BenchResult total;
+    int connected = 0;
+    std::map<std::string, int> clientsPerServer;
+    for (const auto& result : results) {
+        if (result.connected) {
+            clientsPerServer[result.server]++;
+        }
+        total.latency.merge(result.latency);
+        total.ok += result.ok;
+        total.busy += result.busy;
+        total.timeouts += result.timeouts;
+        total.failed += result.failed;
+        connected += result.connected ? 1 : 0;
+    }
+    
+    const LatencyHistogram& latency = total.latency;
+    char report[512];
+    std::snprintf(report, sizeof(report),
+                  "Clients connected: %d/%d\n"
+                  "Requests: %llu ok, %llu busy, %llu timeout, %llu failed\n"
+                  "Elapsed: %.3f s, throughput: %.0f req/s\n"
+                  "Latency (us): min %.1f  mean %.1f  p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f",
+                  connected, static_cast<int>(results.size()),
+                  static_cast<unsigned long long>(total.ok), static_cast<unsigned long long>(total.busy),
+                  static_cast<unsigned long long>(total.timeouts), static_cast<unsigned long long>(total.failed),
+                  elapsed, elapsed > 0 ? total.ok / elapsed : 0.0,
+                  latency.min() / 1000.0, latency.mean() / 1000.0,
+                  latency.percentile(50) / 1000.0, latency.percentile(99) / 1000.0,
+                  latency.percentile(99.9) / 1000.0, latency.max() / 1000.0);
+    std::cout << report << std::endl;
+    
+    if (clientsPerServer.size() > 1) {
+        std::cout << "Clients per server:";
+        for (const auto& entry : clientsPerServer) {
+            std::cout << " " << entry.first << "=" << entry.second;
+        }
+        std::cout << std::endl;
+    }
+    
+    return (connected == static_cast<int>(results.size()) && total.ok > 0) ? 0 : 1;
+}
+
+// Function to run the benchmark and print the report
+int runBenchmark() {
+    const std::string& filename = benchServerFile;
+    if (!filename.empty() && !checkServerAvailability(filename)) {
+        std::cerr << "Client: Server not available: " << filename << std::endl;
+        return 1;
+    }
+    
+    std::cout << "Benchmark: " << benchThreads << " threads x " << benchRequests << " pings"
+              << (benchBatch > 1 ? " in batches of " + std::to_string(benchBatch) : "")
+              << (benchPipeline > 1 ? ", " + std::to_string(benchPipeline) + " in flight" : "")
+              << (benchReactor ? " on one reactor thread" : "") << " against "
+              << (!gatewayAddress.empty() ? "gateway " + gatewayAddress : filename.empty() ? "selected servers" : filename)
+              << " ("<< (benchMode == BENCH_OPEN ? "open" : "closed") << " loop, "
+              << (benchRate > 0 ? std::to_string(benchRate) + " req/s per thread" : "unpaced")
+              << (benchBinary ? ", binary" : ", text") << " protocol)" << std::endl;
+    
+    std::vector<BenchResult> results(benchThreads);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    
+#if IPC_HAVE_COROUTINES
+    if (benchReactor) {
+        threads.emplace_back([&filename, &results]() {
+            placeClientThread(0);
+            runReactorBench(filename, results);
+        });
+    }
+#endif
+    auto benchThread = benchPipeline > 1 ? runPipelinedBenchThread : runBenchThread;
+#if !PLATFORM_WINDOWS
+    if (!gatewayAddress.empty()) {
+        benchThread = runGatewayBenchThread;
+    }
+#endif
+    for (int i = 0; i < benchThreads && !benchReactor; i++) {
+        threads.emplace_back([&filename, &results, benchThread, i]() {
+            placeClientThread(static_cast<size_t>(i));
+            benchThread(filename, results[i]);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    
+    return printBenchReport(results, benchElapsed(results, start));
+}
+
+// Function to replay the recorded requests of one or more clients on one
+// session, each sent at its recorded arrival time scaled by --speed. As in
+// an open-loop benchmark, latency is measured from the scheduled time, so
+// a server that falls behind the recorded pace shows up in the latency of
+// the requests queued behind it. Hellos are not replayed (the session is
+// opened up front), and a batch goes out as the same number of pings.
+void runReplayThread(const std::string& requestedFile, const std::vector<TraceRecord>& records,
+                     std::chrono::steady_clock::time_point start, BenchResult& result) {
+    std::string filename = requestedFile.empty() ? autoConnectToServer() : requestedFile;
+    IpcChannel channel;
+    if (filename.empty() || !openServerChannel(filename, channel)) {
+        return;
+    }
+    result.server = filename;
+    
+    ClientSession client;
+    if (openSession(channel, client, 5000) != REQUEST_OK) {
+        closeChannel(channel);
+        return;
+    }
+    result.connected = true;
+    Message msg{};
+    std::vector<std::string> commands;
+    std::vector<std::string> responses;
+    
+    for (const TraceRecord& record : records) {
+        if (!running) {
+            break;
+        }
+        auto measuredFrom = std::chrono::steady_clock::now();
+        if (replaySpeed > 0) {
+            measuredFrom = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double, std::nano>(record.arrivalNs / replaySpeed));
+            std::this_thread::sleep_until(measuredFrom);
+        }
+        
+        // Recorded in the binary encoding: replayed in it if the server speaks it
+        bool binary = (record.flags & TRACE_BINARY) && client.protocol >= PROTOCOL_BINARY;
+        int count = 1;
+        int rejected = 0;
+        RequestResult outcome;
+        
+        if (record.type == MESSAGE_BATCH) {
+            count = std::max<int>(1, record.entries);
+            commands.assign(count, binary ? std::string(1, static_cast<char>(OP_PING)) : "ping");
+            outcome = exchangeBatch(channel, client, commands, responses, rejected, 5000, binary);
+        } else if (binary) {
+            outcome = exchangeBinary(channel, client, static_cast<Opcode>(record.opcode), std::string_view(), msg, 5000);
+            if (outcome == REQUEST_OK) {
+                rejected = (msg.result == RESULT_OK) ? 0 : 1;
+                releaseMessageBody(channel, msg);
+            }
+        } else {
+            msg = Message{};
+            setMessageText(channel, msg, record.opcode < OP_COUNT ? serverCommands[record.opcode] : "unknown");
+            outcome = exchangeMessage(channel, client, msg, 5000);
+            if (outcome == REQUEST_OK) {
+                releaseMessageBody(channel, msg);
+            }
+        }
+        
+        recordOutcome(result, outcome, count, rejected, measuredFrom);
+        
+        if (client.clientId == 0) {
+            openSession(channel, client, 5000);
+        }
+    }
+    
+    result.finished = std::chrono::steady_clock::now();
+    closeChannel(channel);
+}
+
+// Function to replay a captured trace (--replay) and print the report.
+// Every recorded client stays on one replay thread, so its requests keep
+// their order; with fewer threads than clients (--threads) a thread
+// replays several clients one request at a time.
+int runReplay() {
+    const std::string& filename = benchServerFile;
+    if (!filename.empty() && !checkServerAvailability(filename)) {
+        std::cerr << "Client: Server not available: " << filename << std::endl;
+        return 1;
+    }
+    
+    std::vector<TraceRecord> trace;
+    if (!loadTrace(replayFile, trace)) {
+        std::cerr << "Client: Cannot read trace file: " << replayFile << std::endl;
+        return 1;
+    }
+    trace.erase(std::remove_if(trace.begin(), trace.end(),
+                               [](const TraceRecord& record) { return record.type == MESSAGE_HELLO; }),
+                trace.end());
+    std::stable_sort(trace.begin(), trace.end(), [](const TraceRecord& a, const TraceRecord& b) {
+        return a.arrivalNs < b.arrivalNs;
+    });
+    if (trace.empty()) {
+        std::cerr << "Client: Trace file has no requests to replay: " << replayFile << std::endl;
+        return 1;
+    }
+    
+    // The replay starts with the first request, not with the capture
+    uint64_t origin = trace.front().arrivalNs;
+    for (TraceRecord& record : trace) {
+        record.arrivalNs -= origin;
+    }
+    
+    // Recorded clients in order of their first request, dealt out to the threads
+    std::unordered_map<int, size_t> clientIndex;
+    LatencyHistogram recorded;
+    for (const TraceRecord& record : trace) {
+        clientIndex.emplace(record.clientId, clientIndex.size());
+        recorded.record(static_cast<uint64_t>(record.serviceUs) * 1000);
+    }
+    size_t threadCount = benchThreadsSet ? static_cast<size_t>(benchThreads)
+                                         : std::min<size_t>(clientIndex.size(), 1024);
+    std::vector<std::vector<TraceRecord>> perThread(threadCount);
+    for (const TraceRecord& record : trace) {
+        perThread[clientIndex[record.clientId] % threadCount].push_back(record);
+    }
+    
+    char pace[64];
+    if (replaySpeed == 0) {
+        std::snprintf(pace, sizeof(pace), "as fast as possible");
+    } else if (replaySpeed == 1) {
+        std::snprintf(pace, sizeof(pace), "original timing");
+    } else {
+        std::snprintf(pace, sizeof(pace), "%gx speed", replaySpeed);
+    }
+    std::cout << "Replay: " << trace.size() << " requests of " << clientIndex.size() << " clients over "
+              << trace.back().arrivalNs / 1e9 << " s from " << replayFile << " on " << threadCount
+              << " threads against " << (filename.empty() ? "selected servers" : filename) << " (" << pace << ")"
+              << std::endl;
+    
+    std::vector<BenchResult> results(threadCount);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < threadCount; i++) {
+        threads.emplace_back([&filename, &perThread, &results, start, i]() {
+            placeClientThread(i);
+            runReplayThread(filename, perThread[i], start, results[i]);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    
+    int status = printBenchReport(results, benchElapsed(results, start));
+    
+    char line[160];
+    std::snprintf(line, sizeof(line), "Recorded service (us): p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f",
+                  recorded.percentile(50) / 1000.0, recorded.percentile(99) / 1000.0,
+                  recorded.percentile(99.9) / 1000.0, recorded.max() / 1000.0);
+    std::cout << line << std::endl;
+    return status;
+}
+
+#if !PLATFORM_WINDOWS
+// Function to run the interactive client against a gateway: commands go
+// out as text frames and the gateway forwards them to its server
+int runRemoteSession() {
+    std::string host;
+    int port = 0;
+    parseHostPort(gatewayAddress, host, port);
+    GatewayClient gateway;
+    if (!gateway.connect(host, port)) {
+        std::cout << "Failed to connect to gateway " << gatewayAddress << "." << std::endl;
+        return 1;
+    }
+    std::cout << "Connected to gateway: " << gatewayAddress << std::endl;
+    
+    while (running) {
+        std::cout << "\nEnter command: ";
+        std::string input;
+        if (!std::getline(std::cin, input)) {
+            break;
+        }
+        if (input.empty()) {
+            std::cout << "Enter not empty command";
+            continue;
+        }
+        
+        std::string lowerInput = input;
+        std::transform(lowerInput.begin(), lowerInput.end(), lowerInput.begin(),
+                      [](unsigned char c){ return std::tolower(c); });
+        if (lowerInput == "exit") {
+            break;
+        }
+        
+        // A timeout drops the connection; the next command opens a new one
+        if (!gateway.isConnected() && !gateway.connect(host, port)) {
+            std::cout << "Gateway is not reachable." << std::endl;
+            continue;
+        }
+        
+        IpcResponse response = gateway.exchangeText(input);
+        if (response.status == REQUEST_BUSY) {
+            std::cout << "Server is busy." << std::endl;
+        } else if (response.status == REQUEST_TIMEOUT) {
+            std::cout << "Timeout waiting for response." << std::endl;
+        } else if (response.status != REQUEST_OK) {
+            std::cout << "Failed to send ping." << std::endl;
+        } else {
+            std::cout << "Response: " << (response.body.empty() ? "(empty)" : response.body) << std::endl;
+        }
+    }
+    
+    std::cout << "Client stopped." << std::endl;
+    return 0;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+    if (!parseArguments(argc, argv)) {
+        return 1;
+    }
+    
     signal(SIGINT, signalHandler);
     signal(SIGTERM, signalHandler);
     
+    if (benchEnabled) {
+        return runBenchmark();
+    }
+    if (!replayFile.empty()) {
+        return runReplay();
+    }
+#if !PLATFORM_WINDOWS
+    if (!gatewayAddress.empty()) {
+        return runRemoteSession();
+    }
+#endif
+    
+    placeClientThread(0);   // the interactive session runs on the main thread
+    
     std::string currentFile;
-    int fd = -1;
+    IpcChannel channel;
     
     // Automatic connection on startup
     currentFile = autoConnectToServer();
     
     if (!currentFile.empty()) {
-        fd = open(currentFile.c_str(), O_RDWR);
-        if (fd != -1) {
+        if (openServerChannel(currentFile, channel)) {
             std::cout << "Connected to: " << currentFile << std::endl;
+            beginInteractiveSession(channel);
         } else {
             std::cout << "Failed to connect." << std::endl;
             currentFile = "";
@@ -306,37 +1147,33 @@ int main() {
     }
     
     while (running) {
-        std::string command = getInputFromUser(currentFile);
+        std::string command = getInputFromUser(currentFile, channel);
         
         if (!running) break;
         
         if (command == "CONNECT") {
-            if (fd != -1) {
-                close(fd);
-                fd = -1;
-            }
+            closeChannel(channel);
             
             std::string newFile = autoConnectToServer();
             if (!newFile.empty()) {
-                fd = open(newFile.c_str(), O_RDWR);
-                if (fd != -1) {
+                if (openServerChannel(newFile, channel)) {
                     currentFile = newFile;
-                    currentClientId = 0;
+                    session = ClientSession();
                     std::cout << "Connected to: " << currentFile << std::endl;
+                    beginInteractiveSession(channel);
                 } else {
                     std::cout << "Failed to connect." << std::endl;
                     currentFile = "";
-                    currentClientId = 0;
+                    session = ClientSession();
                 }
             }
             continue;
         }
         
         if (command == "DISCONNECT") {
-            if (fd != -1) {
-                close(fd);
-                fd = -1;
-                currentClientId = 0;
+            if (isChannelOpen(channel)) {
+                closeChannel(channel);
+                session = ClientSession();
                 std::cout << "Disconnected." << std::endl;
             }
             currentFile = "";
@@ -347,102 +1184,50 @@ int main() {
             continue;
         }
         
+        // The session may have been lost (the server restarted, or expired
+        // it while we were idle)
+        validateSession(channel, session);
+        if (session.clientId == 0) {
+            beginInteractiveSession(channel);
+        }
+        
         // Sending ping
         Message msg{};
-        int waitAttempts = 0;
-        const int MAX_WAIT_ATTEMPTS = 5;
-        
-        // Wait until server is free
-        while (running && waitAttempts < MAX_WAIT_ATTEMPTS) {
-            if (!readMessage(fd, msg)) {
-                break;
-            }
-            
-            if (msg.status == 0) {
-                break;
-            }
-            
-            waitAttempts++;
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (!setMessageText(channel, msg, command)) {
+            std::cout << "Error: Message is too large." << std::endl;
+            continue;
         }
         
-        if (waitAttempts >= MAX_WAIT_ATTEMPTS) {
+        RequestResult result = exchangeMessage(channel, session, msg, 5000);
+        
+        if (result == REQUEST_BUSY) {
             std::cout << "Server is busy." << std::endl;
             continue;
         }
         
-        // Send message
-        std::memset(&msg, 0, sizeof(Message));
-        msg.status = 1;
-        msg.client_id = currentClientId;
-        std::strncpy(msg.data, command.c_str(), sizeof(msg.data) - 1);
-        msg.data[sizeof(msg.data) - 1] = '\0';
-        
-        if (!writeMessage(fd, msg)) {
-            std::cout << "Failed to send ping." << std::endl;
+        if (result == REQUEST_TIMEOUT) {
+            std::cout << "Timeout waiting for response." << std::endl;
             continue;
         }
         
-        // Wait for response
-        bool timeout = false;
-        bool gotResponse = false;
-        auto start = std::chrono::steady_clock::now();
-        
-        while (running && !timeout && !gotResponse) {
-            if (!readMessage(fd, msg)) {
-                break;
-            }
-            
-            if (msg.status == 2) {
-                gotResponse = true;
-                
-                if (msg.client_id > 0 && currentClientId == 0) {
-                    currentClientId = msg.client_id;
-                    std::cout << "Server assigned Client ID: " << currentClientId << std::endl;
-                }
-                break;
-            }
-            
-            auto now = std::chrono::steady_clock::now();
-            if (std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count() > 5000) {
-                timeout = true;
-                break;
+        if (result != REQUEST_OK) {
+            if (running && !isServerAlive(channel)) {
+                std::cout << "Server is no longer running." << std::endl;
+            } else if (running) {
+                std::cout << "Failed to send ping." << std::endl;
             }
-            
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        }
-        
-        if (timeout) {
-            std::cout << "Timeout waiting for response." << std::endl;
-            
-            // Reset status
-            msg.status = 0;
-            msg.client_id = currentClientId;
-            std::memset(msg.data, 0, sizeof(msg.data));
-            writeMessage(fd, msg);
             continue;
         }
         
-        if (gotResponse && msg.data[0] != '\0') {
-            std::cout << "Response: " << msg.data << std::endl;
+        char scratch[OVERFLOW_CHUNK_SIZE];
+        std::string_view response;
+        if (messageBody(channel, msg, scratch, response)) {
+            std::cout << "Response: " << (response.empty() ? "(empty)" : response) << std::endl;
         }
-        
-        // Free the server
-        msg.status = 0;
-        msg.client_id = currentClientId;
-        std::memset(msg.data, 0, sizeof(msg.data));
-        writeMessage(fd, msg);
+        releaseMessageBody(channel, msg);
     }
     
-    
-    if (fd != -1) {
-        Message resetMsg{};
-        resetMsg.status = 0;
-        resetMsg.client_id = currentClientId;
-        std::memset(resetMsg.data, 0, sizeof(resetMsg.data));
-        writeMessage(fd, resetMsg);
-        close(fd);
-    }
+    closeChannel(channel);
     
     std::cout << "Client stopped." << std::endl;
     
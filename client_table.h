@@ -0,0 +1,215 @@
+#ifndef CLIENT_TABLE_H
+#define CLIENT_TABLE_H
+
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Sessions of the server's clients, looked up on every request. The table
+// is a fixed array indexed by client ID: ID n lives in entry
+// (n - 1) % capacity, so an entry is reused by IDs a capacity apart and
+// the ID itself tells the generations of an entry apart. IDs come from an
+// atomic counter that starts over at 1 when it runs out of positive
+// values; an ID whose entry is still taken is skipped.
+//
+// Lookups take no lock. An entry's identity word packs client ID and
+// session token; a reader checks it before and after reading the response
+// channel, so an entry that was expired and reused in between is never
+// taken for the old session. Idle sessions are expired by a sweep, which
+// keeps memory at `capacity` entries however many clients come and go;
+// that includes each session's request count, which lives in its entry.
+class ClientTable {
+public:
+    // Function to size the table; `capacity` is rounded up to a power of two
+    void reset(size_t capacity) {
+        capacity_ = 1;
+        while (capacity_ < capacity) {
+            capacity_ <<= 1;
+        }
+        entries_ = std::make_unique<Entry[]>(capacity_);
+        nextId_ = 1;
+        live_ = 0;
+        sweepCursor_ = 0;
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    // Number of sessions currently in the table
+    int liveCount() const {
+        return live_.load(std::memory_order_relaxed);
+    }
+
+    // Function to find the session (`clientId`, `sessionToken`) and its
+    // response channel. Refreshes the session's idle timer.
+    bool find(int clientId, int sessionToken, int now, int& replyChannel) {
+        if (clientId <= 0 || entries_ == nullptr) {
+            return false;
+        }
+        Entry& entry = entryFor(clientId);
+        uint64_t identity = packIdentity(clientId, sessionToken);
+        if (entry.identity.load() != identity) {
+            return false;
+        }
+        int channel = entry.replyChannel.load();
+        if (elapsedMs(now, entry.lastSeen.load(std::memory_order_relaxed)) >= TOUCH_INTERVAL_MS) {
+            entry.lastSeen.store(now, std::memory_order_relaxed);
+        }
+        if (entry.identity.load() != identity) {
+            return false;
+        }
+        replyChannel = channel;
+        return true;
+    }
+
+    // Function to take a new client ID; publish() makes its session visible.
+    // If every entry holds a live session, the one in the way is evicted and
+    // returned in `evictedChannel` (0 = none) for the caller to recycle.
+    int allocate(int now, int& evictedId, int& evictedChannel) {
+        evictedId = 0;
+        evictedChannel = 0;
+        for (size_t attempt = 0;; attempt++) {
+            int clientId = nextId_.fetch_add(1);
+            if (clientId <= 0) {
+                // The counter wrapped (atomic arithmetic wraps, it does not
+                // overflow): whoever sees the first negative value resets it
+                int expected = clientId + 1;
+                nextId_.compare_exchange_strong(expected, 1);
+                continue;
+            }
+            Entry& entry = entryFor(clientId);
+            uint64_t current = entry.identity.load();
+            if (current == CLAIMING) {
+                continue;
+            }
+            if (current != 0 && attempt < capacity_) {
+                continue;   // still live; try the next ID before evicting
+            }
+            if (!entry.identity.compare_exchange_strong(current, CLAIMING)) {
+                continue;
+            }
+            if (current != 0) {
+                evictedId = static_cast<int>(current >> 32);
+                evictedChannel = entry.replyChannel.load();
+                live_.fetch_sub(1);
+            }
+            entry.lastSeen.store(now, std::memory_order_relaxed);
+            return clientId;
+        }
+    }
+
+    // Function to make the session of an allocated ID visible to find()
+    void publish(int clientId, int sessionToken, int replyChannel) {
+        Entry& entry = entryFor(clientId);
+        entry.replyChannel.store(replyChannel);
+        entry.requests.store(0, std::memory_order_relaxed);
+        entry.identity.store(packIdentity(clientId, sessionToken));
+        live_.fetch_add(1);
+    }
+
+    // Function to re-create a session handed over by a previous server
+    // (the server file's response channels remember them). IDs allocated
+    // later start above it. Returns false if its entry is taken.
+    bool adopt(int clientId, int sessionToken, int replyChannel, int now) {
+        if (clientId <= 0 || clientId == INT_MAX) {
+            return false;
+        }
+        Entry& entry = entryFor(clientId);
+        uint64_t expected = 0;
+        if (!entry.identity.compare_exchange_strong(expected, CLAIMING)) {
+            return false;
+        }
+        entry.lastSeen.store(now, std::memory_order_relaxed);
+        publish(clientId, sessionToken, replyChannel);
+        
+        int next = nextId_.load();
+        while (next <= clientId && !nextId_.compare_exchange_weak(next, clientId + 1)) {
+        }
+        return true;
+    }
+
+    // Function to count an answered request of `clientId`. Requests of a
+    // session that has been expired or evicted meanwhile are not counted.
+    void countRequest(int clientId) {
+        if (clientId <= 0 || entries_ == nullptr) {
+            return;
+        }
+        Entry& entry = entryFor(clientId);
+        if (static_cast<int>(entry.identity.load(std::memory_order_relaxed) >> 32) == clientId) {
+            entry.requests.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Function to call `visit(clientId, requests)` for every live session
+    template <typename Visitor>
+    void forEachSession(Visitor&& visit) const {
+        for (size_t i = 0; i < capacity_; i++) {
+            const Entry& entry = entries_[i];
+            uint64_t current = entry.identity.load(std::memory_order_relaxed);
+            if (current != 0 && current != CLAIMING) {
+                visit(static_cast<int>(current >> 32), entry.requests.load(std::memory_order_relaxed));
+            }
+        }
+    }
+
+    // Function to expire sessions idle for `idleMs` or longer, looking at up
+    // to `budget` entries from where the previous sweep stopped. Calls
+    // `expired(clientId, replyChannel, requests)` for each, and drops the
+    // session's request count with it. One sweeper at a time.
+    template <typename Callback>
+    void expireIdle(int now, int idleMs, size_t budget, Callback&& expired) {
+        for (size_t i = 0; i < budget && i < capacity_; i++) {
+            Entry& entry = entries_[sweepCursor_];
+            sweepCursor_ = (sweepCursor_ + 1) & (capacity_ - 1);
+
+            uint64_t current = entry.identity.load();
+            if (current == 0 || current == CLAIMING ||
+                elapsedMs(now, entry.lastSeen.load(std::memory_order_relaxed)) < idleMs) {
+                continue;
+            }
+            int channel = entry.replyChannel.load();
+            if (entry.identity.compare_exchange_strong(current, 0)) {
+                live_.fetch_sub(1);
+                expired(static_cast<int>(current >> 32), channel,
+                        entry.requests.exchange(0, std::memory_order_relaxed));
+            }
+        }
+    }
+
+private:
+    // lastSeen is written at most this often, so steady traffic from a
+    // client does not keep dirtying its entry
+    static constexpr int TOUCH_INTERVAL_MS = 1000;
+    static constexpr uint64_t CLAIMING = ~0ull;   // identity while allocate() fills the entry in
+
+    struct Entry {
+        std::atomic<uint64_t> identity{0};   // client ID << 32 | session token, 0 = free
+        std::atomic<int> replyChannel{0};
+        std::atomic<int> lastSeen{0};        // heartbeatClockMs() of the last lookup
+        std::atomic<uint64_t> requests{0};   // answered requests of the session, for stats
+    };
+
+    // heartbeatClockMs() wraps, so times are compared by their unsigned difference
+    static int32_t elapsedMs(int now, int since) {
+        return static_cast<int32_t>(static_cast<uint32_t>(now) - static_cast<uint32_t>(since));
+    }
+
+    static uint64_t packIdentity(int clientId, int sessionToken) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(clientId)) << 32) | static_cast<uint32_t>(sessionToken);
+    }
+
+    Entry& entryFor(int clientId) {
+        return entries_[static_cast<size_t>(clientId - 1) & (capacity_ - 1)];
+    }
+
+    std::unique_ptr<Entry[]> entries_;
+    size_t capacity_ = 0;
+    std::atomic<int> nextId_{1};
+    std::atomic<int> live_{0};
+    size_t sweepCursor_ = 0;
+};
+
+#endif
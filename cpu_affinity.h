@@ -0,0 +1,175 @@
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include "ipc_common.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#endif
+
+// Thread and memory placement on NUMA machines. A dual-socket host has one
+// node per socket: memory on the other node, or a peer thread on the other
+// socket, puts an interconnect crossing on every access. Threads can be
+// pinned on Linux and Windows; memory is placed on Linux only (elsewhere
+// pages come from the node of the thread that touches them first). Node
+// -1 means unknown, which is what the queries return without NUMA support.
+const int MAX_CPUS = 1024;
+const int MAX_NUMA_NODES = 64;
+
+#if defined(__linux__)
+// Node bit mask of the memory policy calls. The kernel reads `maxnode` - 1
+// bits of it, hence the extra bit passed with it.
+struct NodeMask {
+    static constexpr size_t WORD_BITS = 8 * sizeof(unsigned long);
+    unsigned long words[MAX_NUMA_NODES / WORD_BITS] = {};
+
+    explicit NodeMask(int node) {
+        words[node / WORD_BITS] = 1ul << (node % WORD_BITS);
+    }
+};
+#endif
+
+// Function to parse a CPU list such as "0-3,8,10-11" (the format of
+// taskset and /sys). Returns false if it is malformed or empty.
+inline bool parseCpuList(const std::string& text, std::vector<int>& cpus) {
+    cpus.clear();
+    const char* position = text.c_str();
+    while (*position != '\0') {
+        char* end = nullptr;
+        long first = std::strtol(position, &end, 10);
+        if (end == position || first < 0) {
+            return false;
+        }
+        long last = first;
+        position = end;
+        if (*position == '-') {
+            last = std::strtol(position + 1, &end, 10);
+            if (end == position + 1 || last < first) {
+                return false;
+            }
+            position = end;
+        }
+        if (last >= MAX_CPUS) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+
+        if (*position == ',') {
+            position++;
+        } else if (*position != '\0') {
+            return false;
+        }
+    }
+    return !cpus.empty();
+}
+
+// Function to restrict the calling thread to `cpus`. Threads it starts
+// afterwards inherit the restriction on Linux.
+inline bool pinCurrentThread(const std::vector<int>& cpus) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif PLATFORM_WINDOWS
+    DWORD_PTR mask = 0;
+    for (int cpu : cpus) {
+        if (cpu >= static_cast<int>(sizeof(mask) * 8)) {
+            return false;   // beyond the first processor group
+        }
+        mask |= static_cast<DWORD_PTR>(1) << cpu;
+    }
+    return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+// Function to find the NUMA node of `cpu`, -1 if unknown
+inline int numaNodeOfCpu(int cpu) {
+#if defined(__linux__)
+    // /sys/devices/system/cpu/cpuN holds a nodeM link to its node
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        return -1;
+    }
+    int node = -1;
+    struct dirent* entry;
+    while (node < 0 && (entry = readdir(dir)) != nullptr) {
+        if (std::sscanf(entry->d_name, "node%d", &node) != 1) {
+            node = -1;
+        }
+    }
+    closedir(dir);
+    return node;
+#elif PLATFORM_WINDOWS
+    UCHAR node = 0;
+    return (cpu < 256 && GetNumaProcessorNode(static_cast<UCHAR>(cpu), &node)) ? static_cast<int>(node) : -1;
+#else
+    (void)cpu;
+    return -1;
+#endif
+}
+
+// Function to find the NUMA node the calling thread is running on, -1 if
+// unknown. An unpinned thread may be moved right after the call.
+inline int currentNumaNode() {
+#if defined(__linux__)
+    unsigned cpu = 0;
+    unsigned node = 0;
+    return syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 ? static_cast<int>(node) : -1;
+#elif PLATFORM_WINDOWS
+    return numaNodeOfCpu(static_cast<int>(GetCurrentProcessorNumber()));
+#else
+    return -1;
+#endif
+}
+
+// Function to make `node` the preferred node for the memory the calling
+// thread allocates or faults in from now on, page cache included
+inline bool preferMemoryNode(int node) {
+#if defined(__linux__)
+    if (node < 0 || node >= MAX_NUMA_NODES) {
+        return false;
+    }
+    NodeMask mask(node);
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.words, MAX_NUMA_NODES + 1) == 0;
+#else
+    (void)node;
+    return false;
+#endif
+}
+
+// Function to prefer `node` for the pages of a mapping and move the pages
+// already faulted in there. Only shared memory (shm) keeps the policy for
+// pages faulted in later; those of a regular file come from the node
+// preferred by the faulting thread.
+inline bool bindMemoryToNode(void* address, size_t length, int node) {
+#if defined(__linux__)
+    if (node < 0 || node >= MAX_NUMA_NODES) {
+        return false;
+    }
+    NodeMask mask(node);
+    return syscall(SYS_mbind, address, length, MPOL_PREFERRED, mask.words, MAX_NUMA_NODES + 1, MPOL_MF_MOVE) == 0;
+#else
+    (void)address;
+    (void)length;
+    (void)node;
+    return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,569 @@
+#include "ipc_common.h"
+#include "ipc_client.h"
+#include "ipc_registry.h"
+#include "ipc_net.h"
+#include "async_log.h"
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdlib>
+#include <thread>
+#include <chrono>
+#include <csignal>
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+// TCP gateway: accepts remote clients speaking the frame format of
+// ipc_net.h and forwards their commands to a local server through a few
+// IpcClient sessions. Many connections share each session, and every
+// request stays in flight independently, matched back to its connection
+// and remote sequence when the server answers.
+
+std::atomic<bool>& running = clientRunning;
+
+// Gateway settings (see parseArguments)
+TransportMode transportMode = TRANSPORT_MMAP;
+bool syncWrites = false;
+std::string bindAddress = "0.0.0.0";
+int listenPort = DEFAULT_GATEWAY_PORT;
+std::string requestedServer;   // empty = newest live server
+int sessionCount = 4;          // server sessions the connections are spread over
+LogLevel logLevel = LOG_INFO;
+
+void signalHandler(int /*signum*/) {
+    running = false;
+}
+
+// Function to parse command line options
+bool parseArguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        
+        if (arg.rfind("--transport=", 0) == 0) {
+            if (!parseTransportMode(arg.substr(strlen("--transport=")), transportMode)) {
+                std::cerr << "Gateway: Unknown transport: " << arg << std::endl;
+                return false;
+            }
+        } else if (arg == "--fsync") {
+            syncWrites = true;
+        } else if (arg.rfind("--wait=", 0) == 0) {
+            if (!parseWaitMode(arg.substr(strlen("--wait=")), waitPolicy.mode)) {
+                std::cerr << "Gateway: Unknown wait mode: " << arg << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--spin-us=", 0) == 0) {
+            waitPolicy.spinUs = std::atoi(arg.c_str() + strlen("--spin-us="));
+            if (waitPolicy.spinUs < 0 || waitPolicy.spinUs > 1000000) {
+                std::cerr << "Gateway: Spin time must be between 0 and 1000000 us" << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--priority=", 0) == 0) {
+            if (!parsePriority(arg.substr(strlen("--priority=")), requestPriority)) {
+                std::cerr << "Gateway: Unknown priority: " << arg << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--listen=", 0) == 0) {
+            std::string value = arg.substr(strlen("--listen="));
+            if (value.find(':') == std::string::npos) {
+                value = bindAddress + ":" + value;
+            }
+            if (!parseHostPort(value, bindAddress, listenPort)) {
+                std::cerr << "Gateway: Bad listen address: " << arg << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--server=", 0) == 0) {
+            requestedServer = arg.substr(strlen("--server="));
+        } else if (arg.rfind("--sessions=", 0) == 0) {
+            sessionCount = std::atoi(arg.c_str() + strlen("--sessions="));
+            if (sessionCount <= 0 || sessionCount > 64) {
+                std::cerr << "Gateway: Session count must be between 1 and 64" << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--log-level=", 0) == 0) {
+            if (!parseLogLevel(arg.substr(strlen("--log-level=")), logLevel)) {
+                std::cerr << "Gateway: Unknown log level: " << arg << std::endl;
+                return false;
+            }
+        } else {
+            std::cerr << "Usage: gateway [--listen=[ADDR:]PORT] [--server=ipc_server_N.bin] [--sessions=N]"
+                      << " [--transport=mmap|file|shm|uring] [--fsync] [--wait=block|hybrid|spin] [--spin-us=N]"
+                      << " [--priority=high|normal|bulk] [--log-level=debug|info|warn|error]" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Function to pick the server to forward to: the requested one, else the
+// newest live server from the registry or, without one, the directory
+std::string findServer() {
+    if (!requestedServer.empty()) {
+        return requestedServer;
+    }
+    
+    std::vector<int> numbers;
+    IpcChannel registry;
+    if (openRegistry(registry, transportMode, false)) {
+        numbers = liveServers(registry);
+        closeChannel(registry);
+    } else {
+        for (const std::string& filename : listSharedFiles(transportMode)) {
+            if (filename.find(SERVER_FILE_PREFIX) == 0 && filename.find(".bin") != std::string::npos) {
+                numbers.push_back(std::atoi(filename.c_str() + strlen(SERVER_FILE_PREFIX)));
+            }
+        }
+    }
+    
+    std::sort(numbers.begin(), numbers.end(), [](int a, int b) { return a > b; });
+    for (int number : numbers) {
+        std::string filename = std::string(SERVER_FILE_PREFIX) + std::to_string(number) + ".bin";
+        IpcChannel channel;
+        if (openServerFile(filename, channel, transportMode, syncWrites)) {
+            bool alive = isServerAlive(channel);
+            closeChannel(channel);
+            if (alive) {
+                return filename;
+            }
+        }
+    }
+    return "";
+}
+
+#if defined(__linux__)
+
+// Output beyond this stops reading from a connection until it drains, so
+// a client that does not read its responses cannot grow the gateway
+const size_t MAX_CONNECTION_OUTPUT = 1 << 20;
+
+const uint64_t LISTENER_KEY = 0;
+const uint64_t COMPLETION_KEY = 1;
+
+// A remote client
+struct Connection {
+    int fd = -1;
+    std::string input;        // received bytes, starting at a frame header
+    std::string output;       // encoded responses not sent yet
+    uint32_t events = 0;      // epoll events currently registered
+};
+
+// A finished request on its way back to its connection. Completions come
+// from the IpcClient receiver threads and are handed to the event loop.
+struct Completion {
+    uint64_t connection;
+    uint32_t sequence;
+    uint8_t type;
+    IpcResponse response;
+};
+
+std::mutex completionMutex;
+std::vector<Completion> completions;
+int completionEvent = -1;   // eventfd that wakes the event loop
+
+int epollFd = -1;
+std::unordered_map<uint64_t, Connection> connections;
+uint64_t nextConnectionKey = COMPLETION_KEY + 1;
+
+std::vector<std::unique_ptr<IpcClient>> sessions;
+size_t nextSession = 0;
+std::string connectedServer;
+uint64_t forwardedRequests = 0;
+uint64_t acceptedConnections = 0;
+
+// Function to (re)open the server sessions that are not connected.
+// Returns false if no session is connected afterwards.
+bool connectSessions() {
+    // Healthy sessions stay as they are: connect() starts by closing the
+    // session, which would fail the requests it has in flight
+    std::string filename;
+    bool searched = false;
+    int connected = 0;
+    for (auto& session : sessions) {
+        if (session->isConnected()) {
+            connected++;
+            continue;
+        }
+        if (!searched) {
+            filename = findServer();
+            searched = true;
+        }
+        if (!filename.empty() && session->connect(filename, transportMode, syncWrites)) {
+            connected++;
+        }
+    }
+    if (connected == 0 || filename.empty()) {
+        return connected > 0;
+    }
+    if (filename != connectedServer) {
+        LOG_EVENT(LOG_INFO, "Gateway: Forwarding to %s over %d sessions", filename.c_str(), connected);
+        connectedServer = filename;
+    }
+    return true;
+}
+
+// Function to hand a completion to the event loop; called from any thread
+void postCompletion(Completion completion) {
+    bool wasEmpty = false;
+    {
+        std::lock_guard<std::mutex> lock(completionMutex);
+        wasEmpty = completions.empty();
+        completions.push_back(std::move(completion));
+    }
+    if (wasEmpty) {
+        uint64_t one = 1;
+        ssize_t written = write(completionEvent, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+// Function to open the non-blocking listening socket; returns -1 on failure
+int listenTcp(const std::string& address, int port) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+        return -1;
+    }
+    
+    int fd = -1;
+    for (addrinfo* candidate = addresses; candidate != nullptr && fd < 0; candidate = candidate->ai_next) {
+        fd = socket(candidate->ai_family, candidate->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, candidate->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, candidate->ai_addr, candidate->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+// Function to register the epoll events a connection needs now: input
+// while its output is below the limit, output while anything is queued
+void updateEvents(uint64_t key, Connection& connection) {
+    uint32_t events = 0;
+    if (connection.output.size() < MAX_CONNECTION_OUTPUT) {
+        events |= EPOLLIN;
+    }
+    if (!connection.output.empty()) {
+        events |= EPOLLOUT;
+    }
+    if (events == connection.events) {
+        return;
+    }
+    epoll_event event{};
+    event.events = events;
+    event.data.u64 = key;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, connection.fd, &event);
+    connection.events = events;
+}
+
+void closeConnection(uint64_t key) {
+    auto found = connections.find(key);
+    if (found == connections.end()) {
+        return;
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, found->second.fd, nullptr);
+    close(found->second.fd);
+    connections.erase(found);
+    
+    // Requests still in flight complete later and are dropped
+    LOG_EVENT(LOG_DEBUG, "Gateway: Connection %llu closed", static_cast<unsigned long long>(key));
+}
+
+// Function to answer a frame right away, without the server
+void rejectFrame(Connection& connection, const WireFrame& request, RequestResult status) {
+    WireFrame response;
+    response.sequence = request.sequence;
+    response.type = request.type;
+    response.status = static_cast<uint8_t>(status);
+    appendWireFrame(connection.output, response, std::string_view());
+}
+
+// Function to forward one request frame to the server. Sessions take
+// requests in turn; send() blocks while the chosen session's window is
+// full, which holds back the event loop until the server catches up.
+void forwardFrame(uint64_t key, Connection& connection, const WireFrame& frame, std::string_view body) {
+    IpcClient& session = *sessions[nextSession++ % sessions.size()];
+    if (!session.isConnected() || (frame.type != MESSAGE_SINGLE && frame.type != MESSAGE_BINARY)) {
+        rejectFrame(connection, frame, REQUEST_FAILED);
+        return;
+    }
+    
+    uint32_t sequence = frame.sequence;
+    uint8_t type = frame.type;
+    auto done = [key, sequence, type](IpcResponse& response) {
+        postCompletion(Completion{key, sequence, type, std::move(response)});
+    };
+    forwardedRequests++;
+    if (frame.type == MESSAGE_BINARY) {
+        session.send(static_cast<Opcode>(frame.opcode), body, done);
+    } else {
+        session.sendText(body, done);
+    }
+}
+
+// Function to forward every complete frame in the connection's input, as
+// long as its output has room. Returns false if the stream is corrupt.
+bool forwardInput(uint64_t key, Connection& connection) {
+    size_t position = 0;
+    while (connection.input.size() - position >= WIRE_HEADER_SIZE &&
+           connection.output.size() < MAX_CONNECTION_OUTPUT) {
+        WireFrame frame;
+        if (!decodeWireHeader(connection.input.data() + position, frame)) {
+            return false;
+        }
+        if (connection.input.size() - position < WIRE_HEADER_SIZE + frame.length) {
+            break;
+        }
+        std::string_view body(connection.input.data() + position + WIRE_HEADER_SIZE, frame.length);
+        forwardFrame(key, connection, frame, body);
+        position += WIRE_HEADER_SIZE + frame.length;
+    }
+    connection.input.erase(0, position);
+    return true;
+}
+
+// Function to send as much queued output as the socket takes.
+// Returns false if the connection broke.
+bool flushOutput(uint64_t key, Connection& connection) {
+    size_t sent = 0;
+    while (sent < connection.output.size()) {
+        ssize_t written = send(connection.fd, connection.output.data() + sent, connection.output.size() - sent,
+                               MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(written);
+    }
+    connection.output.erase(0, sent);
+    
+    // Below the limit again: pick up frames that were held back
+    bool wasFull = !(connection.events & EPOLLIN);
+    if (wasFull && connection.output.size() < MAX_CONNECTION_OUTPUT && !forwardInput(key, connection)) {
+        return false;
+    }
+    updateEvents(key, connection);
+    return true;
+}
+
+void acceptConnections(int listener) {
+    while (true) {
+        int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;   // EAGAIN: accepted everything pending
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        
+        uint64_t key = nextConnectionKey++;
+        Connection& connection = connections[key];
+        connection.fd = fd;
+        connection.events = EPOLLIN;
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = key;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        acceptedConnections++;
+        LOG_EVENT(LOG_DEBUG, "Gateway: Connection %llu opened", static_cast<unsigned long long>(key));
+    }
+}
+
+// Function to read whatever a connection sent and forward its frames
+void readConnection(uint64_t key, Connection& connection) {
+    char buffer[65536];
+    ssize_t received = recv(connection.fd, buffer, sizeof(buffer), 0);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (received <= 0) {
+        closeConnection(key);
+        return;
+    }
+    
+    connection.input.append(buffer, static_cast<size_t>(received));
+    if (!forwardInput(key, connection)) {
+        LOG_EVENT(LOG_WARN, "Gateway: Dropping connection %llu, bad frame", static_cast<unsigned long long>(key));
+        closeConnection(key);
+        return;
+    }
+    // Requests that failed at once queue responses without a completion
+    if (!connection.output.empty() && !flushOutput(key, connection)) {
+        closeConnection(key);
+    }
+}
+
+// Function to write the responses that completed since the last wakeup.
+// Each connection gets all of its responses in one send.
+void deliverCompletions() {
+    uint64_t count = 0;
+    ssize_t readBytes = read(completionEvent, &count, sizeof(count));
+    (void)readBytes;
+    
+    std::vector<Completion> ready;
+    {
+        std::lock_guard<std::mutex> lock(completionMutex);
+        ready.swap(completions);
+    }
+    
+    std::vector<uint64_t> touched;
+    for (Completion& completion : ready) {
+        auto found = connections.find(completion.connection);
+        if (found == connections.end()) {
+            continue;
+        }
+        if (found->second.output.empty()) {
+            touched.push_back(completion.connection);
+        }
+        
+        WireFrame frame;
+        frame.sequence = completion.sequence;
+        frame.type = completion.type;
+        frame.status = static_cast<uint8_t>(completion.response.status);
+        frame.result = completion.response.result;
+        appendWireFrame(found->second.output, frame, completion.response.body);
+    }
+    
+    for (uint64_t key : touched) {
+        auto found = connections.find(key);
+        if (found != connections.end() && !flushOutput(key, found->second)) {
+            closeConnection(key);
+        }
+    }
+}
+
+int runGateway() {
+    int listener = listenTcp(bindAddress, listenPort);
+    if (listener < 0) {
+        std::cerr << "Gateway: Cannot listen on " << bindAddress << ":" << listenPort << ": "
+                  << strerror(errno) << std::endl;
+        return 1;
+    }
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    completionEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = LISTENER_KEY;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listener, &event);
+    event.data.u64 = COMPLETION_KEY;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, completionEvent, &event);
+    
+    for (int i = 0; i < sessionCount; i++) {
+        sessions.push_back(std::make_unique<IpcClient>());
+    }
+    if (!connectSessions()) {
+        LOG_EVENT(LOG_WARN, "Gateway: No server available yet, requests fail until one starts");
+    }
+    LOG_EVENT(LOG_INFO, "Gateway: Listening on %s:%d", bindAddress.c_str(), listenPort);
+    
+    // Reconnect check: a restarted server gets new sessions
+    auto nextCheck = std::chrono::steady_clock::now();
+    
+    epoll_event events[64];
+    while (running) {
+        int count = epoll_wait(epollFd, events, 64, WAIT_POLL_INTERVAL_MS);
+        for (int i = 0; i < count; i++) {
+            uint64_t key = events[i].data.u64;
+            if (key == LISTENER_KEY) {
+                acceptConnections(listener);
+                continue;
+            }
+            if (key == COMPLETION_KEY) {
+                deliverCompletions();
+                continue;
+            }
+            
+            auto found = connections.find(key);
+            if (found == connections.end()) {
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                closeConnection(key);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && !flushOutput(key, found->second)) {
+                closeConnection(key);
+                continue;
+            }
+            if (events[i].events & EPOLLIN) {
+                readConnection(key, found->second);
+            }
+        }
+        
+        auto now = std::chrono::steady_clock::now();
+        if (now >= nextCheck) {
+            nextCheck = now + std::chrono::seconds(1);
+            bool healthy = std::all_of(sessions.begin(), sessions.end(),
+                                       [](const std::unique_ptr<IpcClient>& session) { return session->isConnected(); });
+            if (!healthy && !connectSessions() && !connectedServer.empty()) {
+                LOG_EVENT(LOG_WARN, "Gateway: Lost %s, waiting for a server", connectedServer.c_str());
+                connectedServer.clear();
+            }
+        }
+    }
+    
+    LOG_EVENT(LOG_INFO, "Gateway: Shutting down...");
+    for (auto& session : sessions) {
+        session->close();
+    }
+    while (!connections.empty()) {
+        closeConnection(connections.begin()->first);
+    }
+    close(completionEvent);
+    close(epollFd);
+    close(listener);
+    
+    LOG_EVENT(LOG_INFO, "Gateway: %llu connections, %llu requests forwarded",
+              static_cast<unsigned long long>(acceptedConnections),
+              static_cast<unsigned long long>(forwardedRequests));
+    return 0;
+}
+
+#else
+
+int runGateway() {
+    std::cerr << "Gateway: Only available on Linux (epoll)" << std::endl;
+    return 1;
+}
+
+#endif
+
+int main(int argc, char* argv[]) {
+    if (!parseArguments(argc, argv)) {
+        return 1;
+    }
+    
+    eventLog.setLevel(logLevel);
+    eventLog.start();
+    
+    signal(SIGINT, signalHandler);
+    signal(SIGTERM, signalHandler);
+    
+    int status = runGateway();
+    
+    eventLog.stop();
+    return status;
+}
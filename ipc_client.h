@@ -0,0 +1,1043 @@
+#ifndef IPC_CLIENT_H
+#define IPC_CLIENT_H
+
+#include "ipc_common.h"
+#include "ipc_reactor.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Client side of the protocol, for programs that embed a client instead of
+// running the interactive one. The free functions are the synchronous
+// building blocks: open a session, send one request (or a batch) and wait.
+// IpcClient below adds pipelining on top of them.
+
+// Cleared (e.g. from a signal handler) to make blocking calls give up
+inline std::atomic<bool> clientRunning{true};
+
+// PriorityClass of every request this process sends (--priority=...)
+inline int requestPriority = PRIORITY_NORMAL;
+
+// What the server knows about one client. Opened with openSession().
+struct ClientSession {
+    int clientId = 0;         // 0 = no session
+    int sessionToken = 0;     // proves the ID is ours, sent with every request
+    int replyChannel = 0;     // 1-based private response channel, 0 = none
+    uint16_t protocol = 0;    // version agreed in the hello handshake
+    int requestCounter = 0;   // sequence for requests answered on the private channel
+};
+
+enum RequestResult {
+    REQUEST_OK,
+    REQUEST_BUSY,
+    REQUEST_FAILED,
+    REQUEST_TIMEOUT
+};
+
+// Function to open a server file
+inline bool openServerFile(const std::string& filename, IpcChannel& channel, TransportMode mode, bool syncWrites) {
+    if (!openSharedFile(channel, filename, mode, false)) {
+        return false;
+    }
+
+    if (!openChannel(channel, filename, mode, syncWrites)) {
+        closeChannel(channel);
+        return false;
+    }
+    return true;
+}
+
+inline bool takeFreeSlot(IpcChannel& channel, uint32_t slot) {
+    if (loadSlotStatus(channel, slot) != SLOT_FREE ||
+        !compareExchangeSlotStatus(channel, slot, SLOT_FREE, SLOT_CLAIMED, false)) {
+        return false;
+    }
+    startSlotLease(channel, slot, currentProcessId(), SLOT_CLAIM_LEASE_MS);
+    return true;
+}
+
+// Function to claim a free slot, starting at a rotating position so
+// concurrent clients spread over the ring. With every slot taken, slots
+// left behind by clients that died holding them are reclaimed before
+// giving up. Returns -1 if every slot is taken.
+inline int claimSlot(IpcChannel& channel) {
+    uint32_t start = static_cast<uint32_t>(fetchAddWord(channel, CLAIM_CURSOR_OFFSET, 1));
+
+    // With an I/O engine one batch finds the free slots; otherwise each
+    // status is read on the way, stopping at the first free one
+    int statuses[MAX_SLOT_COUNT];
+    bool prefetched = hasIoEngine(channel) && loadSlotStatuses(channel, statuses);
+    for (uint32_t i = 0; i < channel.slotCount; i++) {
+        uint32_t slot = (start + i) % channel.slotCount;
+        if (prefetched && statuses[slot] != SLOT_FREE) {
+            continue;
+        }
+        if (takeFreeSlot(channel, slot)) {
+            return static_cast<int>(slot);
+        }
+    }
+
+    for (uint32_t i = 0; i < channel.slotCount; i++) {
+        uint32_t slot = (start + i) % channel.slotCount;
+        if (reclaimAbandonedSlot(channel, slot, false) && takeFreeSlot(channel, slot)) {
+            return static_cast<int>(slot);
+        }
+    }
+    return -1;
+}
+
+// Function to withdraw a request nobody will read the answer to
+inline void cancelRequest(IpcChannel& channel, uint32_t slot, const Message& request) {
+    // Not picked up yet: take it back and free it. The claim lease has
+    // likely run out by now, so drop it first; a published request is
+    // never reclaimed.
+    if (loadSlotStatus(channel, slot) == SLOT_REQUEST) {
+        storeWord(channel, slotLeaseOffset(slot, offsetof(Message, lease_expires)), 0);
+    }
+    if (compareExchangeSlotStatus(channel, slot, SLOT_REQUEST, SLOT_CLAIMED, false)) {
+        releaseMessageBody(channel, request);
+        releaseSlot(channel, slot);
+        return;
+    }
+
+    // Being processed: the server frees the slot once it is done
+    if (compareExchangeSlotStatus(channel, slot, SLOT_PROCESSING, SLOT_CANCELLED, false)) {
+        return;
+    }
+
+    // The response arrived in the meantime
+    if (loadSlotStatus(channel, slot) == SLOT_RESPONSE && takeSlotLease(channel, slot)) {
+        Message response{};
+        if (readMessage(channel, slot, response)) {
+            releaseMessageBody(channel, response);
+        }
+        releaseSlot(channel, slot);
+    }
+}
+
+// Function to block the owning client until the server publishes past `head`
+inline void waitForResponse(IpcChannel& channel, uint32_t index, int head, int timeoutMs) {
+    size_t headOffset = channelWordOffset(channel, index, offsetof(ResponseChannel, head));
+    size_t waitingOffset = channelWordOffset(channel, index, offsetof(ResponseChannel, clientWaiting));
+
+    if (spinOnWord(channel, headOffset, head, timeoutMs)) {
+        return;
+    }
+
+    // Same handshake as the doorbell: announce the wait, then sleep on head
+    storeWord(channel, waitingOffset, 1);
+    waitWord(channel, headOffset, head, timeoutMs);
+    storeWord(channel, waitingOffset, 0);
+}
+
+// Function to take responses off private channel `index` until the one
+// with `sequence` turns up; stale responses to requests that timed out
+// earlier are skipped. Returns 1 with the response in `msg`, 0 if the
+// channel ran empty (its head in `head`), -1 on error.
+inline int pollResponse(IpcChannel& channel, uint32_t index, int sequence, Message& msg, int& head) {
+    size_t headOffset = channelWordOffset(channel, index, offsetof(ResponseChannel, head));
+    size_t tailOffset = channelWordOffset(channel, index, offsetof(ResponseChannel, tail));
+
+    while (true) {
+        int tail = 0;
+        IoBatch positions(channel);
+        positions.loadWord(headOffset, head);
+        positions.loadWord(tailOffset, tail);
+        if (!positions.submit()) {
+            return -1;
+        }
+        if (head == tail) {
+            return 0;
+        }
+
+        IoBatch take(channel);
+        take.readMessage(responseEntryOffset(channel, index, tail), msg);
+        take.storeWord(tailOffset, tail + 1);
+        if (!take.submit()) {
+            return -1;
+        }
+        if (msg.sequence == sequence) {
+            return 1;
+        }
+        releaseMessageBody(channel, msg);
+    }
+}
+
+// Function to check, at most every WAIT_POLL_INTERVAL_MS, whether the
+// server went away while a request is outstanding, so waiters fail fast
+// instead of running into their timeout
+inline bool serverGone(IpcChannel& channel, std::chrono::steady_clock::time_point now,
+                       std::chrono::steady_clock::time_point& nextCheck) {
+    if (now < nextCheck) {
+        return false;
+    }
+    nextCheck = now + std::chrono::milliseconds(WAIT_POLL_INTERVAL_MS);
+    return !isServerAlive(channel);
+}
+
+// Function to wait for the private-channel response with `sequence`.
+// Gives up early if the server dies.
+inline bool receiveResponse(IpcChannel& channel, const ClientSession& client, int sequence, Message& msg, int timeoutMs) {
+    uint32_t index = static_cast<uint32_t>(client.replyChannel - 1);
+    auto start = std::chrono::steady_clock::now();
+    auto nextCheck = start;
+
+    while (clientRunning) {
+        int head = 0;
+        int polled = pollResponse(channel, index, sequence, msg, head);
+        if (polled != 0) {
+            return polled > 0;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count() > timeoutMs ||
+            serverGone(channel, now, nextCheck)) {
+            return false;
+        }
+
+        waitForResponse(channel, index, head, WAIT_POLL_INTERVAL_MS);
+    }
+    return false;
+}
+
+// Function to check that the session's private channel is still assigned
+// to it; the server takes channels back from sessions that went idle
+inline bool ownsReplyChannel(IpcChannel& channel, const ClientSession& client) {
+    uint32_t index = static_cast<uint32_t>(client.replyChannel - 1);
+    int owner = 0;
+    int token = 0;
+    return index < channel.channelCount &&
+           loadWord(channel, channelWordOffset(channel, index, offsetof(ResponseChannel, ownerId)), owner) &&
+           loadWord(channel, channelWordOffset(channel, index, offsetof(ResponseChannel, ownerToken)), token) &&
+           owner == client.clientId && token == client.sessionToken;
+}
+
+// Function to drop the session if the server no longer knows the channel
+// (e.g. it was restarted), so the next request opens a new one
+inline void validateSession(IpcChannel& channel, ClientSession& client) {
+    if (client.replyChannel != 0 && !ownsReplyChannel(channel, client)) {
+        client = ClientSession();
+    }
+}
+
+// Function to publish `msg` in claimed `slot` and ring the doorbell.
+// Requests answered on the private channel must carry their sequence
+// already; in-slot requests get the slot's next one here. On failure the
+// request body is freed, and so is the slot unless its lease ran out and
+// it was reclaimed meanwhile.
+inline bool postRequest(IpcChannel& channel, const ClientSession& client, uint32_t slot, Message& msg) {
+    // Responses on the private channel are matched by the session's request
+    // counter, in-slot responses by the bumped slot sequence
+    if (client.replyChannel == 0) {
+        Message previous{};
+        if (!readMessage(channel, slot, previous)) {
+            releaseMessageBody(channel, msg);
+            releaseSlot(channel, slot);
+            return false;
+        }
+        msg.sequence = previous.sequence + 1;
+    }
+    msg.client_id = client.clientId;
+    msg.session_token = client.sessionToken;
+    msg.reply_channel = client.replyChannel;
+    msg.priority = requestPriority;
+    msg.status = SLOT_REQUEST;
+
+    if (!writePayload(channel, slot, msg)) {
+        releaseMessageBody(channel, msg);
+        releaseSlot(channel, slot);
+        return false;
+    }
+    if (!compareExchangeSlotStatus(channel, slot, SLOT_CLAIMED, SLOT_REQUEST, false)) {
+        releaseMessageBody(channel, msg);
+        return false;
+    }
+
+    // Ring the doorbell; the wake syscall is only needed if the server sleeps
+    fetchAddWord(channel, DOORBELL_OFFSET, 1);
+    int sleeping = 0;
+    if (loadWord(channel, SERVER_SLEEPING_OFFSET, sleeping) && sleeping) {
+        wakeWord(channel, DOORBELL_OFFSET);
+    }
+    return true;
+}
+
+// Function to claim a slot and publish `msg` in it (see postRequest).
+// Returns the slot, or -1 with REQUEST_BUSY / REQUEST_FAILED in `result`
+// after freeing the request body.
+inline int publishRequest(IpcChannel& channel, const ClientSession& client, Message& msg, RequestResult& result) {
+    // Give up after the same budget as the original 5 x 100 ms busy retries.
+    // Releases wake every waiter, so the budget is time-based, not a count.
+    const int MAX_WAIT_ATTEMPTS = 5;
+    auto busyDeadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(MAX_WAIT_ATTEMPTS * WAIT_POLL_INTERVAL_MS);
+    int slot = -1;
+    result = REQUEST_FAILED;
+
+    // Wait until a slot is free
+    while (clientRunning) {
+        int released = 0;
+        if (!loadWord(channel, RELEASE_COUNTER_OFFSET, released)) {
+            releaseMessageBody(channel, msg);
+            return -1;
+        }
+
+        slot = claimSlot(channel);
+        if (slot >= 0) {
+            break;
+        }
+
+        if (std::chrono::steady_clock::now() >= busyDeadline) {
+            releaseMessageBody(channel, msg);
+            result = REQUEST_BUSY;
+            return -1;
+        }
+
+        if (!spinOnWord(channel, RELEASE_COUNTER_OFFSET, released, WAIT_POLL_INTERVAL_MS)) {
+            fetchAddWord(channel, SLOT_WAITERS_OFFSET, 1);
+            waitWord(channel, RELEASE_COUNTER_OFFSET, released, WAIT_POLL_INTERVAL_MS);
+            fetchAddWord(channel, SLOT_WAITERS_OFFSET, -1);
+        }
+    }
+
+    if (slot < 0) {
+        releaseMessageBody(channel, msg);
+        return -1;
+    }
+
+    if (!postRequest(channel, client, static_cast<uint32_t>(slot), msg)) {
+        return -1;
+    }
+
+    result = REQUEST_OK;
+    return slot;
+}
+
+// Function to check the slot of an in-slot request for its response.
+// Returns 1 with the response in `msg` and the slot freed, 0 while the
+// server has not answered (the slot status in `status`), -1 on error.
+inline int pollSlotResponse(IpcChannel& channel, uint32_t slot, int sequence, Message& msg, int& status) {
+    status = loadSlotStatus(channel, slot);
+    if (status == -1) {
+        return -1;
+    }
+    if (status != SLOT_RESPONSE) {
+        return 0;
+    }
+    if (!takeSlotLease(channel, slot)) {
+        return -1;   // left unread too long and reclaimed
+    }
+
+    bool ok = readMessage(channel, slot, msg);
+    releaseSlot(channel, slot);
+    if (ok && msg.sequence == sequence) {
+        return 1;
+    }
+    if (ok) {
+        releaseMessageBody(channel, msg);
+    }
+    return -1;
+}
+
+// Function to send one request and wait for its response.
+// The request body must already be set (setMessageBody); an overflow chunk
+// it uses is handed to the server, or freed here if the request never
+// reaches it. On REQUEST_OK `msg` holds the response, and the caller frees
+// its body with releaseMessageBody() after reading it. A server that dies
+// meanwhile fails the request right away with REQUEST_FAILED. A session
+// the server has expired is dropped first, so the request opens a new one.
+inline RequestResult exchangeMessage(IpcChannel& channel, ClientSession& client, Message& msg, int timeoutMs) {
+    validateSession(channel, client);
+    if (client.replyChannel > 0) {
+        msg.sequence = ++client.requestCounter;
+    }
+
+    RequestResult published = REQUEST_FAILED;
+    int slot = publishRequest(channel, client, msg, published);
+    if (slot < 0) {
+        return published;
+    }
+
+    // Wait for response. With a private channel the slot now belongs to the
+    // server, which recycles it as soon as it has read the request.
+    int expectedSequence = msg.sequence;
+    if (client.replyChannel > 0) {
+        if (receiveResponse(channel, client, expectedSequence, msg, timeoutMs)) {
+            return REQUEST_OK;
+        }
+        validateSession(channel, client);
+        return clientRunning && isServerAlive(channel) ? REQUEST_TIMEOUT : REQUEST_FAILED;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto nextCheck = start;
+
+    while (clientRunning) {
+        int status = 0;
+        int polled = pollSlotResponse(channel, static_cast<uint32_t>(slot), expectedSequence, msg, status);
+        if (polled > 0) {
+            return REQUEST_OK;
+        }
+        if (polled < 0) {
+            if (status == SLOT_RESPONSE) {
+                return REQUEST_FAILED;   // answered, but not this request, or reclaimed
+            }
+            break;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count() > timeoutMs) {
+            cancelRequest(channel, slot, msg);
+            return REQUEST_TIMEOUT;
+        }
+        if (serverGone(channel, now, nextCheck)) {
+            break;
+        }
+
+        waitForSlotChange(channel, slot, status, WAIT_POLL_INTERVAL_MS);
+    }
+
+    cancelRequest(channel, slot, msg);
+    return REQUEST_FAILED;
+}
+
+// Function to build the hello that opens a session (or confirms the
+// current one) and settles the protocol version. The hello is answered in
+// its slot, so it works while the client has no response channel yet;
+// send it with a copy of the session whose replyChannel is 0.
+inline void prepareHello(IpcChannel& channel, Message& msg) {
+    msg = Message{};
+    msg.type = MESSAGE_HELLO;
+    HelloBody offer{PROTOCOL_MIN_VERSION, PROTOCOL_VERSION};
+    setMessageBody(channel, msg, reinterpret_cast<const char*>(&offer), sizeof(offer));
+}
+
+// Function to take the session from the answer to a hello, freeing its body
+inline RequestResult acceptHello(IpcChannel& channel, ClientSession& client, const Message& msg) {
+    char scratch[OVERFLOW_CHUNK_SIZE];
+    std::string_view body;
+    HelloBody accepted{};
+    bool valid = msg.type == MESSAGE_HELLO && msg.result == RESULT_OK && msg.client_id > 0 &&
+                 messageBody(channel, msg, scratch, body) && body.size() == sizeof(HelloBody);
+    if (valid) {
+        std::memcpy(&accepted, body.data(), sizeof(accepted));
+    }
+    releaseMessageBody(channel, msg);
+
+    if (!valid || accepted.maxVersion < PROTOCOL_MIN_VERSION || accepted.maxVersion > PROTOCOL_VERSION) {
+        return REQUEST_FAILED;
+    }
+    client.clientId = msg.client_id;
+    client.sessionToken = msg.session_token;
+    client.replyChannel = msg.reply_channel;
+    client.protocol = accepted.maxVersion;
+    return REQUEST_OK;
+}
+
+// Function to open a session (or confirm the current one) with a hello
+// handshake
+inline RequestResult openSession(IpcChannel& channel, ClientSession& client, int timeoutMs) {
+    ClientSession handshake = client;
+    handshake.replyChannel = 0;
+
+    Message msg{};
+    prepareHello(channel, msg);
+    RequestResult result = exchangeMessage(channel, handshake, msg, timeoutMs);
+    if (result != REQUEST_OK) {
+        return result;
+    }
+    return acceptHello(channel, client, msg);
+}
+
+// Function to build a binary request: the opcode and an optional body,
+// nothing for either side to parse. Needs a session on PROTOCOL_BINARY.
+inline RequestResult prepareBinary(IpcChannel& channel, const ClientSession& client, Opcode opcode,
+                                   std::string_view body, Message& msg) {
+    if (client.protocol < PROTOCOL_BINARY) {
+        return REQUEST_FAILED;
+    }
+
+    msg = Message{};
+    msg.type = MESSAGE_BINARY;
+    msg.opcode = opcode;
+    if (!setMessageBody(channel, msg, body.empty() ? "" : body.data(), body.size())) {
+        return REQUEST_BUSY;   // no overflow chunk free
+    }
+    return REQUEST_OK;
+}
+
+// Function to send one binary request (see prepareBinary). On REQUEST_OK
+// `msg` holds the response; its `result` tells whether the command
+// succeeded, and the caller frees its body.
+inline RequestResult exchangeBinary(IpcChannel& channel, ClientSession& client, Opcode opcode, std::string_view body,
+                                    Message& msg, int timeoutMs) {
+    RequestResult prepared = prepareBinary(channel, client, opcode, body, msg);
+    if (prepared != REQUEST_OK) {
+        return prepared;
+    }
+    return exchangeMessage(channel, client, msg, timeoutMs);
+}
+
+// Function to send several commands with as few round trips as possible.
+// Commands are packed into batch frames; whatever the server could not fit
+// into a combined response goes out again in the next frame. With `binary`
+// every command is a single opcode byte (see FRAME_BINARY). On REQUEST_OK
+// `responses` holds one response text per command, and `failed` counts the
+// commands the server rejected.
+inline RequestResult exchangeBatch(IpcChannel& channel, ClientSession& client,
+                                   const std::vector<std::string>& commands, std::vector<std::string>& responses,
+                                   int& failed, int timeoutMs, bool binary = false) {
+    responses.clear();
+    failed = 0;
+    size_t next = 0;
+
+    // Frames larger than Message::data go through an overflow chunk
+    char buffer[OVERFLOW_CHUNK_SIZE];
+    size_t capacity = channel.overflowCount > 0 ? sizeof(buffer) : sizeof(Message::data) - 1;
+
+    while (next < commands.size()) {
+        Message msg{};
+        msg.client_id = client.clientId;
+        msg.type = MESSAGE_BATCH;
+        msg.flags = binary ? FRAME_BINARY : 0;
+        size_t used = 0;
+        beginBatch(buffer, used);
+
+        size_t packed = next;
+        while (packed < commands.size() &&
+               appendBatchEntry(buffer, capacity, used, BATCH_ENTRY_OK, commands[packed])) {
+            packed++;
+        }
+        if (packed == next) {
+            return REQUEST_FAILED;   // a single command does not fit a frame
+        }
+        if (!setMessageBody(channel, msg, buffer, used)) {
+            return REQUEST_BUSY;     // no overflow chunk free
+        }
+
+        RequestResult result = exchangeMessage(channel, client, msg, timeoutMs);
+        if (result != REQUEST_OK) {
+            return result;
+        }
+
+        // Without a session the first frame opens one; later frames carry it
+        if (client.clientId == 0 && msg.client_id > 0) {
+            client.clientId = msg.client_id;
+            client.sessionToken = msg.session_token;
+            client.replyChannel = msg.reply_channel;
+        }
+
+        std::string_view body;
+        if (msg.type != MESSAGE_BATCH || !messageBody(channel, msg, buffer, body)) {
+            releaseMessageBody(channel, msg);
+            return REQUEST_FAILED;
+        }
+
+        int answered = batchEntryCount(body);
+        size_t position = 1;
+        bool valid = true;
+        for (int i = 0; i < answered && next < packed; i++) {
+            uint8_t status = 0;
+            std::string_view text;
+            if (!readBatchEntry(body, position, status, text)) {
+                valid = false;
+                break;
+            }
+            responses.emplace_back(text);
+            failed += (status != BATCH_ENTRY_OK) ? 1 : 0;
+            next++;
+        }
+        releaseMessageBody(channel, msg);
+
+        if (!valid || answered == 0) {
+            return REQUEST_FAILED;   // no progress, don't resend forever
+        }
+    }
+    return REQUEST_OK;
+}
+
+// Response to a request sent through IpcClient
+struct IpcResponse {
+    RequestResult status = REQUEST_FAILED;   // REQUEST_OK once the server answered
+    int result = RESULT_OK;                  // ResultCode of a binary command
+    int sequence = 0;                        // correlation ID of the request
+    std::string body;
+};
+
+// Asynchronous client with one session. Any thread may send(); each request
+// gets the next sequence number of the session as its correlation ID and
+// completes through a future or a callback. A receiver thread drains the
+// private response channel and completes requests by sequence, so many of
+// them can be in flight and finish in whatever order the server answers
+// them. The window is the depth of the response channel, which the server
+// must never overrun; send() blocks while it is full.
+//
+// Callbacks run on the receiver thread, or on the sending thread if a
+// request fails before it reaches the server. They must not wait for other
+// requests, and must not send with a full window.
+class IpcClient {
+public:
+    using Callback = std::function<void(IpcResponse&)>;
+
+    IpcClient() = default;
+    IpcClient(const IpcClient&) = delete;
+    IpcClient& operator=(const IpcClient&) = delete;
+
+    ~IpcClient() {
+        close();
+    }
+
+    // Function to open the server file, say hello and start the receiver
+    bool connect(const std::string& filename, TransportMode mode = TRANSPORT_MMAP, bool syncWrites = false,
+                 int timeoutMs = 5000) {
+        close();
+        if (!openServerFile(filename, channel_, mode, syncWrites)) {
+            return false;
+        }
+        if (openSession(channel_, session_, timeoutMs) != REQUEST_OK) {
+            closeChannel(channel_);
+            return false;
+        }
+
+        open_ = true;
+        sessionLost_ = false;
+        if (session_.replyChannel > 0) {
+            receiver_ = std::thread(&IpcClient::receiveLoop, this);
+        }
+        return true;
+    }
+
+    // Function to stop the receiver; requests still in flight fail
+    void close() {
+        if (!open_.exchange(false)) {
+            return;
+        }
+        windowChanged_.notify_all();
+        if (receiver_.joinable()) {
+            receiver_.join();
+        }
+        failPending(REQUEST_FAILED);
+        closeChannel(channel_);
+        session_ = ClientSession();
+    }
+
+    bool isConnected() {
+        return open_ && !sessionLost_ && isServerAlive(channel_);
+    }
+
+    const ClientSession& session() const {
+        return session_;
+    }
+
+    std::future<IpcResponse> send(Opcode opcode, std::string_view body = std::string_view(), int timeoutMs = 5000) {
+        auto promise = std::make_shared<std::promise<IpcResponse>>();
+        std::future<IpcResponse> future = promise->get_future();
+        send(opcode, body, [promise](IpcResponse& response) { promise->set_value(std::move(response)); },
+             timeoutMs);
+        return future;
+    }
+
+    // Function to send a binary command; needs a session on PROTOCOL_BINARY
+    void send(Opcode opcode, std::string_view body, Callback callback, int timeoutMs = 5000) {
+        Message msg{};
+        msg.type = MESSAGE_BINARY;
+        msg.opcode = opcode;
+        if (session_.protocol < PROTOCOL_BINARY) {
+            completeNow(callback, REQUEST_FAILED);
+            return;
+        }
+        submit(msg, body, std::move(callback), timeoutMs);
+    }
+
+    std::future<IpcResponse> sendText(std::string_view command, int timeoutMs = 5000) {
+        auto promise = std::make_shared<std::promise<IpcResponse>>();
+        std::future<IpcResponse> future = promise->get_future();
+        sendText(command, [promise](IpcResponse& response) { promise->set_value(std::move(response)); },
+                 timeoutMs);
+        return future;
+    }
+
+    // Function to send a text command, as typed by a human
+    void sendText(std::string_view command, Callback callback, int timeoutMs = 5000) {
+        Message msg{};
+        msg.type = MESSAGE_SINGLE;
+        submit(msg, command, std::move(callback), timeoutMs);
+    }
+
+    // Function to wait until every request sent so far has completed
+    void drain() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        windowChanged_.wait(lock, [this]() { return pending_.empty() || !open_; });
+    }
+
+private:
+    // How long a timed-out request still holds its place in the window
+    static constexpr int LATE_RESPONSE_MS = 10000;
+
+    struct PendingRequest {
+        Callback callback;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    static void completeNow(Callback& callback, RequestResult status) {
+        IpcResponse response;
+        response.status = status;
+        callback(response);
+    }
+
+    void submit(Message& msg, std::string_view body, Callback callback, int timeoutMs) {
+        if (!open_ || sessionLost_) {
+            completeNow(callback, REQUEST_FAILED);
+            return;
+        }
+        if (!setMessageBody(channel_, msg, body.empty() ? "" : body.data(), body.size())) {
+            completeNow(callback, REQUEST_BUSY);   // too large, or no overflow chunk free
+            return;
+        }
+
+        // Without a private channel responses come back in the slot, one at
+        // a time; fall back to a synchronous exchange. The callback runs
+        // after the lock is released, so it may use the client again.
+        if (session_.replyChannel == 0) {
+            IpcResponse response;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                RequestResult status = exchangeMessage(channel_, session_, msg, timeoutMs);
+                response = takeResponse(msg, status);
+            }
+            callback(response);
+            return;
+        }
+
+        // Register the request before publishing it; the response may come
+        // back before publishRequest() even returns
+        int sequence = 0;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            windowChanged_.wait(lock, [this]() {
+                return pending_.size() + lateResponses_.size() < RESPONSE_RING_DEPTH || !open_;
+            });
+            if (!open_) {
+                lock.unlock();
+                releaseMessageBody(channel_, msg);
+                completeNow(callback, REQUEST_FAILED);
+                return;
+            }
+            sequence = ++session_.requestCounter;
+            pending_[sequence] = PendingRequest{std::move(callback),
+                                                std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs)};
+        }
+        msg.sequence = sequence;
+
+        RequestResult published = REQUEST_FAILED;
+        if (publishRequest(channel_, session_, msg, published) < 0) {
+            complete(sequence, published, nullptr);
+        }
+    }
+
+    // Function to turn a response Message into an IpcResponse, freeing its body
+    IpcResponse takeResponse(Message& msg, RequestResult status) {
+        IpcResponse response;
+        response.status = status;
+        response.sequence = msg.sequence;
+        if (status != REQUEST_OK) {
+            return response;
+        }
+
+        response.result = msg.result;
+        char scratch[OVERFLOW_CHUNK_SIZE];
+        std::string_view body;
+        if (messageBody(channel_, msg, scratch, body)) {
+            response.body.assign(body.data(), body.size());
+        }
+        releaseMessageBody(channel_, msg);
+        return response;
+    }
+
+    // Function to complete the request with `sequence`, if it is still
+    // pending; a response nobody waits for any more is only freed
+    void complete(int sequence, RequestResult status, Message* msg) {
+        Callback callback;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = pending_.find(sequence);
+            if (it != pending_.end()) {
+                callback = std::move(it->second.callback);
+                pending_.erase(it);
+            } else {
+                lateResponses_.erase(sequence);
+            }
+        }
+        windowChanged_.notify_all();
+
+        IpcResponse response;
+        if (msg != nullptr) {
+            response = takeResponse(*msg, status);
+        } else {
+            response.status = status;
+            response.sequence = sequence;
+        }
+        if (callback) {
+            callback(response);
+        }
+    }
+
+    // Function to time out requests whose deadline has passed. The server
+    // may still answer them, so each keeps its place in the window until
+    // its late response has been taken off the ring (or for LATE_RESPONSE_MS,
+    // in case the server dropped it); otherwise a burst of late responses
+    // could fill the ring and crowd out live ones.
+    void expireRequests() {
+        auto now = std::chrono::steady_clock::now();
+        std::vector<std::pair<int, Callback>> expired;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto it = pending_.begin(); it != pending_.end();) {
+                if (it->second.deadline <= now) {
+                    expired.emplace_back(it->first, std::move(it->second.callback));
+                    lateResponses_[it->first] = now + std::chrono::milliseconds(LATE_RESPONSE_MS);
+                    it = pending_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            for (auto it = lateResponses_.begin(); it != lateResponses_.end();) {
+                it = (it->second <= now) ? lateResponses_.erase(it) : std::next(it);
+            }
+        }
+        windowChanged_.notify_all();
+        
+        for (auto& entry : expired) {
+            IpcResponse response;
+            response.status = REQUEST_TIMEOUT;
+            response.sequence = entry.first;
+            if (entry.second) {
+                entry.second(response);
+            }
+        }
+    }
+
+    void failPending(RequestResult status) {
+        std::vector<int> sequences;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto& entry : pending_) {
+                sequences.push_back(entry.first);
+            }
+            lateResponses_.clear();   // the session's ring is gone
+        }
+        for (int sequence : sequences) {
+            complete(sequence, status, nullptr);
+        }
+    }
+
+    void receiveLoop() {
+        uint32_t index = static_cast<uint32_t>(session_.replyChannel - 1);
+        size_t headOffset = channelWordOffset(channel_, index, offsetof(ResponseChannel, head));
+        size_t tailOffset = channelWordOffset(channel_, index, offsetof(ResponseChannel, tail));
+        auto lastExpiry = std::chrono::steady_clock::now();
+        auto nextCheck = lastExpiry;
+
+        while (open_ && clientRunning) {
+            int head = 0;
+            int tail = 0;
+            IoBatch positions(channel_);
+            positions.loadWord(headOffset, head);
+            positions.loadWord(tailOffset, tail);
+            if (!positions.submit()) {
+                break;
+            }
+
+            if (head != tail) {
+                Message msg{};
+                IoBatch take(channel_);
+                take.readMessage(responseEntryOffset(channel_, index, tail), msg);
+                take.storeWord(tailOffset, tail + 1);
+                if (!take.submit()) {
+                    break;
+                }
+                complete(msg.sequence, REQUEST_OK, &msg);
+                continue;
+            }
+
+            // Deadlines are coarse; checking them once per wait period is enough
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastExpiry >= std::chrono::milliseconds(WAIT_POLL_INTERVAL_MS)) {
+                expireRequests();
+                lastExpiry = now;
+                
+                // The server expired the session; whoever owns the client reconnects
+                if (!ownsReplyChannel(channel_, session_)) {
+                    sessionLost_ = true;
+                    failPending(REQUEST_FAILED);
+                    break;
+                }
+            }
+            if (serverGone(channel_, now, nextCheck)) {
+                failPending(REQUEST_FAILED);
+            }
+            waitForResponse(channel_, index, head, WAIT_POLL_INTERVAL_MS);
+        }
+    }
+
+    IpcChannel channel_;
+    ClientSession session_;
+    std::atomic<bool> open_{false};
+    std::atomic<bool> sessionLost_{false};   // the server took the private channel back
+    std::thread receiver_;
+
+    std::mutex mutex_;
+    std::condition_variable windowChanged_;
+    std::unordered_map<int, PendingRequest> pending_;   // sequence -> request
+    std::unordered_map<int, std::chrono::steady_clock::time_point> lateResponses_;   // timed out, answer still due
+};
+
+#if IPC_HAVE_COROUTINES
+
+// Client operations as coroutines on a Reactor (C++20 builds). They follow
+// the blocking functions above step by step; only the waits differ.
+
+// Function to claim a slot and publish `msg` in it (see publishRequest).
+// Gives up after the same 500 ms without a free slot.
+inline Task<RequestResult> asyncPublishRequest(Reactor& reactor, IpcChannel& channel, const ClientSession& client,
+                                               Message& msg, int& slot) {
+    const int BUSY_TIMEOUT_MS = 5 * WAIT_POLL_INTERVAL_MS;
+    auto busyDeadline = Reactor::Clock::now() + std::chrono::milliseconds(BUSY_TIMEOUT_MS);
+    slot = -1;
+
+    while (!reactor.stopping()) {
+        int released = 0;
+        if (!loadWord(channel, RELEASE_COUNTER_OFFSET, released)) {
+            break;
+        }
+
+        slot = claimSlot(channel);
+        if (slot >= 0) {
+            co_return postRequest(channel, client, static_cast<uint32_t>(slot), msg) ? REQUEST_OK : REQUEST_FAILED;
+        }
+
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(busyDeadline - Reactor::Clock::now());
+        if (remaining.count() <= 0) {
+            releaseMessageBody(channel, msg);
+            co_return REQUEST_BUSY;
+        }
+        co_await reactor.waitWord(channel, RELEASE_COUNTER_OFFSET, released, static_cast<int>(remaining.count()),
+                                  SLOT_WAITERS_OFFSET, ANNOUNCE_COUNT);
+    }
+
+    releaseMessageBody(channel, msg);
+    co_return REQUEST_FAILED;
+}
+
+// Function to send one request and wait for its response (see exchangeMessage)
+inline Task<RequestResult> asyncExchangeMessage(Reactor& reactor, IpcChannel& channel, ClientSession& client,
+                                                Message& msg, int timeoutMs) {
+    validateSession(channel, client);
+    if (client.replyChannel > 0) {
+        msg.sequence = ++client.requestCounter;
+    }
+
+    int slot = -1;
+    RequestResult published = co_await asyncPublishRequest(reactor, channel, client, msg, slot);
+    if (published != REQUEST_OK) {
+        co_return published;
+    }
+
+    int expectedSequence = msg.sequence;
+    auto deadline = Reactor::Clock::now() + std::chrono::milliseconds(timeoutMs);
+    auto remainingMs = [&deadline]() {
+        return static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(deadline - Reactor::Clock::now()).count());
+    };
+    // The wait timeouts are capped so a dead server is noticed in time
+    auto nextCheck = std::chrono::steady_clock::now();
+    auto waitMs = [&remainingMs]() {
+        return std::min(remainingMs(), WAIT_POLL_INTERVAL_MS);
+    };
+
+    if (client.replyChannel > 0) {
+        uint32_t index = static_cast<uint32_t>(client.replyChannel - 1);
+        size_t headOffset = channelWordOffset(channel, index, offsetof(ResponseChannel, head));
+        size_t waitingOffset = channelWordOffset(channel, index, offsetof(ResponseChannel, clientWaiting));
+
+        while (!reactor.stopping()) {
+            int head = 0;
+            int polled = pollResponse(channel, index, expectedSequence, msg, head);
+            if (polled > 0) {
+                co_return REQUEST_OK;
+            }
+            if (polled < 0 || remainingMs() <= 0) {
+                break;
+            }
+            if (serverGone(channel, std::chrono::steady_clock::now(), nextCheck)) {
+                co_return REQUEST_FAILED;
+            }
+            co_await reactor.waitWord(channel, headOffset, head, waitMs(), waitingOffset, ANNOUNCE_FLAG);
+        }
+        validateSession(channel, client);
+        co_return reactor.stopping() ? REQUEST_FAILED : REQUEST_TIMEOUT;
+    }
+
+    while (!reactor.stopping()) {
+        int status = 0;
+        int polled = pollSlotResponse(channel, static_cast<uint32_t>(slot), expectedSequence, msg, status);
+        if (polled > 0) {
+            co_return REQUEST_OK;
+        }
+        if (polled < 0) {
+            if (status == SLOT_RESPONSE) {
+                co_return REQUEST_FAILED;
+            }
+            break;
+        }
+        if (remainingMs() <= 0) {
+            cancelRequest(channel, static_cast<uint32_t>(slot), msg);
+            co_return REQUEST_TIMEOUT;
+        }
+        if (serverGone(channel, std::chrono::steady_clock::now(), nextCheck)) {
+            break;
+        }
+        co_await reactor.waitWord(channel, slotStatusOffset(static_cast<uint32_t>(slot)), status, waitMs());
+    }
+
+    cancelRequest(channel, static_cast<uint32_t>(slot), msg);
+    co_return REQUEST_FAILED;
+}
+
+// Function to open a session with a hello handshake (see openSession)
+inline Task<RequestResult> asyncOpenSession(Reactor& reactor, IpcChannel& channel, ClientSession& client,
+                                            int timeoutMs) {
+    ClientSession handshake = client;
+    handshake.replyChannel = 0;
+
+    Message msg{};
+    prepareHello(channel, msg);
+    RequestResult result = co_await asyncExchangeMessage(reactor, channel, handshake, msg, timeoutMs);
+    if (result != REQUEST_OK) {
+        co_return result;
+    }
+    co_return acceptHello(channel, client, msg);
+}
+
+// Function to send one binary request (see exchangeBinary)
+inline Task<RequestResult> asyncExchangeBinary(Reactor& reactor, IpcChannel& channel, ClientSession& client,
+                                               Opcode opcode, std::string_view body, Message& msg, int timeoutMs) {
+    RequestResult prepared = prepareBinary(channel, client, opcode, body, msg);
+    if (prepared != REQUEST_OK) {
+        co_return prepared;
+    }
+    co_return co_await asyncExchangeMessage(reactor, channel, client, msg, timeoutMs);
+}
+
+#endif // IPC_HAVE_COROUTINES
+
+#endif
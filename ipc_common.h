@@ -0,0 +1,1619 @@
+#ifndef IPC_COMMON_H
+#define IPC_COMMON_H
+
+#ifdef _WIN32
+#define PLATFORM_WINDOWS 1
+#else
+#define PLATFORM_WINDOWS 0
+#endif
+
+#if PLATFORM_WINDOWS
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#define open _open
+#define read _read
+#define write _write
+#define close _close
+#define lseek _lseek
+#define fsync _commit
+#define unlink _unlink
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <signal.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "ipc_uring.h"
+#include <climits>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#if PLATFORM_WINDOWS
+#include <unordered_map>
+#endif
+
+// The server file is a ServerHeader followed by `slotCount` Message slots,
+// `channelCount` ResponseChannels and `overflowCount` OverflowChunks.
+// Clients claim a free slot with a CAS on its status word, publish the
+// request and ring the header doorbell; the server walks the slots in ring
+// order starting from where it last stopped. Once a client has been given
+// a private ResponseChannel, its responses come back there instead of the
+// shared slot, and the slot is recycled as soon as the server reads it.
+//
+// Every shared structure is cut into cache lines by who writes them, so a
+// word one side polls or CASes never shares a line with data the other side
+// is writing at the time: a handoff touches the control line and the lines
+// of the payload actually used, nothing else.
+const size_t CACHE_LINE_SIZE = 64;
+
+struct alignas(CACHE_LINE_SIZE) ServerHeader {
+    // Written at startup and shutdown, read by everyone
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t channelCount;
+    uint32_t overflowCount;
+    int serverState;      // ServerState
+    int serverPid;        // process ID of the server, checked along with the heartbeat; 0 = released in a handoff
+    int numaNode;         // NUMA node of the server's dispatcher and file memory, -1 = not placed
+
+    // Request handoff: clients ring the doorbell, the server sleeps on it
+    alignas(CACHE_LINE_SIZE) int doorbell;   // bumped after every published request
+    int serverSleeping;   // 1 while the server blocks on the doorbell
+
+    // Slot release: bumped on every release, clients out of slots sleep on it
+    alignas(CACHE_LINE_SIZE) int releaseCounter;   // bumped every time a slot goes back to SLOT_FREE
+    int slotWaiters;      // clients blocked waiting for a free slot
+
+    // Bumped by every client claim
+    alignas(CACHE_LINE_SIZE) int claimCursor;   // rotating start index for slot claims
+    int overflowCursor;   // rotating start index for overflow chunk claims
+
+    // Published by the server for liveness checks and client-side server selection
+    alignas(CACHE_LINE_SIZE) int heartbeat;   // heartbeatClockMs() of the server's last sign of life
+    int queueDepth;       // requests waiting in the ring (sampled)
+    int inFlight;         // requests taken off the ring and not answered yet
+    int latencyUs;        // moving average of take-to-response time
+    int clientCount;      // clients with a live session
+};
+
+// A slot held by a client (SLOT_CLAIMED, or SLOT_RESPONSE waiting to be
+// read) carries a lease: who holds it and until when. A slot whose holder
+// died or overran the lease is reclaimed (reclaimAbandonedSlot). `status`
+// and the lease words form the control line; the copied payload starts on
+// the next line with `client_id`.
+struct alignas(CACHE_LINE_SIZE) Message {
+    int status;
+    int lease_owner;      // process ID of the client holding the slot
+    int lease_expires;    // heartbeatClockMs() at which the lease ends, 0 = not started
+
+    alignas(CACHE_LINE_SIZE) int client_id;
+    int sequence;         // matches a response to its request, echoed by the server
+    int reply_channel;    // 1-based private ResponseChannel, 0 = answer in this slot
+    int type;             // MessageType: one command, or a packed batch in `data`
+    int flags;            // FRAME_* bits
+    int length;           // bytes of body in use, in `data` or in the overflow chunk
+    int overflow_chunk;   // 1-based OverflowChunk holding the body (FRAME_OVERFLOW)
+    int session_token;    // issued by MESSAGE_HELLO, sent back with every request
+    int opcode;           // Opcode of a MESSAGE_BINARY request
+    int result;           // ResultCode of a MESSAGE_BINARY or MESSAGE_HELLO response
+    int priority;         // PriorityClass of a request
+    char data[256];
+};
+
+// Message::flags
+const int FRAME_OVERFLOW = 1;   // body did not fit `data` and is in `overflow_chunk`
+const int FRAME_BINARY = 2;     // batch entries hold an opcode byte instead of text
+
+enum MessageType {
+    MESSAGE_SINGLE = 0,   // `data` is one NUL-terminated command / response
+    MESSAGE_BATCH = 1,    // `data` holds batch entries (see appendBatchEntry)
+    MESSAGE_HELLO = 2,    // session handshake, answered in the slot
+    MESSAGE_BINARY = 3    // command in `opcode`, optional body, nothing to parse
+};
+
+// Scheduling class of a request. The server serves the classes by
+// weighted fair queuing instead of plain arrival order, so a backlog of
+// bulk work does not hold up health checks and interactive requests.
+// PRIORITY_NORMAL is 0, so a request that does not say is normal.
+enum PriorityClass {
+    PRIORITY_NORMAL = 0,
+    PRIORITY_HIGH = 1,    // health checks, interactive traffic
+    PRIORITY_BULK = 2,    // throughput work that can wait
+    PRIORITY_COUNT
+};
+
+inline bool parsePriority(const std::string& name, int& priority) {
+    if (name == "high") {
+        priority = PRIORITY_HIGH;
+        return true;
+    }
+    if (name == "normal") {
+        priority = PRIORITY_NORMAL;
+        return true;
+    }
+    if (name == "bulk") {
+        priority = PRIORITY_BULK;
+        return true;
+    }
+    return false;
+}
+
+inline const char* priorityName(int priority) {
+    switch (priority) {
+        case PRIORITY_HIGH:
+            return "high";
+        case PRIORITY_BULK:
+            return "bulk";
+        default:
+            return "normal";
+    }
+}
+
+// Commands. Text requests name them ("ping"), binary requests and binary
+// batch entries carry the opcode.
+enum Opcode : uint8_t {
+    OP_PING,
+    OP_STATS,
+    OP_ERROR,
+    OP_TIMEOUT,
+    OP_CRASH,
+    OP_INVALID,
+    OP_COUNT
+};
+
+enum ResultCode {
+    RESULT_OK = 0,
+    RESULT_ERROR = 1,            // the command failed; the body says why
+    RESULT_UNKNOWN_OPCODE = 2,
+    RESULT_UNSUPPORTED = 3       // hello: no protocol version in common
+};
+
+// Protocol versions, negotiated in the hello handshake
+const uint16_t PROTOCOL_TEXT = 1;     // text commands and text batches
+const uint16_t PROTOCOL_BINARY = 2;   // adds MESSAGE_BINARY and binary batches
+const uint16_t PROTOCOL_MIN_VERSION = PROTOCOL_TEXT;
+const uint16_t PROTOCOL_VERSION = PROTOCOL_BINARY;
+
+// Body of a MESSAGE_HELLO. The client offers the versions it speaks; the
+// server answers with the newest one both sides know, in both fields.
+struct HelloBody {
+    uint16_t minVersion;
+    uint16_t maxVersion;
+};
+
+// Responses a client can have outstanding on its channel; IpcClient keeps at
+// most this many requests in flight
+const int RESPONSE_RING_DEPTH = 16;
+
+// Large message bodies. The sender claims a chunk, writes the body into it
+// and names it in the Message; whoever reads the message frees the chunk.
+const size_t OVERFLOW_CHUNK_SIZE = 4096;
+
+struct alignas(CACHE_LINE_SIZE) OverflowChunk {
+    int inUse;            // 0 = free, claimed with a CAS to 1
+    int reserved;
+    alignas(CACHE_LINE_SIZE) char data[OVERFLOW_CHUNK_SIZE];
+};
+
+// Single-producer (server) / single-consumer (owning client) ring of
+// responses. The producer and consumer indices live on separate lines.
+struct alignas(CACHE_LINE_SIZE) ResponseChannel {
+    int ownerId;          // client the channel is assigned to, 0 = unassigned
+    int ownerToken;       // session token of the owner
+    alignas(CACHE_LINE_SIZE) int head;   // responses published by the server
+    alignas(CACHE_LINE_SIZE) int tail;   // responses consumed by the client
+    int clientWaiting;    // 1 while the owner blocks on `head`
+    Message entries[RESPONSE_RING_DEPTH];
+};
+
+// The layout is shared between processes and builds; these pin it down
+static_assert(sizeof(ServerHeader) == 5 * CACHE_LINE_SIZE, "ServerHeader is five cache lines");
+static_assert(offsetof(ServerHeader, doorbell) == 1 * CACHE_LINE_SIZE &&
+              offsetof(ServerHeader, releaseCounter) == 2 * CACHE_LINE_SIZE &&
+              offsetof(ServerHeader, claimCursor) == 3 * CACHE_LINE_SIZE &&
+              offsetof(ServerHeader, heartbeat) == 4 * CACHE_LINE_SIZE,
+              "ServerHeader groups must start on their own cache lines");
+static_assert(offsetof(Message, status) == 0 && offsetof(Message, client_id) == CACHE_LINE_SIZE,
+              "Message payload must start on the line after the control words");
+static_assert(sizeof(Message) == 6 * CACHE_LINE_SIZE, "Message is a control line plus five payload lines");
+static_assert(offsetof(OverflowChunk, data) == CACHE_LINE_SIZE &&
+              sizeof(OverflowChunk) == CACHE_LINE_SIZE + OVERFLOW_CHUNK_SIZE,
+              "OverflowChunk data must start on the line after its claim word");
+static_assert(offsetof(ResponseChannel, head) == 1 * CACHE_LINE_SIZE &&
+              offsetof(ResponseChannel, tail) == 2 * CACHE_LINE_SIZE &&
+              offsetof(ResponseChannel, entries) == 3 * CACHE_LINE_SIZE,
+              "ResponseChannel indices must sit on their own cache lines");
+
+// Slot status values. 0/1/2 keep their original meaning.
+enum SlotStatus {
+    SLOT_FREE = 0,        // nobody owns the slot
+    SLOT_REQUEST = 1,     // client has published a request
+    SLOT_RESPONSE = 2,    // server has written the response
+    SLOT_CLAIMED = 3,     // client owns the slot and is writing the request
+    SLOT_PROCESSING = 4,  // server took the request
+    SLOT_CANCELLED = 5    // client gave up while the server was processing
+};
+
+// A successor takes over a server file with a CAS from SERVER_RUNNING to
+// SERVER_HANDOFF. The running server then stops taking requests, answers
+// the ones it took and releases the file by storing 0 as serverPid; the
+// successor stores its own PID and SERVER_RUNNING again. Requests in the
+// ring wait for the successor, and clients keep using the file throughout.
+enum ServerState {
+    SERVER_STOPPED = 0,
+    SERVER_RUNNING = 1,
+    SERVER_HANDOFF = 2
+};
+
+inline const char* SERVER_FILE_PREFIX = "ipc_server_";
+
+const uint32_t IPC_MAGIC = 0x31435049;   // "IPC1"
+const uint32_t IPC_LAYOUT_VERSION = 14;
+const uint32_t DEFAULT_SLOT_COUNT = 32;
+const uint32_t MAX_SLOT_COUNT = 1024;
+const uint32_t DEFAULT_CHANNEL_COUNT = 64;
+const uint32_t MAX_CHANNEL_COUNT = 4096;
+const uint32_t DEFAULT_OVERFLOW_COUNT = 16;
+const uint32_t MAX_OVERFLOW_COUNT = 1024;
+
+// Upper bound for a single wait on a shared word
+const int WAIT_POLL_INTERVAL_MS = 100;
+
+// Without a wakeup mechanism (file transport, non-Linux POSIX) a wait polls
+// the word, sleeping 10, 20, 40 ... us in between up to this period
+const int WAIT_FD_POLL_FIRST_US = 10;
+const int WAIT_FD_POLL_MAX_US = 1000;
+
+// How a process waits for a shared word to change (--wait=...).
+// WAIT_BLOCK goes straight to the futex / event / poll sleep of waitWord().
+// WAIT_HYBRID first busy-spins for `spinUs`, then sleeps in growing steps
+// for up to `backoffUs`, and only then blocks. WAIT_SPIN never blocks: for
+// pinned deployments where a core per waiter is cheaper than a wakeup.
+// Spinning waiters do not announce themselves, so the other side skips its
+// wake syscall as well.
+enum WaitMode {
+    WAIT_BLOCK,
+    WAIT_HYBRID,
+    WAIT_SPIN
+};
+
+struct WaitPolicy {
+    WaitMode mode = WAIT_BLOCK;
+    int spinUs = 50;
+    int backoffUs = 1000;
+};
+
+inline WaitPolicy waitPolicy;   // per process, set from the command line
+
+const int WAIT_BACKOFF_FIRST_US = 10;
+const int WAIT_BACKOFF_MAX_US = 200;
+const unsigned WAIT_SPIN_CHECK_MASK = 63;   // read the clock and yield every 64 polls
+
+inline bool parseWaitMode(const std::string& name, WaitMode& mode) {
+    if (name == "block") {
+        mode = WAIT_BLOCK;
+        return true;
+    }
+    if (name == "hybrid") {
+        mode = WAIT_HYBRID;
+        return true;
+    }
+    if (name == "spin") {
+        mode = WAIT_SPIN;
+        return true;
+    }
+    return false;
+}
+
+// The server refreshes ServerHeader::heartbeat this often; a heartbeat
+// older than SERVER_STALE_MS means the server is gone even if its file
+// still says SERVER_RUNNING (e.g. it crashed).
+const int SERVER_HEARTBEAT_INTERVAL_MS = 100;
+const int SERVER_STALE_MS = 2000;
+
+// Slot leases: claiming to publishing takes microseconds, and a client reads
+// its in-slot response well within its 5 s timeout (or cancels it)
+const int SLOT_CLAIM_LEASE_MS = 2000;
+const int SLOT_RESPONSE_LEASE_MS = 10000;
+
+// How a process talks to the server file.
+// TRANSPORT_MMAP maps the file and accesses the slots in place,
+// TRANSPORT_FILE uses positioned read/write calls and a file lock for CAS,
+// TRANSPORT_SHM keeps the file in shared memory instead of the working
+// directory (a POSIX shm_open object, or a named mapping backed by the
+// paging file on Windows) and maps it like TRANSPORT_MMAP,
+// TRANSPORT_URING is TRANSPORT_FILE with the reads and writes going through
+// an io_uring engine (Linux; elsewhere, or if the kernel refuses, it falls
+// back to the positioned calls). It shares files with TRANSPORT_FILE.
+// All processes sharing a file should use the same transport, because the
+// file lock does not exclude atomic instructions on a mapping, and shared
+// memory files are not visible to the other transports at all.
+enum TransportMode {
+    TRANSPORT_FILE,
+    TRANSPORT_MMAP,
+    TRANSPORT_SHM,
+    TRANSPORT_URING
+};
+
+// Transports that access the file with read/write calls instead of a mapping
+inline bool isFileTransport(TransportMode mode) {
+    return mode == TRANSPORT_FILE || mode == TRANSPORT_URING;
+}
+
+// Shared words are accessed through the mapping by several processes,
+// so they must be plain lock-free atomic ints.
+static_assert(sizeof(std::atomic<int>) == sizeof(int), "atomic<int> must match int layout");
+static_assert(std::atomic<int>::is_always_lock_free, "atomic<int> must be lock-free");
+
+struct IpcChannel {
+    int fd = -1;
+    std::string name;
+    TransportMode mode = TRANSPORT_MMAP;
+    bool syncWrites = false;   // fsync/msync after every write (off by default)
+    uint32_t slotCount = 0;
+    uint32_t channelCount = 0;
+    uint32_t overflowCount = 0;
+    size_t mappedSize = 0;
+    char* view = nullptr;      // mapped file, only in TRANSPORT_MMAP
+    bool prefault = false;     // fault the whole mapping in when it is opened (server --prealloc)
+    std::mutex lockMutex;      // file transport: serializes CAS between threads
+#if defined(__linux__)
+    std::unique_ptr<UringEngine> uring;   // TRANSPORT_URING, if the kernel allows it
+#endif
+#if PLATFORM_WINDOWS
+    HANDLE mapping = nullptr;
+    std::mutex eventMutex;
+    std::unordered_map<size_t, HANDLE> events;   // named auto-reset event per waited word
+#endif
+};
+
+inline size_t serverFileSize(uint32_t slotCount, uint32_t channelCount, uint32_t overflowCount) {
+    return sizeof(ServerHeader) + static_cast<size_t>(slotCount) * sizeof(Message) +
+           static_cast<size_t>(channelCount) * sizeof(ResponseChannel) +
+           static_cast<size_t>(overflowCount) * sizeof(OverflowChunk);
+}
+
+inline size_t slotOffset(uint32_t slot) {
+    return sizeof(ServerHeader) + static_cast<size_t>(slot) * sizeof(Message);
+}
+
+inline size_t slotStatusOffset(uint32_t slot) {
+    return slotOffset(slot) + offsetof(Message, status);
+}
+
+// `index` is 0-based here; Message::reply_channel stores index + 1
+inline size_t responseChannelOffset(const IpcChannel& channel, uint32_t index) {
+    return sizeof(ServerHeader) + static_cast<size_t>(channel.slotCount) * sizeof(Message) +
+           static_cast<size_t>(index) * sizeof(ResponseChannel);
+}
+
+inline size_t responseEntryOffset(const IpcChannel& channel, uint32_t index, int position) {
+    return responseChannelOffset(channel, index) + offsetof(ResponseChannel, entries) +
+           static_cast<size_t>(position % RESPONSE_RING_DEPTH) * sizeof(Message);
+}
+
+// `index` is 0-based here; Message::overflow_chunk stores index + 1
+inline size_t overflowChunkOffset(const IpcChannel& channel, uint32_t index) {
+    return responseChannelOffset(channel, channel.channelCount) +
+           static_cast<size_t>(index) * sizeof(OverflowChunk);
+}
+
+const size_t SERVER_STATE_OFFSET = offsetof(ServerHeader, serverState);
+const size_t DOORBELL_OFFSET = offsetof(ServerHeader, doorbell);
+const size_t SERVER_SLEEPING_OFFSET = offsetof(ServerHeader, serverSleeping);
+const size_t RELEASE_COUNTER_OFFSET = offsetof(ServerHeader, releaseCounter);
+const size_t SLOT_WAITERS_OFFSET = offsetof(ServerHeader, slotWaiters);
+const size_t CLAIM_CURSOR_OFFSET = offsetof(ServerHeader, claimCursor);
+const size_t OVERFLOW_CURSOR_OFFSET = offsetof(ServerHeader, overflowCursor);
+const size_t HEARTBEAT_OFFSET = offsetof(ServerHeader, heartbeat);
+const size_t SERVER_PID_OFFSET = offsetof(ServerHeader, serverPid);
+const size_t NUMA_NODE_OFFSET = offsetof(ServerHeader, numaNode);
+const size_t QUEUE_DEPTH_OFFSET = offsetof(ServerHeader, queueDepth);
+const size_t IN_FLIGHT_OFFSET = offsetof(ServerHeader, inFlight);
+const size_t LATENCY_US_OFFSET = offsetof(ServerHeader, latencyUs);
+const size_t CLIENT_COUNT_OFFSET = offsetof(ServerHeader, clientCount);
+
+inline bool parseTransportMode(const std::string& name, TransportMode& mode) {
+    if (name == "mmap") {
+        mode = TRANSPORT_MMAP;
+        return true;
+    }
+    if (name == "file") {
+        mode = TRANSPORT_FILE;
+        return true;
+    }
+    if (name == "shm") {
+        mode = TRANSPORT_SHM;
+        return true;
+    }
+    if (name == "uring") {
+        mode = TRANSPORT_URING;
+        return true;
+    }
+    return false;
+}
+
+// Positioned I/O used by the file transport and for reading the header
+inline bool readAt(int fd, size_t offset, void* buffer, size_t length) {
+#if !PLATFORM_WINDOWS
+    return pread(fd, buffer, length, static_cast<off_t>(offset)) == static_cast<ssize_t>(length);
+#else
+    if (_lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) == -1) {
+        return false;
+    }
+    return read(fd, buffer, static_cast<unsigned>(length)) == static_cast<int>(length);
+#endif
+}
+
+inline bool writeAt(int fd, size_t offset, const void* buffer, size_t length) {
+#if !PLATFORM_WINDOWS
+    return pwrite(fd, buffer, length, static_cast<off_t>(offset)) == static_cast<ssize_t>(length);
+#else
+    if (_lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) == -1) {
+        return false;
+    }
+    return write(fd, buffer, static_cast<unsigned>(length)) == static_cast<int>(length);
+#endif
+}
+
+// Shared files. Server and registry files live in the working directory,
+// or in shared memory with TRANSPORT_SHM; these functions are the only ones
+// that know where. Everything else goes through the channel, either its
+// fd or its mapping.
+
+#if !PLATFORM_WINDOWS
+inline std::string sharedMemoryName(const std::string& name) {
+    return "/" + name;
+}
+#else
+inline std::string sharedMemoryName(const std::string& name) {
+    return "Local\\" + name;
+}
+#endif
+
+inline bool resizeFile(int fd, size_t size) {
+#if !PLATFORM_WINDOWS
+    return ftruncate(fd, static_cast<off_t>(size)) == 0;
+#else
+    return _chsize_s(fd, static_cast<__int64>(size)) == 0;
+#endif
+}
+
+// Function to reserve the disk blocks (or shared memory pages) of a file
+// up front, so later writes never allocate and cannot fail for lack of
+// space, and to start reading it into the page cache. Without fallocate
+// the file keeps the size resizeFile() gave it.
+inline bool preallocateFile(int fd, size_t size) {
+    if (fd == -1) {
+        return true;   // Windows shared memory is committed when it is created
+    }
+#if defined(__linux__)
+    if (posix_fallocate(fd, 0, static_cast<off_t>(size)) != 0) {
+        return false;
+    }
+    posix_fadvise(fd, 0, static_cast<off_t>(size), POSIX_FADV_WILLNEED);
+#else
+    (void)size;
+#endif
+    return true;
+}
+
+#if PLATFORM_WINDOWS
+// Function to create or open a named mapping backed by the paging file and
+// map all of it. The mapping lives as long as some process has it open.
+inline bool openSharedMapping(IpcChannel& channel, const std::string& name, bool create, size_t size) {
+    std::string mappingName = sharedMemoryName(name);
+    HANDLE mapping = nullptr;
+    if (create) {
+        uint64_t total = size;
+        mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                                     static_cast<DWORD>(total >> 32), static_cast<DWORD>(total), mappingName.c_str());
+        if (mapping != nullptr && GetLastError() == ERROR_ALREADY_EXISTS) {
+            CloseHandle(mapping);
+            return false;
+        }
+    } else {
+        mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, mappingName.c_str());
+    }
+    if (mapping == nullptr) {
+        return false;
+    }
+
+    char* view = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+    MEMORY_BASIC_INFORMATION info{};
+    if (view == nullptr || VirtualQuery(view, &info, sizeof(info)) == 0) {
+        if (view != nullptr) {
+            UnmapViewOfFile(view);
+        }
+        CloseHandle(mapping);
+        return false;
+    }
+    channel.mapping = mapping;
+    channel.view = view;
+    channel.mappedSize = info.RegionSize;
+    return true;
+}
+#endif
+
+// Function to open shared file `name` for `channel`. With `create` the file
+// must not exist yet and is created with `size` bytes. Sets `channel.fd`;
+// shared memory on Windows has no fd and is mapped here instead.
+inline bool openSharedFile(IpcChannel& channel, const std::string& name, TransportMode mode, bool create,
+                           size_t size = 0) {
+#if PLATFORM_WINDOWS
+    if (mode == TRANSPORT_SHM) {
+        return openSharedMapping(channel, name, create, size);
+    }
+#endif
+
+    int flags = create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR;
+#if !PLATFORM_WINDOWS
+    int fd = (mode == TRANSPORT_SHM) ? shm_open(sharedMemoryName(name).c_str(), flags, S_IRUSR | S_IWUSR)
+                                     : open(name.c_str(), flags, S_IRUSR | S_IWUSR);
+#else
+    int fd = open(name.c_str(), flags, S_IRUSR | S_IWUSR);
+#endif
+    if (fd == -1) {
+        return false;
+    }
+    if (create && !resizeFile(fd, size)) {
+        close(fd);
+        return false;
+    }
+    channel.fd = fd;
+    return true;
+}
+
+// Function to delete a shared file. Channels still attached keep working.
+inline bool removeSharedFile(const std::string& name, TransportMode mode) {
+#if !PLATFORM_WINDOWS
+    if (mode == TRANSPORT_SHM) {
+        return shm_unlink(sharedMemoryName(name).c_str()) == 0;
+    }
+#else
+    if (mode == TRANSPORT_SHM) {
+        return true;   // goes away with the last handle
+    }
+#endif
+    return unlink(name.c_str()) == 0;
+}
+
+// Function to list the shared files of a transport. Shared memory can only
+// be listed on Linux (/dev/shm); elsewhere discovery relies on the registry.
+inline std::vector<std::string> listSharedFiles(TransportMode mode) {
+    std::vector<std::string> names;
+
+#if !PLATFORM_WINDOWS
+    const char* directory = ".";
+    if (mode == TRANSPORT_SHM) {
+#if defined(__linux__)
+        directory = "/dev/shm";
+#else
+        return names;
+#endif
+    }
+    DIR* dir = opendir(directory);
+    if (dir) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            names.push_back(entry->d_name);
+        }
+        closedir(dir);
+    }
+#else
+    if (mode == TRANSPORT_SHM) {
+        return names;
+    }
+    WIN32_FIND_DATA findFileData;
+    HANDLE hFind = FindFirstFile("*", &findFileData);
+    if (hFind != INVALID_HANDLE_VALUE) {
+        do {
+            names.push_back(findFileData.cFileName);
+        } while (FindNextFile(hFind, &findFileData) != 0);
+        FindClose(hFind);
+    }
+#endif
+
+    return names;
+}
+
+// Function to read or write a shared file before (or without) mapping it
+inline bool readShared(IpcChannel& channel, size_t offset, void* buffer, size_t length) {
+    if (channel.view != nullptr) {
+        if (offset + length > channel.mappedSize) {
+            return false;
+        }
+        std::memcpy(buffer, channel.view + offset, length);
+        return true;
+    }
+    return readAt(channel.fd, offset, buffer, length);
+}
+
+inline bool writeShared(IpcChannel& channel, size_t offset, const void* buffer, size_t length) {
+    if (channel.view != nullptr) {
+        if (offset + length > channel.mappedSize) {
+            return false;
+        }
+        std::memcpy(channel.view + offset, buffer, length);
+        return true;
+    }
+    return writeAt(channel.fd, offset, buffer, length);
+}
+
+inline bool isChannelOpen(const IpcChannel& channel) {
+    return channel.fd != -1 || channel.view != nullptr;
+}
+
+// Function to map the whole server file
+inline bool mapChannel(IpcChannel& channel, size_t size) {
+#if !PLATFORM_WINDOWS
+    int flags = MAP_SHARED;
+#if defined(__linux__)
+    if (channel.prefault) {
+        flags |= MAP_POPULATE;   // read the whole file in with the mapping
+    }
+#endif
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, channel.fd, 0);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    channel.view = static_cast<char*>(addr);
+#else
+    HANDLE file = reinterpret_cast<HANDLE>(_get_osfhandle(channel.fd));
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    channel.mapping = CreateFileMapping(file, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(size), nullptr);
+    if (channel.mapping == nullptr) {
+        return false;
+    }
+    channel.view = static_cast<char*>(MapViewOfFile(channel.mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+    if (channel.view == nullptr) {
+        CloseHandle(channel.mapping);
+        channel.mapping = nullptr;
+        return false;
+    }
+#endif
+    channel.mappedSize = size;
+    return true;
+}
+
+// Function to fault in every page of a mapping for writing, so the first
+// request to touch a slot, channel or chunk takes no page fault. Each page
+// gets an atomic add of 0, which is safe while other processes use it.
+inline void prefaultMapping(IpcChannel& channel) {
+    const size_t PAGE_STRIDE = 4096;   // the smallest page size in use
+    for (size_t offset = 0; offset + sizeof(int) <= channel.mappedSize; offset += PAGE_STRIDE) {
+        reinterpret_cast<std::atomic<int>*>(channel.view + offset)->fetch_add(0, std::memory_order_relaxed);
+    }
+}
+
+// Function to keep a mapping resident, so slot memory is never paged out
+// between requests. Needs a RLIMIT_MEMLOCK as large as the file.
+inline bool lockChannelMemory(IpcChannel& channel) {
+    if (channel.view == nullptr) {
+        return true;
+    }
+#if !PLATFORM_WINDOWS
+    return mlock(channel.view, channel.mappedSize) == 0;
+#else
+    return VirtualLock(channel.view, channel.mappedSize) != 0;
+#endif
+}
+
+// Function to attach a channel to an already initialized server file,
+// opened with openSharedFile(). The header is read first so every transport
+// learns the slot count. `name` identifies the server file for the wakeup
+// events on Windows.
+inline bool openChannel(IpcChannel& channel, const std::string& name, TransportMode mode, bool syncWrites) {
+    channel.name = name;
+    channel.mode = mode;
+    channel.syncWrites = syncWrites;
+
+    ServerHeader header{};
+    if (!readShared(channel, 0, &header, sizeof(header))) {
+        return false;
+    }
+    if (header.magic != IPC_MAGIC || header.version != IPC_LAYOUT_VERSION ||
+        header.slotCount == 0 || header.slotCount > MAX_SLOT_COUNT ||
+        header.channelCount > MAX_CHANNEL_COUNT || header.overflowCount > MAX_OVERFLOW_COUNT) {
+        return false;
+    }
+    channel.slotCount = header.slotCount;
+    channel.channelCount = header.channelCount;
+    channel.overflowCount = header.overflowCount;
+
+    size_t size = serverFileSize(header.slotCount, header.channelCount, header.overflowCount);
+    if (isFileTransport(mode)) {
+#if defined(__linux__)
+        if (mode == TRANSPORT_URING && !channel.uring) {
+            channel.uring = std::make_unique<UringEngine>();
+            if (!channel.uring->setup(channel.fd)) {
+                channel.uring.reset();
+            }
+        }
+#endif
+        return true;
+    }
+    // Shared memory on Windows is mapped whole by openSharedFile
+    if (channel.view == nullptr ? !mapChannel(channel, size) : channel.mappedSize < size) {
+        return false;
+    }
+    if (channel.prefault) {
+        prefaultMapping(channel);
+    }
+    return true;
+}
+
+inline void closeChannel(IpcChannel& channel) {
+    if (channel.view != nullptr) {
+#if !PLATFORM_WINDOWS
+        munmap(channel.view, channel.mappedSize);
+#else
+        UnmapViewOfFile(channel.view);
+        CloseHandle(channel.mapping);
+        channel.mapping = nullptr;
+#endif
+        channel.view = nullptr;
+        channel.mappedSize = 0;
+    }
+
+#if PLATFORM_WINDOWS
+    for (auto& entry : channel.events) {
+        CloseHandle(entry.second);
+    }
+    channel.events.clear();
+#endif
+#if defined(__linux__)
+    channel.uring.reset();
+#endif
+
+    if (channel.fd != -1) {
+        close(channel.fd);
+        channel.fd = -1;
+    }
+    channel.slotCount = 0;
+    channel.channelCount = 0;
+    channel.overflowCount = 0;
+}
+
+// Milliseconds on the monotonic clock, truncated to fit a shared int.
+// The clock is system-wide, so servers and clients on the same machine can
+// compare heartbeats; differences are taken modulo 2^32.
+inline int heartbeatClockMs() {
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    return static_cast<int>(static_cast<uint32_t>(now));
+}
+
+inline int currentProcessId() {
+#if !PLATFORM_WINDOWS
+    return static_cast<int>(getpid());
+#else
+    return static_cast<int>(GetCurrentProcessId());
+#endif
+}
+
+// Function to check whether a process on this machine still exists.
+// Unknown (0) or unreadable processes count as alive.
+inline bool isProcessAlive(int pid) {
+    if (pid <= 0) {
+        return true;
+    }
+#if !PLATFORM_WINDOWS
+    return kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH;
+#else
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, static_cast<DWORD>(pid));
+    if (process == nullptr) {
+        return GetLastError() != ERROR_INVALID_PARAMETER;
+    }
+    bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+    CloseHandle(process);
+    return alive;
+#endif
+}
+
+// Function to write a fresh header and empty slots (server side) into a
+// file opened with openSharedFile(), resizing it if it was left behind
+inline bool initializeServerFile(IpcChannel& file, uint32_t slotCount, uint32_t channelCount,
+                                 uint32_t overflowCount, bool syncWrites) {
+    size_t size = serverFileSize(slotCount, channelCount, overflowCount);
+    if (file.view != nullptr ? file.mappedSize < size : !resizeFile(file.fd, size)) {
+        return false;   // a named mapping cannot grow
+    }
+
+    std::vector<char> slots(size - sizeof(ServerHeader), 0);
+    if (!writeShared(file, sizeof(ServerHeader), slots.data(), slots.size())) {
+        return false;
+    }
+
+    ServerHeader header{};
+    header.magic = IPC_MAGIC;
+    header.version = IPC_LAYOUT_VERSION;
+    header.slotCount = slotCount;
+    header.channelCount = channelCount;
+    header.overflowCount = overflowCount;
+    header.serverState = SERVER_RUNNING;
+    header.heartbeat = heartbeatClockMs();
+    header.serverPid = currentProcessId();
+    header.numaNode = -1;
+    if (!writeShared(file, 0, &header, sizeof(header))) {
+        return false;
+    }
+
+    if (syncWrites && file.fd != -1) {
+        fsync(file.fd);
+    }
+    return true;
+}
+
+inline std::atomic<int>& sharedWord(IpcChannel& channel, size_t offset) {
+    return *reinterpret_cast<std::atomic<int>*>(channel.view + offset);
+}
+
+// RAII lock used by the file transport for read-modify-write operations
+class FileLockGuard {
+public:
+    explicit FileLockGuard(IpcChannel& channel) : channel_(channel), threadLock_(channel.lockMutex) {
+#if !PLATFORM_WINDOWS
+        locked_ = (flock(channel_.fd, LOCK_EX) == 0);
+#else
+        HANDLE file = reinterpret_cast<HANDLE>(_get_osfhandle(channel_.fd));
+        OVERLAPPED overlapped{};
+        locked_ = LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped) != 0;
+#endif
+    }
+
+    ~FileLockGuard() {
+        if (!locked_) return;
+#if !PLATFORM_WINDOWS
+        flock(channel_.fd, LOCK_UN);
+#else
+        HANDLE file = reinterpret_cast<HANDLE>(_get_osfhandle(channel_.fd));
+        OVERLAPPED overlapped{};
+        UnlockFileEx(file, 0, 1, 0, &overlapped);
+#endif
+    }
+
+    bool locked() const { return locked_; }
+
+private:
+    IpcChannel& channel_;
+    std::lock_guard<std::mutex> threadLock_;
+    bool locked_ = false;
+};
+
+inline void syncRange(IpcChannel& channel, size_t offset, size_t length) {
+    if (!channel.syncWrites) {
+        return;
+    }
+    if (channel.view == nullptr) {
+        fsync(channel.fd);
+        return;
+    }
+#if !PLATFORM_WINDOWS
+    // msync needs a page-aligned start address
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t start = offset - (offset % page);
+    msync(channel.view + start, offset + length - start, MS_SYNC);
+#else
+    FlushViewOfFile(channel.view + offset, length);
+#endif
+}
+
+#if PLATFORM_WINDOWS
+inline HANDLE eventForWord(IpcChannel& channel, size_t offset) {
+    std::lock_guard<std::mutex> lock(channel.eventMutex);
+    auto it = channel.events.find(offset);
+    if (it != channel.events.end()) {
+        return it->second;
+    }
+    // Both sides open the same named event; failure just leaves polling.
+    // Manual reset, so one SetEvent releases every process waiting on it.
+    std::string eventName = "Local\\" + channel.name + "." + std::to_string(offset);
+    HANDLE event = CreateEventA(nullptr, TRUE, FALSE, eventName.c_str());
+    channel.events[offset] = event;
+    return event;
+}
+#endif
+
+// Word-level operations. Every shared control field is an int accessed
+// through these, so the slot protocol is written once for both transports.
+inline bool loadWord(IpcChannel& channel, size_t offset, int& value) {
+    if (channel.view != nullptr) {
+        value = sharedWord(channel, offset).load(std::memory_order_acquire);
+        return true;
+    }
+    return readAt(channel.fd, offset, &value, sizeof(value));
+}
+
+inline bool storeWord(IpcChannel& channel, size_t offset, int value) {
+    if (channel.view != nullptr) {
+        sharedWord(channel, offset).store(value, std::memory_order_seq_cst);
+        return true;
+    }
+    return writeAt(channel.fd, offset, &value, sizeof(value));
+}
+
+inline bool compareExchangeWord(IpcChannel& channel, size_t offset, int expected, int desired) {
+    if (channel.view != nullptr) {
+        return sharedWord(channel, offset).compare_exchange_strong(expected, desired, std::memory_order_seq_cst);
+    }
+
+    FileLockGuard lock(channel);
+    int current = 0;
+    if (!lock.locked() || !readAt(channel.fd, offset, &current, sizeof(current)) || current != expected) {
+        return false;
+    }
+    return writeAt(channel.fd, offset, &desired, sizeof(desired));
+}
+
+// Returns the previous value, or `fallback` if the word could not be updated
+inline int fetchAddWord(IpcChannel& channel, size_t offset, int delta, int fallback = 0) {
+    if (channel.view != nullptr) {
+        return sharedWord(channel, offset).fetch_add(delta, std::memory_order_seq_cst);
+    }
+
+    FileLockGuard lock(channel);
+    int current = 0;
+    if (!lock.locked() || !readAt(channel.fd, offset, &current, sizeof(current))) {
+        return fallback;
+    }
+    int updated = current + delta;
+    if (!writeAt(channel.fd, offset, &updated, sizeof(updated))) {
+        return fallback;
+    }
+    return current;
+}
+
+// Function to wake every process waiting on a shared word
+inline void wakeWord(IpcChannel& channel, size_t offset) {
+    if (channel.view == nullptr) {
+        return;
+    }
+#if defined(__linux__)
+    // Shared (non-private) futex: waiters live in other processes
+    syscall(SYS_futex, &sharedWord(channel, offset), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#elif PLATFORM_WINDOWS
+    HANDLE event = eventForWord(channel, offset);
+    if (event != nullptr) {
+        SetEvent(event);
+    }
+#else
+    (void)offset;
+#endif
+}
+
+// Function to block until a shared word is no longer `current`.
+// Returns early on a notification (or, without one, once polling sees the
+// change), otherwise after `timeoutMs`; callers always re-check the word,
+// so spurious returns are harmless.
+inline void waitWord(IpcChannel& channel, size_t offset, int current, int timeoutMs) {
+#if defined(__linux__)
+    if (channel.view != nullptr) {
+        struct timespec timeout;
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+        // Returns immediately with EAGAIN if the word already changed
+        syscall(SYS_futex, &sharedWord(channel, offset), FUTEX_WAIT, current, &timeout, nullptr, 0);
+        return;
+    }
+#elif PLATFORM_WINDOWS
+    if (channel.view != nullptr) {
+        // Reset before re-checking the word: a wake after the check still
+        // finds the event set. Every waiter resets it, so the wait is also
+        // capped in case another waiter's reset swallowed our wake.
+        HANDLE event = eventForWord(channel, offset);
+        int value = 0;
+        if (event != nullptr) {
+            ResetEvent(event);
+        }
+        if (event != nullptr && loadWord(channel, offset, value)) {
+            if (value == current) {
+                WaitForSingleObject(event, std::min(timeoutMs, WAIT_POLL_INTERVAL_MS));
+            }
+            return;
+        }
+    }
+#endif
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+    int sleepUs = WAIT_FD_POLL_FIRST_US;
+    int value = current;
+    while (Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::min(std::chrono::microseconds(sleepUs),
+                                             std::chrono::duration_cast<std::chrono::microseconds>(deadline - Clock::now())));
+        if (!loadWord(channel, offset, value) || value != current) {
+            return;
+        }
+        sleepUs = std::min(sleepUs * 2, WAIT_FD_POLL_MAX_US);
+    }
+}
+
+// Function to tell the CPU we are in a spin loop (saves power and lets a
+// sibling hyperthread run)
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+// Function to run the non-blocking part of the wait policy on a shared
+// word. Returns true if the wait is over (the word left `current`, it could
+// not be read, or `timeoutMs` passed), false if the caller should announce
+// itself and block with waitWord(). Callers re-check the word either way.
+inline bool spinOnWord(IpcChannel& channel, size_t offset, int current, int timeoutMs) {
+    if (waitPolicy.mode == WAIT_BLOCK) {
+        return false;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+    Clock::time_point spinEnd = waitPolicy.mode == WAIT_SPIN
+                                    ? deadline
+                                    : std::min(deadline, Clock::now() + std::chrono::microseconds(waitPolicy.spinUs));
+    int value = current;
+    for (unsigned polls = 1;; polls++) {
+        if (!loadWord(channel, offset, value) || value != current) {
+            return true;
+        }
+        if ((polls & WAIT_SPIN_CHECK_MASK) != 0) {
+            cpuRelax();
+            continue;
+        }
+        if (Clock::now() >= spinEnd) {
+            break;
+        }
+        std::this_thread::yield();   // keeps an oversubscribed machine usable
+    }
+    if (waitPolicy.mode == WAIT_SPIN) {
+        return true;
+    }
+
+    // Back off with sleeps too short for a wakeup to be worth it. A channel
+    // without a wakeup (no view) has nothing to block on, so it keeps
+    // polling at the longest step until the wait times out.
+    Clock::time_point backoffEnd = channel.view == nullptr
+                                       ? deadline
+                                       : std::min(deadline, Clock::now() + std::chrono::microseconds(waitPolicy.backoffUs));
+    int sleepUs = WAIT_BACKOFF_FIRST_US;
+    while (Clock::now() < backoffEnd) {
+        std::this_thread::sleep_for(std::chrono::microseconds(sleepUs));
+        if (!loadWord(channel, offset, value) || value != current) {
+            return true;
+        }
+        sleepUs = std::min(sleepUs * 2, WAIT_BACKOFF_MAX_US);
+    }
+    return Clock::now() >= deadline;
+}
+
+// Number of `data` bytes a message actually uses: the body plus its NUL
+// terminator, nothing for overflow bodies. Untrusted lengths are clamped.
+inline size_t inlineBodyBytes(const Message& msg) {
+    if ((msg.flags & FRAME_OVERFLOW) || msg.length <= 0) {
+        return (msg.flags & FRAME_OVERFLOW) ? 0 : 1;
+    }
+    return std::min(static_cast<size_t>(msg.length) + 1, sizeof(msg.data));
+}
+
+// Function to copy a Message record (slot or response entry) into a local Message.
+// The status is acquired first so the payload written before it is visible.
+// Only the used part of `data` is copied; the rest of `msg.data` is left as is.
+inline bool readMessageAt(IpcChannel& channel, size_t offset, Message& msg) {
+    if (channel.view != nullptr) {
+        Message* shared = reinterpret_cast<Message*>(channel.view + offset);
+        msg.status = sharedWord(channel, offset + offsetof(Message, status)).load(std::memory_order_acquire);
+        std::memcpy(&msg.client_id, &shared->client_id, offsetof(Message, data) - offsetof(Message, client_id));
+        std::memcpy(msg.data, shared->data, inlineBodyBytes(msg));
+        return true;
+    }
+    // One pread of the whole record is cheaper than a second call for the body
+    return readAt(channel.fd, offset, &msg, sizeof(Message));
+}
+
+// Function to write everything except the status word, up to the end of the
+// used body. The owner of the record hands it over afterwards with a status
+// store or CAS.
+inline bool writePayloadAt(IpcChannel& channel, size_t offset, const Message& msg) {
+    size_t length = offsetof(Message, data) - offsetof(Message, client_id) + inlineBodyBytes(msg);
+    const char* payload = reinterpret_cast<const char*>(&msg) + offsetof(Message, client_id);
+
+    if (channel.view != nullptr) {
+        std::memcpy(channel.view + offset + offsetof(Message, client_id), payload, length);
+        return true;
+    }
+    return writeAt(channel.fd, offset + offsetof(Message, client_id), payload, length);
+}
+
+// Function to check whether a channel has an I/O engine to batch requests for
+inline bool hasIoEngine(const IpcChannel& channel) {
+#if defined(__linux__)
+    return channel.uring != nullptr && channel.uring->usable();
+#else
+    (void)channel;
+    return false;
+#endif
+}
+
+// A group of reads and writes on a channel that go out together. On a
+// mapped channel each operation happens right away. On the file transports
+// they are queued, and submit() runs them in order: in one syscall through
+// the io_uring engine, else one positioned call each. Read results are only
+// valid once submit() returned true; after a failed operation the rest of
+// the group is skipped.
+class IoBatch {
+public:
+    explicit IoBatch(IpcChannel& channel) : channel_(channel) {}
+
+    void loadWord(size_t offset, int& value) {
+        if (channel_.view != nullptr) {
+            value = sharedWord(channel_, offset).load(std::memory_order_acquire);
+            return;
+        }
+        ops_.push_back(Op{OP_READ, offset, &value, sizeof(value), 0});
+    }
+
+    void storeWord(size_t offset, int value) {
+        if (channel_.view != nullptr) {
+            sharedWord(channel_, offset).store(value, std::memory_order_seq_cst);
+            return;
+        }
+        ops_.push_back(Op{OP_WRITE, offset, nullptr, sizeof(value), value});   // written from Op::word
+    }
+
+    void readMessage(size_t offset, Message& msg) {
+        if (channel_.view != nullptr) {
+            ok_ = readMessageAt(channel_, offset, msg) && ok_;
+            return;
+        }
+        ops_.push_back(Op{OP_READ, offset, &msg, sizeof(Message), 0});
+    }
+
+    void writePayload(size_t offset, const Message& msg) {
+        if (channel_.view != nullptr) {
+            ok_ = writePayloadAt(channel_, offset, msg) && ok_;
+            return;
+        }
+        size_t length = offsetof(Message, data) - offsetof(Message, client_id) + inlineBodyBytes(msg);
+        char* payload = reinterpret_cast<char*>(const_cast<Message*>(&msg)) + offsetof(Message, client_id);
+        ops_.push_back(Op{OP_WRITE, offset + offsetof(Message, client_id), payload, length, 0});
+    }
+
+    // Function to make the writes before it durable (only with --fsync)
+    void sync(size_t offset, size_t length) {
+        if (!channel_.syncWrites) {
+            return;
+        }
+        if (channel_.view != nullptr) {
+            syncRange(channel_, offset, length);
+            return;
+        }
+        ops_.push_back(Op{OP_SYNC, 0, nullptr, 0, 0});
+    }
+
+    bool submit() {
+        if (ops_.empty() || !ok_) {
+            return ok_;
+        }
+        for (Op& op : ops_) {
+            if (op.buffer == nullptr) {
+                op.buffer = &op.word;
+            }
+        }
+#if defined(__linux__)
+        if (channel_.uring && channel_.uring->usable()) {
+            std::vector<UringOp> uringOps;
+            uringOps.reserve(ops_.size());
+            for (const Op& op : ops_) {
+                uint8_t opcode = op.kind == OP_READ ? IORING_OP_READ_FIXED
+                               : op.kind == OP_WRITE ? IORING_OP_WRITE_FIXED : IORING_OP_FSYNC;
+                uringOps.push_back(UringOp{opcode, op.offset, op.buffer, static_cast<uint32_t>(op.length)});
+            }
+            ops_.clear();
+            ok_ = channel_.uring->execute(uringOps.data(), uringOps.size());
+            return ok_;
+        }
+#endif
+        for (const Op& op : ops_) {
+            bool done = op.kind == OP_READ ? readAt(channel_.fd, op.offset, op.buffer, op.length)
+                      : op.kind == OP_WRITE ? writeAt(channel_.fd, op.offset, op.buffer, op.length)
+                      : fsync(channel_.fd) == 0;
+            if (!done) {
+                ok_ = false;
+                break;
+            }
+        }
+        ops_.clear();
+        return ok_;
+    }
+
+private:
+    enum OpKind { OP_READ, OP_WRITE, OP_SYNC };
+    struct Op {
+        OpKind kind;
+        size_t offset;
+        void* buffer;
+        size_t length;
+        int word;   // value of a queued storeWord
+    };
+
+    IpcChannel& channel_;
+    std::vector<Op> ops_;
+    bool ok_ = true;
+};
+
+// Slot helpers
+
+// Returns the slot status, or -1 on error
+inline int loadSlotStatus(IpcChannel& channel, uint32_t slot) {
+    int status = 0;
+    if (!loadWord(channel, slotStatusOffset(slot), status)) {
+        return -1;
+    }
+    return status;
+}
+
+// Function to read the status of every slot into `statuses`
+// (channel.slotCount entries) as one batch, for scans of the whole ring
+inline bool loadSlotStatuses(IpcChannel& channel, int* statuses) {
+    IoBatch batch(channel);
+    for (uint32_t slot = 0; slot < channel.slotCount; slot++) {
+        batch.loadWord(slotStatusOffset(slot), statuses[slot]);
+    }
+    return batch.submit();
+}
+
+// `wake` is false for transitions nobody is waiting for (claims, pickups)
+inline bool storeSlotStatus(IpcChannel& channel, uint32_t slot, int status, bool wake = true) {
+    if (!storeWord(channel, slotStatusOffset(slot), status)) {
+        return false;
+    }
+    syncRange(channel, slotOffset(slot), sizeof(Message));
+    if (wake) {
+        wakeWord(channel, slotStatusOffset(slot));
+    }
+    return true;
+}
+
+inline bool compareExchangeSlotStatus(IpcChannel& channel, uint32_t slot, int expected, int desired,
+                                      bool wake = true) {
+    if (!compareExchangeWord(channel, slotStatusOffset(slot), expected, desired)) {
+        return false;
+    }
+    syncRange(channel, slotOffset(slot), sizeof(Message));
+    if (wake) {
+        wakeWord(channel, slotStatusOffset(slot));
+    }
+    return true;
+}
+
+inline size_t slotLeaseOffset(uint32_t slot, size_t field) {
+    return slotOffset(slot) + field;
+}
+
+inline int leaseDeadline(int durationMs) {
+    int deadline = heartbeatClockMs() + durationMs;
+    return deadline != 0 ? deadline : 1;   // 0 means "not started"
+}
+
+// Function to hand the lease of a slot to `owner` for `durationMs`
+inline void startSlotLease(IpcChannel& channel, uint32_t slot, int owner, int durationMs) {
+    storeWord(channel, slotLeaseOffset(slot, offsetof(Message, lease_owner)), owner);
+    storeWord(channel, slotLeaseOffset(slot, offsetof(Message, lease_expires)), leaseDeadline(durationMs));
+}
+
+inline void announceSlotRelease(IpcChannel& channel) {
+    fetchAddWord(channel, RELEASE_COUNTER_OFFSET, 1);
+
+    int waiters = 0;
+    if (loadWord(channel, SLOT_WAITERS_OFFSET, waiters) && waiters > 0) {
+        wakeWord(channel, RELEASE_COUNTER_OFFSET);
+    }
+}
+
+// Function for the holder of a slot to take its lease back before freeing
+// it, so a reclaim of the same slot cannot also succeed. Returns false if
+// the lease was already broken and the slot is no longer ours.
+inline bool takeSlotLease(IpcChannel& channel, uint32_t slot) {
+    size_t expiresOffset = slotLeaseOffset(slot, offsetof(Message, lease_expires));
+    int expires = 0;
+    if (!loadWord(channel, expiresOffset, expires)) {
+        return false;
+    }
+    return expires == 0 || compareExchangeWord(channel, expiresOffset, expires, 0);
+}
+
+// Function to give a slot back and wake clients waiting for a free one.
+// The lease is cleared first, so the next holder starts without one.
+inline void releaseSlot(IpcChannel& channel, uint32_t slot) {
+    IoBatch batch(channel);
+    batch.storeWord(slotLeaseOffset(slot, offsetof(Message, lease_expires)), 0);
+    batch.storeWord(slotStatusOffset(slot), SLOT_FREE);
+    batch.sync(slotOffset(slot), sizeof(Message));
+    batch.submit();
+    announceSlotRelease(channel);
+}
+
+inline void waitForSlotChange(IpcChannel& channel, uint32_t slot, int current, int timeoutMs) {
+    if (!spinOnWord(channel, slotStatusOffset(slot), current, timeoutMs)) {
+        waitWord(channel, slotStatusOffset(slot), current, timeoutMs);
+    }
+}
+
+inline bool readMessage(IpcChannel& channel, uint32_t slot, Message& msg) {
+    return readMessageAt(channel, slotOffset(slot), msg);
+}
+
+inline bool writePayload(IpcChannel& channel, uint32_t slot, const Message& msg) {
+    return writePayloadAt(channel, slotOffset(slot), msg);
+}
+
+inline bool writeMessage(IpcChannel& channel, uint32_t slot, const Message& msg, bool wake = true) {
+    if (!writePayload(channel, slot, msg)) {
+        return false;
+    }
+    return storeSlotStatus(channel, slot, msg.status, wake);
+}
+
+// Function to check that a server is running and still heartbeating; a
+// server being handed over still counts. Two loads from the header, no
+// request round trip.
+inline bool isServerAlive(IpcChannel& channel) {
+    int state = SERVER_STOPPED;
+    int heartbeat = 0;
+    if (!loadWord(channel, SERVER_STATE_OFFSET, state) || (state != SERVER_RUNNING && state != SERVER_HANDOFF) ||
+        !loadWord(channel, HEARTBEAT_OFFSET, heartbeat)) {
+        return false;
+    }
+    // A heartbeat stored just after our clock read comes out slightly negative
+    int32_t age = static_cast<int32_t>(static_cast<uint32_t>(heartbeatClockMs()) - static_cast<uint32_t>(heartbeat));
+    if (age > SERVER_STALE_MS) {
+        return false;
+    }
+
+    // A killed server is noticed at once, not only when its heartbeat ages
+    int pid = 0;
+    return !loadWord(channel, SERVER_PID_OFFSET, pid) || isProcessAlive(pid);
+}
+
+// Response channel helpers
+
+inline size_t channelWordOffset(IpcChannel& channel, uint32_t index, size_t field) {
+    return responseChannelOffset(channel, index) + field;
+}
+
+// Message bodies. Short bodies live in Message::data; anything that does
+// not fit goes into an overflow chunk, which the reader of the message
+// frees with releaseMessageBody() once it is done with the body.
+
+// Function to claim a free overflow chunk. Returns the 1-based chunk or 0.
+inline int allocateOverflowChunk(IpcChannel& channel) {
+    if (channel.overflowCount == 0) {
+        return 0;
+    }
+
+    uint32_t start = static_cast<uint32_t>(fetchAddWord(channel, OVERFLOW_CURSOR_OFFSET, 1));
+    for (uint32_t i = 0; i < channel.overflowCount; i++) {
+        uint32_t index = (start + i) % channel.overflowCount;
+        size_t offset = overflowChunkOffset(channel, index) + offsetof(OverflowChunk, inUse);
+        int inUse = 1;
+        if (loadWord(channel, offset, inUse) && inUse == 0 && compareExchangeWord(channel, offset, 0, 1)) {
+            return static_cast<int>(index + 1);
+        }
+    }
+    return 0;
+}
+
+inline void releaseOverflowChunk(IpcChannel& channel, int chunk) {
+    if (chunk <= 0 || static_cast<uint32_t>(chunk) > channel.overflowCount) {
+        return;
+    }
+    storeWord(channel, overflowChunkOffset(channel, static_cast<uint32_t>(chunk - 1)) + offsetof(OverflowChunk, inUse), 0);
+}
+
+// Function to set the body of an outgoing message: in place when it fits,
+// otherwise in a freshly claimed overflow chunk. Returns false if the body
+// is larger than a chunk or no chunk is free.
+inline bool setMessageBody(IpcChannel& channel, Message& msg, const char* body, size_t length) {
+    msg.flags &= ~FRAME_OVERFLOW;
+    msg.overflow_chunk = 0;
+
+    if (length < sizeof(msg.data)) {
+        std::memmove(msg.data, body, length);
+        msg.data[length] = '\0';
+        msg.length = static_cast<int>(length);
+        return true;
+    }
+
+    if (length > OVERFLOW_CHUNK_SIZE) {
+        return false;
+    }
+    int chunk = allocateOverflowChunk(channel);
+    if (chunk == 0) {
+        return false;
+    }
+
+    size_t offset = overflowChunkOffset(channel, static_cast<uint32_t>(chunk - 1)) + offsetof(OverflowChunk, data);
+    if (channel.view != nullptr) {
+        std::memcpy(channel.view + offset, body, length);
+    } else if (!writeAt(channel.fd, offset, body, length)) {
+        releaseOverflowChunk(channel, chunk);
+        return false;
+    }
+
+    msg.flags |= FRAME_OVERFLOW;
+    msg.overflow_chunk = chunk;
+    msg.length = static_cast<int>(length);
+    msg.data[0] = '\0';
+    return true;
+}
+
+inline bool setMessageText(IpcChannel& channel, Message& msg, std::string_view text) {
+    return setMessageBody(channel, msg, text.data(), text.size());
+}
+
+// Function to get the body of a received message. Inline bodies are viewed
+// in `msg.data`; overflow bodies are viewed in place in the mapping, or
+// read into `scratch` (OVERFLOW_CHUNK_SIZE bytes) by the file transport.
+// Returns false if the message names a chunk that does not exist.
+inline bool messageBody(IpcChannel& channel, const Message& msg, char* scratch, std::string_view& body) {
+    if (!(msg.flags & FRAME_OVERFLOW)) {
+        size_t length = msg.length > 0 ? static_cast<size_t>(msg.length) : 0;
+        body = std::string_view(msg.data, std::min(length, sizeof(msg.data) - 1));
+        return true;
+    }
+
+    if (msg.overflow_chunk <= 0 || static_cast<uint32_t>(msg.overflow_chunk) > channel.overflowCount ||
+        msg.length < 0 || static_cast<size_t>(msg.length) > OVERFLOW_CHUNK_SIZE) {
+        return false;
+    }
+    size_t offset = overflowChunkOffset(channel, static_cast<uint32_t>(msg.overflow_chunk - 1)) +
+                    offsetof(OverflowChunk, data);
+    if (channel.view != nullptr) {
+        body = std::string_view(channel.view + offset, static_cast<size_t>(msg.length));
+        return true;
+    }
+    if (!readAt(channel.fd, offset, scratch, static_cast<size_t>(msg.length))) {
+        return false;
+    }
+    body = std::string_view(scratch, static_cast<size_t>(msg.length));
+    return true;
+}
+
+inline void releaseMessageBody(IpcChannel& channel, const Message& msg) {
+    if (msg.flags & FRAME_OVERFLOW) {
+        releaseOverflowChunk(channel, msg.overflow_chunk);
+    }
+}
+
+// Function to free a slot whose client is gone: it died (or stalled past
+// its lease) between claiming the slot and publishing the request, or
+// before reading its in-slot response. With `checkOwner` a live lease is
+// also broken if its owner process no longer exists; that costs a syscall,
+// so only the server's periodic sweep does it. Returns true if the slot
+// was freed.
+inline bool reclaimAbandonedSlot(IpcChannel& channel, uint32_t slot, bool checkOwner) {
+    int status = loadSlotStatus(channel, slot);
+    if (status != SLOT_CLAIMED && status != SLOT_RESPONSE) {
+        return false;
+    }
+
+    size_t expiresOffset = slotLeaseOffset(slot, offsetof(Message, lease_expires));
+    int owner = 0;
+    int expires = 0;
+    if (!loadWord(channel, slotLeaseOffset(slot, offsetof(Message, lease_owner)), owner) ||
+        !loadWord(channel, expiresOffset, expires)) {
+        return false;
+    }
+    if (expires == 0) {
+        // Claimed a moment ago, or the client died before writing its lease:
+        // start the clock so a later pass can tell
+        compareExchangeWord(channel, expiresOffset, 0, leaseDeadline(SLOT_CLAIM_LEASE_MS));
+        return false;
+    }
+
+    bool expired = static_cast<int32_t>(static_cast<uint32_t>(heartbeatClockMs()) - static_cast<uint32_t>(expires)) >= 0;
+    if (!expired && (!checkOwner || isProcessAlive(owner))) {
+        return false;
+    }
+
+    // Nobody writes an abandoned slot, so its body can be read before taking it
+    Message response{};
+    if (status == SLOT_RESPONSE && !readMessage(channel, slot, response)) {
+        return false;
+    }
+
+    // Taking the lease first keeps two reclaimers (or a late owner) from
+    // both freeing the slot
+    if (!compareExchangeWord(channel, expiresOffset, expires, 0) ||
+        !compareExchangeSlotStatus(channel, slot, status, SLOT_FREE, false)) {
+        return false;
+    }
+    if (status == SLOT_RESPONSE) {
+        releaseMessageBody(channel, response);
+    }
+    announceSlotRelease(channel);
+    return true;
+}
+
+// Batch frames. A MESSAGE_BATCH carries many commands in one round trip.
+// Its body starts with the entry count, followed by entries of
+// [result byte][length byte][text]. Requests use result BATCH_ENTRY_OK.
+// With FRAME_BINARY the text of a request entry is just the opcode byte,
+// and ping responses come back empty.
+// The combined response holds one entry per request, in order; if it runs
+// out of space the server stops early, so a response with fewer entries
+// than the request means the rest were not processed and can be resent.
+
+const uint8_t BATCH_ENTRY_OK = 0;
+const uint8_t BATCH_ENTRY_ERROR = 1;
+const size_t BATCH_MAX_ENTRIES = 255;
+
+inline void beginBatch(char* buffer, size_t& used) {
+    buffer[0] = 0;
+    used = 1;
+}
+
+inline int batchEntryCount(std::string_view body) {
+    return body.empty() ? 0 : static_cast<unsigned char>(body[0]);
+}
+
+// Returns false without changing `buffer` if the entry does not fit
+inline bool appendBatchEntry(char* buffer, size_t capacity, size_t& used, uint8_t result, std::string_view text) {
+    int count = static_cast<unsigned char>(buffer[0]);
+    if (text.size() > 255 || count >= static_cast<int>(BATCH_MAX_ENTRIES) ||
+        used + 2 + text.size() > capacity) {
+        return false;
+    }
+    buffer[used] = static_cast<char>(result);
+    buffer[used + 1] = static_cast<char>(text.size());
+    std::memcpy(buffer + used + 2, text.data(), text.size());
+    used += 2 + text.size();
+    buffer[0] = static_cast<char>(count + 1);
+    return true;
+}
+
+// Reads the entry at `position` (start at 1) and advances past it.
+// Returns false at the end or if the entry runs past the body.
+inline bool readBatchEntry(std::string_view body, size_t& position, uint8_t& result, std::string_view& text) {
+    if (position + 2 > body.size()) {
+        return false;
+    }
+    size_t length = static_cast<unsigned char>(body[position + 1]);
+    if (position + 2 + length > body.size()) {
+        return false;
+    }
+    result = static_cast<uint8_t>(body[position]);
+    text = body.substr(position + 2, length);
+    position += 2 + length;
+    return true;
+}
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef IPC_NET_H
+#define IPC_NET_H
+
+// Network side of the IPC channel: the frame format spoken between the TCP
+// gateway (gateway.cpp) and remote clients, plus a small blocking client.
+// Local clients keep using the server file directly; remote ones send the
+// same commands as frames and the gateway forwards them into the slots.
+//
+// A frame is a fixed 16-byte header in network byte order followed by
+// `length` bytes of body:
+//
+//   uint32 length    bytes of body after the header
+//   uint32 sequence  chosen by the client, echoed in the response
+//   uint8  type      MESSAGE_SINGLE (text command) or MESSAGE_BINARY
+//   uint8  status    response: RequestResult of the forwarded request
+//   uint16 opcode    binary request: Opcode
+//   int32  result    response: ResultCode of a binary command
+//
+// Responses may arrive in any order; the sequence matches them up, so a
+// client can keep many requests in flight on one connection.
+
+#include "ipc_common.h"
+#include "ipc_client.h"
+
+#if !PLATFORM_WINDOWS
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#endif
+
+#include <cstdlib>
+#include <string>
+#include <string_view>
+
+const int DEFAULT_GATEWAY_PORT = 7070;
+const size_t WIRE_HEADER_SIZE = 16;
+const size_t WIRE_MAX_BODY = OVERFLOW_CHUNK_SIZE;
+
+struct WireFrame {
+    uint32_t length = 0;
+    uint32_t sequence = 0;
+    uint8_t type = MESSAGE_SINGLE;
+    uint8_t status = REQUEST_OK;
+    uint16_t opcode = 0;
+    int32_t result = RESULT_OK;
+};
+
+inline void putWireWord(char* out, uint32_t value) {
+    out[0] = static_cast<char>(value >> 24);
+    out[1] = static_cast<char>(value >> 16);
+    out[2] = static_cast<char>(value >> 8);
+    out[3] = static_cast<char>(value);
+}
+
+inline uint32_t getWireWord(const char* in) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(in);
+    return (static_cast<uint32_t>(bytes[0]) << 24) | (static_cast<uint32_t>(bytes[1]) << 16) |
+           (static_cast<uint32_t>(bytes[2]) << 8) | static_cast<uint32_t>(bytes[3]);
+}
+
+// Function to append a frame with `body` to `out`
+inline void appendWireFrame(std::string& out, WireFrame frame, std::string_view body) {
+    char header[WIRE_HEADER_SIZE];
+    frame.length = static_cast<uint32_t>(body.size());
+    putWireWord(header, frame.length);
+    putWireWord(header + 4, frame.sequence);
+    header[8] = static_cast<char>(frame.type);
+    header[9] = static_cast<char>(frame.status);
+    header[10] = static_cast<char>(frame.opcode >> 8);
+    header[11] = static_cast<char>(frame.opcode);
+    putWireWord(header + 12, static_cast<uint32_t>(frame.result));
+
+    out.append(header, WIRE_HEADER_SIZE);
+    out.append(body.data(), body.size());
+}
+
+// Function to decode the frame header at `in`. Returns false if the body
+// length is out of range, which means the stream cannot be trusted.
+inline bool decodeWireHeader(const char* in, WireFrame& frame) {
+    frame.length = getWireWord(in);
+    frame.sequence = getWireWord(in + 4);
+    frame.type = static_cast<uint8_t>(in[8]);
+    frame.status = static_cast<uint8_t>(in[9]);
+    frame.opcode = static_cast<uint16_t>((static_cast<unsigned char>(in[10]) << 8) | static_cast<unsigned char>(in[11]));
+    frame.result = static_cast<int32_t>(getWireWord(in + 12));
+    return frame.length <= WIRE_MAX_BODY;
+}
+
+// Function to split "host:port" (or just "host"); false if the port is bad
+inline bool parseHostPort(const std::string& text, std::string& host, int& port) {
+    size_t colon = text.rfind(':');
+    host = text.substr(0, colon);
+    port = DEFAULT_GATEWAY_PORT;
+    if (colon != std::string::npos) {
+        port = std::atoi(text.c_str() + colon + 1);
+    }
+    return !host.empty() && port > 0 && port < 65536;
+}
+
+#if !PLATFORM_WINDOWS
+
+// Function to send all of `data`; false if the connection broke
+inline bool sendAll(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        length -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+// Function to open a TCP connection to `host`:`port`; returns -1 on failure.
+// Requests are small and latency-bound, so Nagle's algorithm is off.
+inline int connectTcp(const std::string& host, int port, int timeoutMs) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (addrinfo* address = addresses; address != nullptr && fd < 0; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    timeval timeout{timeoutMs / 1000, (timeoutMs % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+// Blocking client of a gateway. Requests can be pipelined: send several,
+// then receive their responses (in any order) by sequence. One thread at
+// a time.
+class GatewayClient {
+public:
+    GatewayClient() = default;
+    GatewayClient(const GatewayClient&) = delete;
+    GatewayClient& operator=(const GatewayClient&) = delete;
+
+    ~GatewayClient() {
+        close();
+    }
+
+    bool connect(const std::string& host, int port, int timeoutMs = 5000) {
+        close();
+        fd_ = connectTcp(host, port, timeoutMs);
+        return fd_ >= 0;
+    }
+
+    void close() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        input_.clear();
+    }
+
+    bool isConnected() const {
+        return fd_ >= 0;
+    }
+
+    // Function to send a text command; returns its sequence, 0 on failure
+    uint32_t sendText(std::string_view command) {
+        WireFrame frame;
+        frame.type = MESSAGE_SINGLE;
+        return sendFrame(frame, command);
+    }
+
+    // Function to send a binary command; returns its sequence, 0 on failure
+    uint32_t send(Opcode opcode, std::string_view body = std::string_view()) {
+        WireFrame frame;
+        frame.type = MESSAGE_BINARY;
+        frame.opcode = static_cast<uint16_t>(opcode);
+        return sendFrame(frame, body);
+    }
+
+    // Function to wait for the next response, whichever request it answers.
+    // A broken or timed-out connection closes the client and reports
+    // REQUEST_FAILED / REQUEST_TIMEOUT.
+    IpcResponse receive() {
+        IpcResponse response;
+        WireFrame frame;
+        while (fd_ >= 0) {
+            if (input_.size() >= WIRE_HEADER_SIZE && !decodeWireHeader(input_.data(), frame)) {
+                break;
+            }
+            if (input_.size() >= WIRE_HEADER_SIZE && input_.size() >= WIRE_HEADER_SIZE + frame.length) {
+                response.status = static_cast<RequestResult>(frame.status);
+                response.result = frame.result;
+                response.sequence = static_cast<int>(frame.sequence);
+                response.body.assign(input_, WIRE_HEADER_SIZE, frame.length);
+                input_.erase(0, WIRE_HEADER_SIZE + frame.length);
+                return response;
+            }
+
+            char buffer[16384];
+            ssize_t received = recv(fd_, buffer, sizeof(buffer), 0);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                bool timedOut = received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+                response.status = timedOut ? REQUEST_TIMEOUT : REQUEST_FAILED;
+                close();
+                return response;
+            }
+            input_.append(buffer, static_cast<size_t>(received));
+        }
+        close();
+        response.status = REQUEST_FAILED;
+        return response;
+    }
+
+    // Function to send a text command and wait for its response
+    IpcResponse exchangeText(std::string_view command) {
+        uint32_t sequence = sendText(command);
+        if (sequence == 0) {
+            IpcResponse response;
+            response.status = REQUEST_FAILED;
+            return response;
+        }
+        // Skip late answers to earlier requests, whatever their status (an
+        // earlier request may have come back BUSY or TIMEOUT). A response
+        // for another sequence only ends the wait if the connection failed.
+        IpcResponse response = receive();
+        while (response.sequence != static_cast<int>(sequence) && isConnected()) {
+            response = receive();
+        }
+        return response;
+    }
+
+private:
+    uint32_t sendFrame(WireFrame& frame, std::string_view body) {
+        if (fd_ < 0 || body.size() > WIRE_MAX_BODY) {
+            return 0;
+        }
+        if (++nextSequence_ == 0) {
+            nextSequence_ = 1;
+        }
+        frame.sequence = nextSequence_;
+
+        std::string out;
+        appendWireFrame(out, frame, body);
+        if (!sendAll(fd_, out.data(), out.size())) {
+            close();
+            return 0;
+        }
+        return frame.sequence;
+    }
+
+    int fd_ = -1;
+    uint32_t nextSequence_ = 0;
+    std::string input_;   // received bytes not yet returned as responses
+};
+
+#endif // !PLATFORM_WINDOWS
+
+#endif
@@ -0,0 +1,451 @@
+#ifndef IPC_REACTOR_H
+#define IPC_REACTOR_H
+
+#include "ipc_common.h"
+
+// Optional coroutine runtime. Built only with C++20 coroutines; in C++17
+// builds this header defines IPC_HAVE_COROUTINES as 0 and nothing else.
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define IPC_HAVE_COROUTINES 1
+#else
+#define IPC_HAVE_COROUTINES 0
+#endif
+
+#if IPC_HAVE_COROUTINES
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <ctime>
+#ifndef SYS_futex_waitv
+#define SYS_futex_waitv 449
+#endif
+#endif
+
+// One thread runs many coroutines. Whatever would block a thread (waiting
+// for a shared word to change, a timeout, a delay) is a co_await on the
+// Reactor instead, which suspends the coroutine and resumes it from run()
+// once the word changed or the time is up. The words are the same futex
+// words the blocking code sleeps on, with the same announce-then-wait
+// handshake, so the other side wakes a reactor exactly like a thread.
+
+class Reactor;
+
+template <typename T>
+class Task;
+
+struct TaskPromiseBase {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+
+    // Tasks are lazy: they run once awaited
+    std::suspend_always initial_suspend() noexcept {
+        return {};
+    }
+
+    // Finishing resumes whoever awaited the task
+    struct FinalAwaiter {
+        bool await_ready() noexcept {
+            return false;
+        }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            return handle.promise().continuation;
+        }
+        void await_resume() noexcept {}
+    };
+
+    FinalAwaiter final_suspend() noexcept {
+        return {};
+    }
+
+    void unhandled_exception() {
+        std::terminate();
+    }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+    T value{};
+
+    Task<T> get_return_object();
+
+    void return_value(T result) {
+        value = std::move(result);
+    }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+
+    void return_void() {}
+};
+
+// Coroutine returning T to the coroutine that co_awaits it. Start a
+// top-level one with Reactor::spawn().
+template <typename T = void>
+class Task {
+public:
+    using promise_type = TaskPromise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    Task& operator=(Task&&) = delete;
+
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle_.promise().continuation = caller;
+        return handle_;
+    }
+
+    T await_resume() {
+        if constexpr (!std::is_void_v<T>) {
+            return std::move(handle_.promise().value);
+        }
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+template <typename T>
+inline Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// How a waiting reactor tells the other side it needs a wake syscall
+enum WaitAnnounce {
+    ANNOUNCE_NONE,    // the other side always wakes (slot status)
+    ANNOUNCE_FLAG,    // store 1 while waiting, 0 after (serverSleeping, clientWaiting)
+    ANNOUNCE_COUNT    // add 1 while waiting, remove it after (slotWaiters)
+};
+
+// Words a reactor blocks on at once with futex_waitv; more are polled
+const size_t REACTOR_MAX_FUTEX_WAITS = 128;
+const int REACTOR_POLL_INTERVAL_US = 1000;
+
+class Reactor {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // run() stops waiting once `keepRunning` is cleared: every pending
+    // wait and delay completes at once, so coroutines can wind down
+    explicit Reactor(std::atomic<bool>& keepRunning) : keepRunning_(keepRunning) {}
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    bool stopping() const {
+        return !keepRunning_;
+    }
+
+    // Function to start a top-level coroutine; it runs from run()
+    void spawn(Task<void> task) {
+        Detached detached = runDetached(*this, std::move(task));
+        live_++;
+        ready_.push_back(detached.handle);
+    }
+
+    // Function to run coroutines until all of them have finished
+    void run() {
+        while (live_ > 0) {
+            while (!ready_.empty()) {
+                std::vector<std::coroutine_handle<>> batch;
+                batch.swap(ready_);
+                for (auto handle : batch) {
+                    handle.resume();
+                }
+            }
+            if (live_ == 0) {
+                break;
+            }
+
+            collectCompleted(Clock::now());
+            if (ready_.empty()) {
+                sleepUntilEvent();
+            }
+        }
+    }
+
+    struct SleepAwaiter {
+        Reactor& reactor;
+        Clock::time_point deadline;
+
+        bool await_ready() const {
+            return reactor.stopping() || Clock::now() >= deadline;
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            reactor.timers_.push(Timer{deadline, reactor.timerSequence_++, handle});
+        }
+        void await_resume() {}
+    };
+
+    // co_await to suspend for `milliseconds`
+    SleepAwaiter sleepFor(int milliseconds) {
+        return SleepAwaiter{*this, Clock::now() + std::chrono::milliseconds(milliseconds)};
+    }
+
+    SleepAwaiter sleepUntil(Clock::time_point deadline) {
+        return SleepAwaiter{*this, deadline};
+    }
+
+    struct YieldAwaiter {
+        Reactor& reactor;
+
+        bool await_ready() const {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            reactor.yielded_.push_back(handle);
+        }
+        void await_resume() {}
+    };
+
+    // co_await to let due timers and changed words run first
+    YieldAwaiter yield() {
+        return YieldAwaiter{*this};
+    }
+
+    // Function to check whether a busy coroutine should yield
+    bool hasDueWork() {
+        return !ready_.empty() || (!timers_.empty() && timers_.top().deadline <= Clock::now());
+    }
+
+    struct WordWait {
+        IpcChannel* channel;
+        size_t offset;
+        int current;
+        Clock::time_point deadline;
+        size_t announceOffset;
+        WaitAnnounce announce;
+        std::coroutine_handle<> handle;
+        bool changed = false;
+    };
+
+    struct WordAwaiter {
+        Reactor& reactor;
+        WordWait wait;
+
+        bool await_ready() {
+            int value = 0;
+            if (reactor.stopping() || !loadWord(*wait.channel, wait.offset, value)) {
+                return true;
+            }
+            wait.changed = (value != wait.current);
+            return wait.changed;
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            wait.handle = handle;
+            reactor.announce(wait, true);
+            reactor.waits_.push_back(&wait);
+        }
+        bool await_resume() const {
+            return wait.changed;
+        }
+    };
+
+    // co_await until the shared word at `offset` is no longer `current`
+    // (true) or `timeoutMs` passed (false). Like waitWord(), callers always
+    // re-check the word, so an early return is harmless.
+    WordAwaiter waitWord(IpcChannel& channel, size_t offset, int current, int timeoutMs,
+                         size_t announceOffset = 0, WaitAnnounce announce = ANNOUNCE_NONE) {
+        return WordAwaiter{*this, WordWait{&channel, offset, current,
+                                           Clock::now() + std::chrono::milliseconds(timeoutMs),
+                                           announceOffset, announce, {}}};
+    }
+
+private:
+    struct Timer {
+        Clock::time_point deadline;
+        uint64_t sequence;   // keeps timers with the same deadline in order
+        std::coroutine_handle<> handle;
+
+        bool operator>(const Timer& other) const {
+            return deadline != other.deadline ? deadline > other.deadline : sequence > other.sequence;
+        }
+    };
+
+    // Top-level coroutine frame; it frees itself when the task is done
+    struct Detached {
+        struct promise_type {
+            Detached get_return_object() {
+                return Detached{std::coroutine_handle<promise_type>::from_promise(*this)};
+            }
+            std::suspend_always initial_suspend() noexcept {
+                return {};
+            }
+            std::suspend_never final_suspend() noexcept {
+                return {};
+            }
+            void return_void() {}
+            void unhandled_exception() {
+                std::terminate();
+            }
+        };
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    static Detached runDetached(Reactor& reactor, Task<void> task) {
+        co_await task;
+        reactor.live_--;
+    }
+
+    void announce(WordWait& wait, bool waiting) {
+        if (wait.announce == ANNOUNCE_FLAG) {
+            storeWord(*wait.channel, wait.announceOffset, waiting ? 1 : 0);
+        } else if (wait.announce == ANNOUNCE_COUNT) {
+            fetchAddWord(*wait.channel, wait.announceOffset, waiting ? 1 : -1);
+        }
+    }
+
+    // Function to queue every coroutine whose word changed, whose wait
+    // timed out or whose timer is due
+    void collectCompleted(Clock::time_point now) {
+        bool stop = stopping();
+        for (size_t i = 0; i < waits_.size();) {
+            WordWait& wait = *waits_[i];
+            int value = 0;
+            bool readable = loadWord(*wait.channel, wait.offset, value);
+            wait.changed = readable && value != wait.current;
+            if (!readable || wait.changed || now >= wait.deadline || stop) {
+                announce(wait, false);
+                ready_.push_back(wait.handle);
+                waits_[i] = waits_.back();
+                waits_.pop_back();
+            } else {
+                i++;
+            }
+        }
+
+        while (!timers_.empty() && (stop || timers_.top().deadline <= now)) {
+            ready_.push_back(timers_.top().handle);
+            timers_.pop();
+        }
+
+        ready_.insert(ready_.end(), yielded_.begin(), yielded_.end());
+        yielded_.clear();
+    }
+
+    // Function to block until a waited-on word may have changed or the
+    // next deadline, but no longer than WAIT_POLL_INTERVAL_MS so a cleared
+    // keepRunning is noticed
+    void sleepUntilEvent() {
+        Clock::time_point now = Clock::now();
+        Clock::time_point deadline = now + std::chrono::milliseconds(WAIT_POLL_INTERVAL_MS);
+        if (!timers_.empty()) {
+            deadline = std::min(deadline, timers_.top().deadline);
+        }
+        for (const WordWait* wait : waits_) {
+            deadline = std::min(deadline, wait->deadline);
+        }
+        if (deadline <= now) {
+            return;
+        }
+        if (waits_.empty()) {
+            std::this_thread::sleep_until(deadline);
+            return;
+        }
+
+        // Words beyond what one futex_waitv takes are only checked when it returns
+        if (waits_.size() > REACTOR_MAX_FUTEX_WAITS) {
+            deadline = std::min(deadline, now + std::chrono::microseconds(REACTOR_POLL_INTERVAL_US));
+        }
+        if (waitOnWords(deadline)) {
+            return;
+        }
+
+        // No way to block on several words: block on the only one, or poll
+        if (waits_.size() == 1 && waits_[0]->channel->view != nullptr) {
+            auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - now);
+            ::waitWord(*waits_[0]->channel, waits_[0]->offset, waits_[0]->current, static_cast<int>(remaining.count()));
+            return;
+        }
+        std::this_thread::sleep_until(std::min(deadline, now + std::chrono::microseconds(REACTOR_POLL_INTERVAL_US)));
+    }
+
+    // Function to sleep on many shared words at once with futex_waitv
+    // (Linux 5.16+). Returns false if it is not available for these words.
+    bool waitOnWords(Clock::time_point deadline) {
+#if defined(__linux__)
+        if (!futexWaitvAvailable_) {
+            return false;
+        }
+
+        // Layout of struct futex_waitv; shared futexes, 32-bit words
+        struct FutexWaiter {
+            uint64_t value;
+            uint64_t address;
+            uint32_t flags;
+            uint32_t reserved;
+        };
+        const uint32_t FUTEX_SIZE_U32 = 0x02;
+
+        size_t count = std::min(waits_.size(), REACTOR_MAX_FUTEX_WAITS);
+        FutexWaiter waiters[REACTOR_MAX_FUTEX_WAITS];
+        for (size_t i = 0; i < count; i++) {
+            WordWait& wait = *waits_[i];
+            if (wait.channel->view == nullptr) {
+                return false;   // the file transport has no futex to sleep on
+            }
+            waiters[i].value = static_cast<uint32_t>(wait.current);
+            waiters[i].address = reinterpret_cast<uintptr_t>(&sharedWord(*wait.channel, wait.offset));
+            waiters[i].flags = FUTEX_SIZE_U32;
+            waiters[i].reserved = 0;
+        }
+
+        // The timeout is absolute on CLOCK_MONOTONIC, which steady_clock uses
+        auto sinceEpoch = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch());
+        struct timespec timeout;
+        timeout.tv_sec = static_cast<time_t>(sinceEpoch.count() / 1000000000LL);
+        timeout.tv_nsec = static_cast<long>(sinceEpoch.count() % 1000000000LL);
+
+        // Returns at once with EAGAIN if a word already changed
+        if (syscall(SYS_futex_waitv, waiters, count, 0, &timeout, CLOCK_MONOTONIC) == -1 && errno == ENOSYS) {
+            futexWaitvAvailable_ = false;
+            return false;
+        }
+        return true;
+#else
+        (void)deadline;
+        return false;
+#endif
+    }
+
+    std::atomic<bool>& keepRunning_;
+    int live_ = 0;   // spawned coroutines not finished yet
+    std::vector<std::coroutine_handle<>> ready_;
+    std::vector<std::coroutine_handle<>> yielded_;
+    std::vector<WordWait*> waits_;   // each lives in its suspended coroutine's frame
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+    uint64_t timerSequence_ = 0;
+    bool futexWaitvAvailable_ = true;
+};
+
+#endif // IPC_HAVE_COROUTINES
+
+#endif
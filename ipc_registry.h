@@ -0,0 +1,172 @@
+#ifndef IPC_REGISTRY_H
+#define IPC_REGISTRY_H
+
+#include "ipc_common.h"
+
+#include <algorithm>
+#include <vector>
+
+// Shared server registry, `ipc_registry.bin` next to the server files (in
+// the same transport namespace, see openSharedFile).
+// Running servers hold an entry with their number and a heartbeat, so a
+// client finds the live servers with one read of the mapped table instead
+// of scanning the directory and opening every server file. Servers also
+// draw their numbers from the registry's counter.
+struct RegistryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    int nextServerNumber;   // last number handed out
+};
+
+struct RegistryEntry {
+    int serverNumber;       // 0 = free, -n = being filled in by server n, > 0 = registered
+    int pid;
+    int heartbeat;          // heartbeatClockMs() of the last heartbeat
+    int reserved;
+};
+
+inline const char* REGISTRY_FILE_NAME = "ipc_registry.bin";
+
+const uint32_t REGISTRY_MAGIC = 0x52435049;   // "IPCR"
+const uint32_t REGISTRY_VERSION = 1;
+const uint32_t REGISTRY_CAPACITY = 64;
+const int REGISTRY_HEARTBEAT_MS = 1000;
+const int REGISTRY_STALE_MS = 5000;   // entries older than this belong to dead servers
+
+inline size_t registryEntryOffset(uint32_t index, size_t field) {
+    return sizeof(RegistryHeader) + static_cast<size_t>(index) * sizeof(RegistryEntry) + field;
+}
+
+const size_t REGISTRY_NEXT_NUMBER_OFFSET = offsetof(RegistryHeader, nextServerNumber);
+
+// Function to tell the age of a heartbeat. Heartbeats are on the monotonic
+// clock, so wall clock steps do not make live servers look dead or dead
+// ones live; heartbeatClockMs() wraps, hence the unsigned difference.
+inline int32_t heartbeatAgeMs(int now, int heartbeat) {
+    return static_cast<int32_t>(static_cast<uint32_t>(now) - static_cast<uint32_t>(heartbeat));
+}
+
+// Function to attach to the registry. With `create` a missing registry is
+// created and its number counter starts at `lastServerNumber` (servers pass
+// the highest number found on disk). Returns false if there is no usable
+// registry; callers then fall back to scanning the directory.
+inline bool openRegistry(IpcChannel& registry, TransportMode mode, bool create, int lastServerNumber = 0) {
+    size_t size = registryEntryOffset(REGISTRY_CAPACITY, 0);
+
+    if (create && openSharedFile(registry, REGISTRY_FILE_NAME, mode, true, size)) {
+        std::vector<char> zeros(size, 0);
+        RegistryHeader header{};
+        header.version = REGISTRY_VERSION;
+        header.capacity = REGISTRY_CAPACITY;
+        header.nextServerNumber = lastServerNumber;
+        std::memcpy(zeros.data(), &header, sizeof(header));
+
+        // The magic goes in last, so nobody attaches to a half-written file
+        header.magic = REGISTRY_MAGIC;
+        if (!writeShared(registry, 0, zeros.data(), zeros.size()) ||
+            !writeShared(registry, offsetof(RegistryHeader, magic), &header.magic, sizeof(header.magic))) {
+            closeChannel(registry);
+            removeSharedFile(REGISTRY_FILE_NAME, mode);
+            return false;
+        }
+    } else if (!openSharedFile(registry, REGISTRY_FILE_NAME, mode, false)) {
+        return false;
+    }
+
+    // Another process may still be creating it; give it a moment
+    RegistryHeader header{};
+    for (int attempt = 0; attempt < 10; attempt++) {
+        if (readShared(registry, 0, &header, sizeof(header)) && header.magic == REGISTRY_MAGIC) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (header.magic != REGISTRY_MAGIC || header.version != REGISTRY_VERSION ||
+        header.capacity != REGISTRY_CAPACITY) {
+        closeChannel(registry);
+        return false;
+    }
+
+    registry.name = REGISTRY_FILE_NAME;
+    registry.mode = mode;
+    if (!isFileTransport(mode) && registry.view == nullptr && !mapChannel(registry, size)) {
+        closeChannel(registry);
+        return false;
+    }
+    return true;
+}
+
+inline int allocateServerNumber(IpcChannel& registry) {
+    return fetchAddWord(registry, REGISTRY_NEXT_NUMBER_OFFSET, 1, -1) + 1;
+}
+
+// Function to add a server to the registry. Entries left by servers that
+// stopped heartbeating are reused, including ones a server died filling
+// in. Returns the entry index or -1 if full.
+inline int registerServer(IpcChannel& registry, int serverNumber) {
+    int now = heartbeatClockMs();
+
+    for (uint32_t i = 0; i < REGISTRY_CAPACITY; i++) {
+        size_t numberOffset = registryEntryOffset(i, offsetof(RegistryEntry, serverNumber));
+        int current = 0;
+        int heartbeat = 0;
+        if (!loadWord(registry, numberOffset, current) ||
+            !loadWord(registry, registryEntryOffset(i, offsetof(RegistryEntry, heartbeat)), heartbeat)) {
+            return -1;
+        }
+
+        if (current != 0 && heartbeatAgeMs(now, heartbeat) <= REGISTRY_STALE_MS) {
+            continue;
+        }
+
+        // The heartbeat goes in before the reservation, so an entry whose
+        // server dies while filling it in goes stale like any other. Racing
+        // servers reserve with their own -serverNumber, so at most one CAS
+        // on the same old value wins.
+        storeWord(registry, registryEntryOffset(i, offsetof(RegistryEntry, heartbeat)), now);
+        if (!compareExchangeWord(registry, numberOffset, current, -serverNumber)) {
+            continue;
+        }
+        storeWord(registry, registryEntryOffset(i, offsetof(RegistryEntry, pid)), currentProcessId());
+        storeWord(registry, numberOffset, serverNumber);
+        return static_cast<int>(i);
+    }
+    return -1;
+}
+
+inline void heartbeatServer(IpcChannel& registry, int index) {
+    if (index >= 0) {
+        storeWord(registry, registryEntryOffset(static_cast<uint32_t>(index), offsetof(RegistryEntry, heartbeat)),
+                  heartbeatClockMs());
+    }
+}
+
+inline void deregisterServer(IpcChannel& registry, int index, int serverNumber) {
+    if (index >= 0) {
+        compareExchangeWord(registry,
+                            registryEntryOffset(static_cast<uint32_t>(index), offsetof(RegistryEntry, serverNumber)),
+                            serverNumber, 0);
+    }
+}
+
+// Function to list the servers with a recent heartbeat, newest first
+inline std::vector<int> liveServers(IpcChannel& registry) {
+    std::vector<int> servers;
+    int now = heartbeatClockMs();
+
+    for (uint32_t i = 0; i < REGISTRY_CAPACITY; i++) {
+        int number = 0;
+        int heartbeat = 0;
+        if (loadWord(registry, registryEntryOffset(i, offsetof(RegistryEntry, serverNumber)), number) && number > 0 &&
+            loadWord(registry, registryEntryOffset(i, offsetof(RegistryEntry, heartbeat)), heartbeat) &&
+            heartbeatAgeMs(now, heartbeat) <= REGISTRY_STALE_MS) {
+            servers.push_back(number);
+        }
+    }
+
+    std::sort(servers.begin(), servers.end(), [](int a, int b) { return a > b; });
+    return servers;
+}
+
+#endif
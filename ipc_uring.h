@@ -0,0 +1,284 @@
+#ifndef IPC_URING_H
+#define IPC_URING_H
+
+// io_uring engine for the file transport (Linux only, no liburing needed).
+// A channel opened with TRANSPORT_URING gets one engine: a small ring with
+// the server file registered as fixed file 0 and a staging buffer
+// registered as fixed buffer 0. IoBatch (ipc_common.h) hands it groups of
+// positioned reads, writes and fsyncs; each group goes to the kernel in a
+// single io_uring_enter that also waits for the completions, so a group
+// costs one syscall however many operations it holds. The operations of a
+// group are linked and run in order, and completions are reaped straight
+// from the mapped completion ring. If the kernel refuses a submission or a
+// wait, the engine closes its ring and the channel goes on with positioned
+// calls.
+
+#if defined(__linux__)
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+// One positioned operation on the engine's file. `opcode` is
+// IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED or IORING_OP_FSYNC.
+struct UringOp {
+    uint8_t opcode;
+    uint64_t offset;
+    void* buffer;      // caller memory; staged through the registered buffer
+    uint32_t length;
+};
+
+class UringEngine {
+public:
+    static const unsigned RING_ENTRIES = 128;
+    static const size_t STAGING_SIZE = 64 * 1024;
+
+    UringEngine() = default;
+    UringEngine(const UringEngine&) = delete;
+    UringEngine& operator=(const UringEngine&) = delete;
+
+    ~UringEngine() {
+        shutdown();
+    }
+
+    // Function to create the ring and register `fd` and the staging buffer.
+    // Returns false if io_uring is not available (old kernel, seccomp, ...).
+    bool setup(int fd) {
+        io_uring_params params{};
+        ringFd_ = static_cast<int>(syscall(__NR_io_uring_setup, RING_ENTRIES, &params));
+        if (ringFd_ < 0) {
+            return false;
+        }
+
+        sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        singleMap_ = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMap_) {
+            sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+        }
+
+        sqRing_ = mapRing(sqRingSize_, IORING_OFF_SQ_RING);
+        cqRing_ = singleMap_ ? sqRing_ : mapRing(cqRingSize_, IORING_OFF_CQ_RING);
+        sqeSize_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(mapRing(sqeSize_, IORING_OFF_SQES));
+        staging_ = static_cast<char*>(mmap(nullptr, STAGING_SIZE, PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (sqRing_ == MAP_FAILED || cqRing_ == MAP_FAILED || sqes_ == MAP_FAILED || staging_ == MAP_FAILED) {
+            shutdown();
+            return false;
+        }
+
+        char* sq = static_cast<char*>(sqRing_);
+        char* cq = static_cast<char*>(cqRing_);
+        sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        sqEntries_ = params.sq_entries;
+
+        // Fixed file and buffer save the kernel a lookup and a page pinning
+        // on every operation
+        iovec staging{staging_, STAGING_SIZE};
+        if (syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_FILES, &fd, 1) != 0 ||
+            syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_BUFFERS, &staging, 1) != 0) {
+            shutdown();
+            return false;
+        }
+        usable_.store(true, std::memory_order_release);
+        return true;
+    }
+
+    // False once the engine has given up on its ring
+    bool usable() const {
+        return usable_.load(std::memory_order_acquire);
+    }
+
+    // Function to run `ops` in order. Returns false if any of them failed
+    // or transferred fewer bytes than asked for.
+    bool execute(const UringOp* ops, size_t count) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ringFd_ < 0) {
+            return false;   // abandoned while this caller waited for the lock
+        }
+        size_t next = 0;
+        bool ok = true;
+
+        // Groups bigger than the ring or the staging buffer go out in parts
+        while (next < count && ok) {
+            size_t first = next;
+            size_t staged = 0;
+            while (next < count && next - first < sqEntries_ &&
+                   staged + ops[next].length <= STAGING_SIZE) {
+                staged += ops[next].length;
+                next++;
+            }
+            if (next == first) {
+                return false;   // a single operation larger than the staging buffer
+            }
+            ok = submitAndWait(ops + first, next - first);
+        }
+        return ok;
+    }
+
+private:
+    void* mapRing(size_t size, off_t offset) {
+        return mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, offset);
+    }
+
+    bool submitAndWait(const UringOp* ops, size_t count) {
+        unsigned tail = *sqTail_;
+        size_t staged = 0;
+        for (size_t i = 0; i < count; i++) {
+            unsigned index = tail & sqMask_;
+            io_uring_sqe& sqe = sqes_[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = ops[i].opcode;
+            sqe.fd = 0;   // fixed file 0
+            sqe.flags = IOSQE_FIXED_FILE | (i + 1 < count ? IOSQE_IO_LINK : 0);
+            sqe.off = ops[i].offset;
+            sqe.user_data = i;
+            if (ops[i].opcode != IORING_OP_FSYNC) {
+                char* region = staging_ + staged;
+                if (ops[i].opcode == IORING_OP_WRITE_FIXED) {
+                    std::memcpy(region, ops[i].buffer, ops[i].length);
+                }
+                sqe.addr = reinterpret_cast<uint64_t>(region);
+                sqe.len = ops[i].length;
+                sqe.buf_index = 0;
+                staged += ops[i].length;
+            }
+            sqArray_[index] = index;
+            tail++;
+        }
+        __atomic_store_n(sqTail_, tail, __ATOMIC_RELEASE);
+
+        // Submit the group and wait for all of it in the same call
+        unsigned submitted = 0;
+        while (submitted < count) {
+            long entered = syscall(__NR_io_uring_enter, ringFd_, static_cast<unsigned>(count - submitted),
+                                   static_cast<unsigned>(count - submitted), IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (entered < 0 && errno == EINTR) {
+                continue;
+            }
+            if (entered <= 0) {
+                return abandon();   // the rest of the group is still queued
+            }
+            submitted += static_cast<unsigned>(entered);
+        }
+
+        // Reap every completion of the group from the shared ring
+        bool ok = true;
+        size_t reaped = 0;
+        while (reaped < count) {
+            unsigned head = *cqHead_;
+            unsigned ready = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+            if (head == ready) {
+                if (syscall(__NR_io_uring_enter, ringFd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+                    errno != EINTR) {
+                    return abandon();   // completions of the group are still due
+                }
+                continue;
+            }
+            for (; head != ready; head++, reaped++) {
+                const io_uring_cqe& cqe = cqes_[head & cqMask_];
+                if (cqe.user_data >= count) {
+                    return abandon();   // not ours: the ring is out of step
+                }
+                const UringOp& op = ops[cqe.user_data];
+                bool complete = (op.opcode == IORING_OP_FSYNC) ? cqe.res == 0
+                                                               : cqe.res == static_cast<int>(op.length);
+                ok = ok && complete;
+            }
+            __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+        }
+
+        // Hand the data of the reads back to the caller
+        staged = 0;
+        for (size_t i = 0; i < count && ok; i++) {
+            if (ops[i].opcode == IORING_OP_READ_FIXED) {
+                std::memcpy(ops[i].buffer, staging_ + staged, ops[i].length);
+            }
+            if (ops[i].opcode != IORING_OP_FSYNC) {
+                staged += ops[i].length;
+            }
+        }
+        return ok;
+    }
+
+    // Function to give up on the ring after an error that may have left
+    // submissions or completions of a group in it, so they can never mix
+    // with the next group. Closing the ring cancels whatever is queued.
+    bool abandon() {
+        usable_.store(false, std::memory_order_release);
+        shutdown();
+        return false;
+    }
+
+    void shutdown() {
+        if (sqes_ != nullptr && sqes_ != MAP_FAILED) {
+            munmap(sqes_, sqeSize_);
+        }
+        if (cqRing_ != nullptr && cqRing_ != MAP_FAILED && !singleMap_) {
+            munmap(cqRing_, cqRingSize_);
+        }
+        if (sqRing_ != nullptr && sqRing_ != MAP_FAILED) {
+            munmap(sqRing_, sqRingSize_);
+        }
+        if (staging_ != nullptr && staging_ != MAP_FAILED) {
+            munmap(staging_, STAGING_SIZE);
+        }
+        if (ringFd_ >= 0) {
+            close(ringFd_);   // also drops the registered file and buffer
+        }
+        ringFd_ = -1;
+        sqRing_ = cqRing_ = nullptr;
+        sqes_ = nullptr;
+        staging_ = nullptr;
+    }
+
+    std::mutex mutex_;   // one group at a time; the ring is empty between groups
+    std::atomic<bool> usable_{false};
+    int ringFd_ = -1;
+    bool singleMap_ = false;
+    void* sqRing_ = nullptr;
+    void* cqRing_ = nullptr;
+    size_t sqRingSize_ = 0;
+    size_t cqRingSize_ = 0;
+    size_t sqeSize_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    char* staging_ = nullptr;
+    unsigned sqEntries_ = 0;
+    unsigned* sqTail_ = nullptr;
+    unsigned sqMask_ = 0;
+    unsigned* sqArray_ = nullptr;
+    unsigned* cqHead_ = nullptr;
+    unsigned* cqTail_ = nullptr;
+    unsigned cqMask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+};
+
+#endif // __linux__
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <cstdint>
+#include <cstring>
+
+// HDR-style latency histogram: every power-of-two range of values is split
+// into SUB_BUCKET_COUNT linear buckets, so any recorded value is kept with
+// roughly 3% relative precision over the whole uint64_t range, in a fixed
+// array and without allocating. Values are usually nanoseconds.
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKET_BITS = 5;
+    static const uint64_t SUB_BUCKET_COUNT = 1u << SUB_BUCKET_BITS;
+    static const int BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+    LatencyHistogram() {
+        reset();
+    }
+
+    void reset() {
+        std::memset(counts_, 0, sizeof(counts_));
+        total_ = 0;
+        sum_ = 0;
+        min_ = UINT64_MAX;
+        max_ = 0;
+    }
+
+    void record(uint64_t value) {
+        counts_[indexFor(value)]++;
+        total_++;
+        sum_ += value;
+        if (value < min_) min_ = value;
+        if (value > max_) max_ = value;
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (int i = 0; i < BUCKET_COUNT; i++) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        sum_ += other.sum_;
+        if (other.min_ < min_) min_ = other.min_;
+        if (other.max_ > max_) max_ = other.max_;
+    }
+
+    uint64_t count() const { return total_; }
+    uint64_t min() const { return total_ ? min_ : 0; }
+    uint64_t max() const { return max_; }
+    double mean() const { return total_ ? static_cast<double>(sum_) / total_ : 0.0; }
+
+    // Value at or below which `percentile` percent of the samples fall
+    uint64_t percentile(double percentile) const {
+        if (total_ == 0) {
+            return 0;
+        }
+
+        uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * total_ + 0.5);
+        if (rank == 0) rank = 1;
+        if (rank > total_) rank = total_;
+
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKET_COUNT; i++) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                uint64_t value = highestValueAt(i);
+                return value < max_ ? value : max_;
+            }
+        }
+        return max_;
+    }
+
+private:
+    static int highestBit(uint64_t value) {
+        int bit = 0;
+        while (value >>= 1) {
+            bit++;
+        }
+        return bit;
+    }
+
+    static int indexFor(uint64_t value) {
+        if (value < SUB_BUCKET_COUNT) {
+            return static_cast<int>(value);
+        }
+        int shift = highestBit(value) - SUB_BUCKET_BITS;
+        return static_cast<int>((shift + 1) * SUB_BUCKET_COUNT + ((value >> shift) - SUB_BUCKET_COUNT));
+    }
+
+    // Largest value that maps to bucket `index`
+    static uint64_t highestValueAt(int index) {
+        if (index < static_cast<int>(SUB_BUCKET_COUNT)) {
+            return static_cast<uint64_t>(index);
+        }
+        int shift = index / static_cast<int>(SUB_BUCKET_COUNT) - 1;
+        uint64_t sub = index % SUB_BUCKET_COUNT;
+        return ((SUB_BUCKET_COUNT + sub + 1) << shift) - 1;
+    }
+
+    uint64_t counts_[BUCKET_COUNT];
+    uint64_t total_;
+    uint64_t sum_;
+    uint64_t min_;
+    uint64_t max_;
+};
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef REQUEST_SCHEDULER_H
+#define REQUEST_SCHEDULER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+
+// Requests taken off the ring and waiting for the dispatcher, one FIFO
+// queue per priority class. pop() picks the class by deficit round robin:
+// on its turn a class earns its weight in credit and is served while the
+// credit covers the cost of the request at its front (1 per command, so a
+// batch costs its entries), then the next class gets its turn. With every
+// class backlogged each one gets a share of the commands proportional to
+// its weight, and a class with work never waits longer than one round.
+// Only the dispatcher thread touches it.
+template <typename Task, int CLASSES>
+class RequestScheduler {
+public:
+    // Function to set the weight of every class (each at least 1)
+    void setWeights(const int* weights) {
+        for (int i = 0; i < CLASSES; i++) {
+            weights_[i] = weights[i] > 0 ? weights[i] : 1;
+        }
+    }
+
+    void push(Task&& task, int priorityClass, int cost) {
+        queues_[priorityClass].push_back(Queued{std::move(task), cost > 0 ? cost : 1});
+        size_++;
+    }
+
+    // Function to take the next request in weighted fair order.
+    // Returns false if nothing is queued.
+    bool pop(Task& task) {
+        if (size_ == 0) {
+            return false;
+        }
+        while (true) {
+            std::deque<Queued>& queue = queues_[current_];
+            if (queue.empty()) {
+                deficit_[current_] = 0;   // an idle class does not save up credit
+                nextClass();
+                continue;
+            }
+            if (!credited_) {
+                deficit_[current_] += weights_[current_];
+                credited_ = true;
+            }
+            if (deficit_[current_] < queue.front().cost) {
+                nextClass();
+                continue;
+            }
+
+            deficit_[current_] -= queue.front().cost;
+            task = std::move(queue.front().task);
+            queue.pop_front();
+            size_--;
+            if (queue.empty()) {
+                deficit_[current_] = 0;
+            }
+            return true;
+        }
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    size_t queued(int priorityClass) const {
+        return queues_[priorityClass].size();
+    }
+
+private:
+    struct Queued {
+        Task task;
+        int cost;
+    };
+
+    void nextClass() {
+        current_ = (current_ + 1) % CLASSES;
+        credited_ = false;
+    }
+
+    std::deque<Queued> queues_[CLASSES];
+    int weights_[CLASSES] = {};
+    int deficit_[CLASSES] = {};
+    int current_ = 0;
+    bool credited_ = false;   // the current class got its weight for this turn
+    size_t size_ = 0;
+};
+
+// Per-client token buckets: a client may send `rate` commands per second
+// on average and up to `burst` at once. Buckets sit in a fixed array
+// indexed by client ID, like the client table, and a bucket found holding
+// another ID starts over full. Only the dispatcher thread touches it.
+class RateLimiter {
+public:
+    // Function to size the limiter; `rate` 0 turns it off
+    void reset(size_t capacity, int rate, int burst) {
+        capacity_ = 1;
+        while (capacity_ < capacity) {
+            capacity_ <<= 1;
+        }
+        rate_ = rate;
+        burst_ = burst > 0 ? burst : rate;
+        buckets_ = rate > 0 ? std::make_unique<Bucket[]>(capacity_) : nullptr;
+    }
+
+    bool enabled() const {
+        return rate_ > 0;
+    }
+
+    // Function to charge `cost` commands to `clientId` at `nowUs`.
+    // Returns false if the client is over its rate.
+    bool admit(int clientId, int64_t nowUs, int cost) {
+        if (!enabled() || clientId <= 0) {
+            return true;
+        }
+        Bucket& bucket = buckets_[static_cast<size_t>(clientId - 1) & (capacity_ - 1)];
+        if (bucket.clientId != clientId) {
+            bucket.clientId = clientId;
+            bucket.tokens = burst_;
+            bucket.refilledUs = nowUs;
+        }
+
+        bucket.tokens += static_cast<double>(nowUs - bucket.refilledUs) * rate_ / 1000000.0;
+        if (bucket.tokens > burst_) {
+            bucket.tokens = burst_;
+        }
+        bucket.refilledUs = nowUs;
+        if (bucket.tokens < cost) {
+            return false;
+        }
+        bucket.tokens -= cost;
+        return true;
+    }
+
+private:
+    struct Bucket {
+        int clientId = 0;
+        double tokens = 0;
+        int64_t refilledUs = 0;
+    };
+
+    std::unique_ptr<Bucket[]> buckets_;
+    size_t capacity_ = 0;
+    int rate_ = 0;
+    int burst_ = 0;
+};
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef REQUEST_TRACE_H
+#define REQUEST_TRACE_H
+
+#include "ipc_common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Request traces: with --capture the server appends one fixed-size record
+// per request to a memory-mapped trace file, and the client's --replay
+// sends the same mix of requests again with the same spacing. The file is
+// a header followed by room for `capacity` records. It is created at full
+// size and mapped once, so recording a request is a compare-and-swap and
+// a 24-byte copy, without a system call; a full trace drops new records.
+const uint32_t TRACE_MAGIC = 0x54435049;   // "IPCT"
+const uint32_t TRACE_VERSION = 1;
+
+const uint8_t TRACE_BINARY = 1;          // the request was binary (or a binary batch)
+const uint8_t TRACE_NO_COMMAND = 0xFF;   // opcode of hellos and batches
+
+struct alignas(CACHE_LINE_SIZE) TraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t capacity;   // records the file has room for
+    int count;           // records written so far (atomic)
+};
+
+struct TraceRecord {
+    uint64_t arrivalNs;   // since the capture started, when the request was taken off the ring
+    uint32_t serviceUs;   // from arrival until the response was delivered
+    int32_t clientId;     // 0 for a hello
+    uint16_t length;      // request body bytes
+    uint8_t type;         // MessageType
+    uint8_t opcode;       // command of a single request, OP_COUNT = unknown
+    uint8_t entries;      // commands in a batch, 1 otherwise
+    uint8_t priority;     // class the scheduler served it in
+    uint8_t flags;        // TRACE_BINARY
+    uint8_t reserved;
+};
+
+static_assert(sizeof(TraceRecord) == 24, "trace records are packed to 24 bytes");
+
+const size_t TRACE_COUNT_OFFSET = offsetof(TraceHeader, count);
+
+inline size_t traceRecordOffset(uint32_t index) {
+    return sizeof(TraceHeader) + static_cast<size_t>(index) * sizeof(TraceRecord);
+}
+
+// Writer side, shared by every processing thread of the server
+class TraceWriter {
+public:
+    // Function to create the trace file `filename` (replacing an older one)
+    // with room for `capacity` records, and map it
+    bool open(const std::string& filename, uint32_t capacity) {
+        removeSharedFile(filename, TRANSPORT_MMAP);
+        size_t size = traceRecordOffset(capacity);
+        if (!openSharedFile(file_, filename, TRANSPORT_MMAP, true, size)) {
+            return false;
+        }
+        // Mapped with MAP_POPULATE, so no record write takes a page fault
+        file_.prefault = true;
+        if (!preallocateFile(file_.fd, size) || !mapChannel(file_, size)) {
+            closeChannel(file_);
+            removeSharedFile(filename, TRANSPORT_MMAP);
+            return false;
+        }
+
+        TraceHeader header{};
+        header.magic = TRACE_MAGIC;
+        header.version = TRACE_VERSION;
+        header.recordSize = sizeof(TraceRecord);
+        header.capacity = capacity;
+        writeShared(file_, 0, &header, sizeof(header));
+        capacity_ = capacity;
+        startedAt_ = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    bool enabled() const {
+        return file_.view != nullptr;
+    }
+
+    // Nanoseconds from the start of the capture to `time`
+    uint64_t sinceStart(std::chrono::steady_clock::time_point time) const {
+        return time < startedAt_ ? 0 : static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(time - startedAt_).count());
+    }
+
+    // Function to append a record. Returns false if the trace is full.
+    bool append(const TraceRecord& record) {
+        std::atomic<int>& count = sharedWord(file_, TRACE_COUNT_OFFSET);
+        int index = count.load(std::memory_order_relaxed);
+        do {
+            if (static_cast<uint32_t>(index) >= capacity_) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        } while (!count.compare_exchange_weak(index, index + 1, std::memory_order_relaxed));
+
+        std::memcpy(file_.view + traceRecordOffset(static_cast<uint32_t>(index)), &record, sizeof(record));
+        return true;
+    }
+
+    int recorded() {
+        return enabled() ? sharedWord(file_, TRACE_COUNT_OFFSET).load() : 0;
+    }
+
+    uint64_t dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+    // Function to unmap the trace; the records stay in the file
+    void close() {
+        closeChannel(file_);
+    }
+
+private:
+    IpcChannel file_;
+    uint32_t capacity_ = 0;
+    std::chrono::steady_clock::time_point startedAt_;
+    std::atomic<uint64_t> dropped_{0};   // records that did not fit
+};
+
+// Function to read every record of the trace file `filename`, in the order
+// they were written (which is close to, not exactly, arrival order)
+inline bool loadTrace(const std::string& filename, std::vector<TraceRecord>& records) {
+    IpcChannel file;
+    if (!openSharedFile(file, filename, TRANSPORT_MMAP, false)) {
+        return false;
+    }
+    TraceHeader header{};
+    bool valid = readShared(file, 0, &header, sizeof(header)) &&
+                 header.magic == TRACE_MAGIC && header.version == TRACE_VERSION &&
+                 header.recordSize == sizeof(TraceRecord) && header.count >= 0 &&
+                 static_cast<uint32_t>(header.count) <= header.capacity;
+    if (valid) {
+        records.resize(static_cast<size_t>(header.count));
+        valid = records.empty() ||
+                readShared(file, traceRecordOffset(0), records.data(), records.size() * sizeof(TraceRecord));
+    }
+    closeChannel(file);
+    return valid;
+}
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+// Responses of the server's cacheable commands, so a repeated request is
+// answered from a copy instead of running its handler again. Each
+// processing thread owns one cache (like its ThreadMetrics), so lookups
+// take no lock. The entries and their hash index (open addressing with
+// linear probing, at least twice as many slots as entries) are allocated
+// once by reset(), so the request path never allocates. When the cache is
+// full the CLOCK hand evicts the first entry that was not used since the
+// hand last passed it. Requests and responses above the size limits
+// below are never cached.
+const size_t CACHE_MAX_REQUEST = 64;    // request body bytes in the key
+const size_t CACHE_MAX_RESPONSE = 256;  // response bytes kept per entry
+
+// What a response depends on: the command, the request encoding (a binary
+// ping gets no text), the client for per-client responses (0 otherwise)
+// and the request body.
+struct CacheKey {
+    uint8_t opcode;
+    bool binary;
+    int clientId;
+    std::string_view request;
+};
+
+class ResponseCache {
+public:
+    // Function to drop every entry and make room for `capacity` (0 = off)
+    void reset(size_t capacity) {
+        entries_ = capacity > 0 ? std::make_unique<Entry[]>(capacity) : nullptr;
+        capacity_ = capacity;
+        hand_ = 0;
+        used_ = 0;
+        index_ = nullptr;
+        indexMask_ = 0;
+        if (capacity > 0) {
+            size_t slots = 2;
+            while (slots < 2 * capacity) {
+                slots <<= 1;
+            }
+            index_ = std::make_unique<uint32_t[]>(slots);
+            indexMask_ = slots - 1;
+        }
+    }
+
+    bool enabled() const {
+        return capacity_ > 0;
+    }
+
+    // Function to copy the cached response of `key` into `response` (at
+    // most `size` - 1 bytes, NUL-terminated). Returns false on a miss.
+    bool lookup(const CacheKey& key, char* response, size_t size, size_t& length, bool& succeeded) {
+        if (!enabled() || key.request.size() > CACHE_MAX_REQUEST) {
+            return false;
+        }
+        uint64_t hash = hashKey(key);
+        uint32_t slot = index_[findSlot(hash)];
+        if (slot == 0 || !matches(entries_[slot - 1], key) || entries_[slot - 1].responseLength >= size) {
+            return false;
+        }
+
+        Entry& entry = entries_[slot - 1];
+        entry.referenced = true;
+        length = entry.responseLength;
+        std::memcpy(response, entry.response, length);
+        response[length] = '\0';
+        succeeded = entry.succeeded;
+        return true;
+    }
+
+    // Function to remember the response to `key`, evicting if necessary
+    void store(const CacheKey& key, std::string_view response, bool succeeded) {
+        if (!enabled() || key.request.size() > CACHE_MAX_REQUEST || response.size() > CACHE_MAX_RESPONSE) {
+            return;
+        }
+        uint64_t hash = hashKey(key);
+
+        // Same hash: overwrite in place (a different key with the same hash
+        // just loses its entry)
+        size_t position = 0;
+        size_t slot = findSlot(hash);
+        if (index_[slot] != 0) {
+            position = index_[slot] - 1;
+        } else {
+            position = takeEntry();
+            entries_[position].hash = hash;
+            index_[findSlot(hash)] = static_cast<uint32_t>(position + 1);   // eviction may have moved it
+        }
+
+        Entry& entry = entries_[position];
+        entry.hash = hash;
+        entry.live = true;
+        entry.referenced = true;
+        entry.succeeded = succeeded;
+        entry.opcode = key.opcode;
+        entry.binary = key.binary;
+        entry.clientId = key.clientId;
+        entry.requestLength = static_cast<uint16_t>(key.request.size());
+        entry.responseLength = static_cast<uint16_t>(response.size());
+        std::memcpy(entry.request, key.request.data(), key.request.size());
+        std::memcpy(entry.response, response.data(), response.size());
+    }
+
+private:
+    struct Entry {
+        uint64_t hash = 0;
+        bool live = false;
+        bool referenced = false;   // CLOCK bit, set by every hit
+        bool succeeded = false;
+        uint8_t opcode = 0;
+        bool binary = false;
+        int clientId = 0;
+        uint16_t requestLength = 0;
+        uint16_t responseLength = 0;
+        char request[CACHE_MAX_REQUEST];
+        char response[CACHE_MAX_RESPONSE];
+    };
+
+    // FNV-1a over every part of the key
+    static uint64_t hashKey(const CacheKey& key) {
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&hash](const void* data, size_t length) {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+            for (size_t i = 0; i < length; i++) {
+                hash = (hash ^ bytes[i]) * 1099511628211ull;
+            }
+        };
+        mix(&key.opcode, sizeof(key.opcode));
+        mix(&key.binary, sizeof(key.binary));
+        mix(&key.clientId, sizeof(key.clientId));
+        mix(key.request.data(), key.request.size());
+        return hash;
+    }
+
+    static bool matches(const Entry& entry, const CacheKey& key) {
+        return entry.live && entry.opcode == key.opcode && entry.binary == key.binary &&
+               entry.clientId == key.clientId && entry.requestLength == key.request.size() &&
+               std::memcmp(entry.request, key.request.data(), key.request.size()) == 0;
+    }
+
+    // Function to find the index slot holding `hash`, or the empty slot
+    // where it would go. The index is at most half full, so probing ends.
+    size_t findSlot(uint64_t hash) const {
+        size_t slot = static_cast<size_t>(hash) & indexMask_;
+        while (index_[slot] != 0 && entries_[index_[slot] - 1].hash != hash) {
+            slot = (slot + 1) & indexMask_;
+        }
+        return slot;
+    }
+
+    // Function to empty an index slot, moving later entries of its probe
+    // run back so that every entry stays reachable from its home slot
+    void removeSlot(size_t hole) {
+        for (size_t next = (hole + 1) & indexMask_; index_[next] != 0; next = (next + 1) & indexMask_) {
+            size_t home = static_cast<size_t>(entries_[index_[next] - 1].hash) & indexMask_;
+            if (((next - home) & indexMask_) >= ((next - hole) & indexMask_)) {
+                index_[hole] = index_[next];
+                hole = next;
+            }
+        }
+        index_[hole] = 0;
+    }
+
+    // Function to find a free entry, or evict one with the CLOCK hand
+    size_t takeEntry() {
+        if (used_ < capacity_) {
+            return used_++;
+        }
+        while (entries_[hand_].referenced) {
+            entries_[hand_].referenced = false;
+            hand_ = (hand_ + 1) % capacity_;
+        }
+        size_t victim = hand_;
+        hand_ = (hand_ + 1) % capacity_;
+        removeSlot(findSlot(entries_[victim].hash));
+        entries_[victim].live = false;
+        return victim;
+    }
+
+    std::unique_ptr<Entry[]> entries_;
+    size_t capacity_ = 0;
+    size_t hand_ = 0;
+    size_t used_ = 0;   // entries handed out before the first eviction
+    std::unique_ptr<uint32_t[]> index_;   // by key hash: entry + 1, 0 = empty
+    size_t indexMask_ = 0;
+};
+
+#endif
@@ -1,29 +1,21 @@
-#ifdef _WIN32
-#define PLATFORM_WINDOWS 1
-#else
-#define PLATFORM_WINDOWS 0
-#endif
-
-#if PLATFORM_WINDOWS
-#include <windows.h>
-#include <io.h>
-#include <fcntl.h>
-#define open _open
-#define read _read
-#define write _write
-#define close _close
-#define lseek _lseek
-#define fsync _commit
-#define unlink _unlink
-#else
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <dirent.h>
-#endif
+#include "ipc_common.h"
+#include "worker_pool.h"
+#include "async_log.h"
+#include "ipc_registry.h"
+#include "server_metrics.h"
+#include "response_cache.h"
+#include "client_table.h"
+#include "request_scheduler.h"
+#include "request_trace.h"
+#include "cpu_affinity.h"
+#include "ipc_reactor.h"
 
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <charconv>
+#include <cctype>
+#include <cstdio>
 #include <cstring>
 #include <thread>
 #include <chrono>
@@ -32,293 +24,1682 @@
 #include <ctime>
 #include <algorithm>
 #include <vector>
-#include <set>
+#include <memory>
 #include <mutex>
+#include <random>
+#include <cstdlib>
 
-struct Message {
-    int status;
-    int client_id;
-    char data[256];
-};
-
-const char* SERVER_FILE_PREFIX = "ipc_server_";
 std::atomic<bool> running{true};
+std::atomic<bool> handoffRequested{false};   // a successor is taking over the server file
 
 // Global variables for the server
 std::string currentFileName;
 int serverInstanceNumber = 1;
-std::atomic<int> clientCounter{0};
-int nextClientId = 1;
+std::atomic<int> clientCounter{0};   // sessions opened since startup
 
-std::mutex clientMutex;
-std::set<int> connectedClients;
+// Sessions of registered clients. Lookups are lock-free; opening or
+// expiring a session takes registrationMutex for the token generator and
+// the response channel free list.
+ClientTable clientTable;
+std::mutex registrationMutex;
+std::mt19937 tokenGenerator{std::random_device{}()};
+std::vector<uint32_t> freeReplyChannels;   // unassigned channels, next one at the back
+std::unique_ptr<std::mutex[]> replyChannelLocks;   // one producer at a time per channel
 
-void logEvent(const std::string& event) {
-    std::time_t now = std::time(nullptr);
-    char timeStr[100];
-    std::strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", std::localtime(&now));
-    
-    std::cout << "[" << timeStr << "] " << event << std::endl;
-}
+// Per-thread request counters and latency histograms; block 0 belongs to
+// the main thread, block N to pool worker N - 1
+std::unique_ptr<ServerMetrics> metrics;
 
+// Per-thread response caches, numbered like the metrics blocks
+std::unique_ptr<ResponseCache[]> responseCaches;
+
+// Transport settings (see parseArguments)
+TransportMode transportMode = TRANSPORT_MMAP;
+bool syncWrites = false;
+uint32_t slotCount = DEFAULT_SLOT_COUNT;
+uint32_t channelCount = DEFAULT_CHANNEL_COUNT;
+uint32_t overflowCount = DEFAULT_OVERFLOW_COUNT;
+int workerCount = 0;
+int cacheEntries = 1024;       // response cache entries per processing thread, 0 = off
+int maxClients = 65536;        // client table entries
+int clientIdleMs = 600000;     // sessions unused this long are expired
+bool reactorEnabled = false;   // main loop and delays as coroutines (C++20 builds)
+int classWeights[PRIORITY_COUNT] = {4, 8, 1};   // scheduler weight by PriorityClass (normal, high, bulk)
+int rateLimit = 0;             // commands per second per client before demotion to bulk, 0 = off
+int rateBurst = 0;             // commands a client may send at once, 0 = one second's worth
+bool preallocate = false;      // reserve, prefault and lock the server file in memory
+std::string takeoverFile;      // server file to take over instead of creating one
+std::string captureFile;       // trace file to record every request in, empty = no capture
+int captureSizeMb = 64;        // size of the trace file
+std::vector<int> serverCpus;   // dispatcher on the first, workers round robin on the others, empty = not pinned
+int numaNode = -1;             // node for the server file memory, -1 = that of the dispatcher's CPU
+LogLevel logLevel = LOG_DEBUG;
+
+// Only flips the flag: the main loop does the logging once it wakes up,
+// since formatting a log record is not async-signal-safe
 void signalHandler(int signum) {
-    logEvent("Server: Shutting down...");    
     running = false;
 }
 
-bool readMessage(int fd, Message& msg) {
-    if (lseek(fd, 0, SEEK_SET) == -1) {
+// View of the text in a message buffer; stops at the first NUL or at the
+// end of the buffer if the sender did not terminate it
+std::string_view messageText(const char* data, size_t size) {
+    const void* end = std::memchr(data, '\0', size);
+    return std::string_view(data, end ? static_cast<const char*>(end) - data : size);
+}
+
+std::string_view trimWhitespace(std::string_view text) {
+    size_t start = text.find_first_not_of(" \t\n\r");
+    if (start == std::string_view::npos) return std::string_view();
+    
+    size_t end = text.find_last_not_of(" \t\n\r");
+    return text.substr(start, end - start + 1);
+}
+
+bool equalsIgnoreCase(std::string_view text, std::string_view expected) {
+    if (text.size() != expected.size()) return false;
+    
+    for (size_t i = 0; i < text.size(); i++) {
+        if (std::tolower(static_cast<unsigned char>(text[i])) != expected[i]) return false;
+    }
+    return true;
+}
+
+// Helpers that build a response in place, e.g. in Message::data.
+// `length` is the number of bytes written so far; the buffer always stays
+// NUL terminated and output that does not fit is cut off.
+void appendText(char* buffer, size_t size, size_t& length, std::string_view text) {
+    size_t count = std::min(text.size(), size - 1 - length);
+    std::memcpy(buffer + length, text.data(), count);
+    length += count;
+    buffer[length] = '\0';
+}
+
+void appendNumber(char* buffer, size_t size, size_t& length, int value) {
+    char digits[16];
+    std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+    appendText(buffer, size, length, std::string_view(digits, result.ptr - digits));
+}
+
+const std::string_view INVALID_REQUEST_RESPONSE = "ERROR: Unknown command";
+
+// Function to write the pong for `clientId`; returns its length
+size_t formatPong(char* buffer, size_t size, int clientId) {
+    size_t length = 0;
+    appendText(buffer, size, length, "pong from server #");
+    appendNumber(buffer, size, length, serverInstanceNumber);
+    appendText(buffer, size, length, " to client #");
+    appendNumber(buffer, size, length, clientId);
+    return length;
+}
+
+// Function to find the maximum number of an existing server
+int findMaxServerNumber() {
+    int maxNumber = 0;
+    
+    for (const std::string& filename : listSharedFiles(transportMode)) {
+        if (filename.find(SERVER_FILE_PREFIX) == 0) {
+            // Extract the number from the filename
+            std::string numStr = filename.substr(strlen(SERVER_FILE_PREFIX));
+            size_t dotPos = numStr.find('.');
+            if (dotPos != std::string::npos) {
+                numStr = numStr.substr(0, dotPos);
+                try {
+                    int num = std::stoi(numStr);
+                    if (num > maxNumber) {
+                        maxNumber = num;
+                    }
+                } catch (...) {
+                    // Ignore files with incorrect names
+                }
+            }
+        }
+    }
+    
+    return maxNumber;
+}
+
+// Function to parse command line options
+bool parseArguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        
+        if (arg.rfind("--transport=", 0) == 0) {
+            if (!parseTransportMode(arg.substr(strlen("--transport=")), transportMode)) {
+                std::cerr << "Server: Unknown transport: " << arg << std::endl;
+                return false;
+            }
+        } else if (arg == "--fsync") {
+            syncWrites = true;
+        } else if (arg == "--prealloc") {
+            preallocate = true;
+        } else if (arg.rfind("--takeover=", 0) == 0) {
+            takeoverFile = arg.substr(strlen("--takeover="));
+            if (takeoverFile.find(SERVER_FILE_PREFIX) != 0) {
+                std::cerr << "Server: Can only take over " << SERVER_FILE_PREFIX << "N.bin files" << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--capture=", 0) == 0) {
+            captureFile = arg.substr(strlen("--capture="));
+            if (captureFile.empty() || captureFile.find(SERVER_FILE_PREFIX) == 0) {
+                std::cerr << "Server: Capture needs a file name that is not a server file" << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--capture-size=", 0) == 0) {
+            captureSizeMb = std::atoi(arg.c_str() + strlen("--capture-size="));
+            if (captureSizeMb <= 0 || captureSizeMb > 4096) {
+                std::cerr << "Server: Capture size must be between 1 and 4096 MB" << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--cpus=", 0) == 0) {
+            if (!parseCpuList(arg.substr(strlen("--cpus=")), serverCpus)) {
+                std::cerr << "Server: CPU list must look like 0-3,8 (CPUs below " << MAX_CPUS << ")" << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--numa-node=", 0) == 0) {
+            numaNode = std::atoi(arg.c_str() + strlen("--numa-node="));
+            if (numaNode < 0 || numaNode >= MAX_NUMA_NODES) {
+                std::cerr << "Server: NUMA node must be between 0 and " << MAX_NUMA_NODES - 1 << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--wait=", 0) == 0) {
+            if (!parseWaitMode(arg.substr(strlen("--wait=")), waitPolicy.mode)) {
+                std::cerr << "Server: Unknown wait mode: " << arg << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--spin-us=", 0) == 0) {
+            waitPolicy.spinUs = std::atoi(arg.c_str() + strlen("--spin-us="));
+            if (waitPolicy.spinUs < 0 || waitPolicy.spinUs > 1000000) {
+                std::cerr << "Server: Spin time must be between 0 and 1000000 us" << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--slots=", 0) == 0) {
+            int count = std::atoi(arg.c_str() + strlen("--slots="));
+            if (count <= 0 || count > (int)MAX_SLOT_COUNT) {
+                std::cerr << "Server: Slot count must be between 1 and " << MAX_SLOT_COUNT << std::endl;
+                return false;
+            }
+            slotCount = static_cast<uint32_t>(count);
+        } else if (arg.rfind("--channels=", 0) == 0) {
+            int count = std::atoi(arg.c_str() + strlen("--channels="));
+            if (count < 0 || count > (int)MAX_CHANNEL_COUNT) {
+                std::cerr << "Server: Channel count must be between 0 and " << MAX_CHANNEL_COUNT << std::endl;
+                return false;
+            }
+            channelCount = static_cast<uint32_t>(count);
+        } else if (arg.rfind("--overflow=", 0) == 0) {
+            int count = std::atoi(arg.c_str() + strlen("--overflow="));
+            if (count < 0 || count > (int)MAX_OVERFLOW_COUNT) {
+                std::cerr << "Server: Overflow chunk count must be between 0 and " << MAX_OVERFLOW_COUNT << std::endl;
+                return false;
+            }
+            overflowCount = static_cast<uint32_t>(count);
+        } else if (arg.rfind("--workers=", 0) == 0) {
+            workerCount = std::atoi(arg.c_str() + strlen("--workers="));
+            if (workerCount < 0 || workerCount > 256) {
+                std::cerr << "Server: Worker count must be between 0 and 256" << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--cache=", 0) == 0) {
+            cacheEntries = std::atoi(arg.c_str() + strlen("--cache="));
+            if (cacheEntries < 0 || cacheEntries > 1000000) {
+                std::cerr << "Server: Cache size must be between 0 and 1000000 entries" << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--max-clients=", 0) == 0) {
+            maxClients = std::atoi(arg.c_str() + strlen("--max-clients="));
+            if (maxClients <= 0 || maxClients > (1 << 24)) {
+                std::cerr << "Server: Client table size must be between 1 and " << (1 << 24) << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--client-idle=", 0) == 0) {
+            int seconds = std::atoi(arg.c_str() + strlen("--client-idle="));
+            if (seconds <= 0 || seconds > 86400) {
+                std::cerr << "Server: Client idle time must be between 1 and 86400 seconds" << std::endl;
+                return false;
+            }
+            clientIdleMs = seconds * 1000;
+        } else if (arg.rfind("--weights=", 0) == 0) {
+            int high = 0, normal = 0, bulk = 0;
+            if (std::sscanf(arg.c_str() + strlen("--weights="), "%d,%d,%d", &high, &normal, &bulk) != 3 ||
+                high <= 0 || normal <= 0 || bulk <= 0 || high > 1000 || normal > 1000 || bulk > 1000) {
+                std::cerr << "Server: Weights must be three numbers between 1 and 1000 (high,normal,bulk)" << std::endl;
+                return false;
+            }
+            classWeights[PRIORITY_HIGH] = high;
+            classWeights[PRIORITY_NORMAL] = normal;
+            classWeights[PRIORITY_BULK] = bulk;
+        } else if (arg.rfind("--rate-limit=", 0) == 0) {
+            rateLimit = std::atoi(arg.c_str() + strlen("--rate-limit="));
+            if (rateLimit < 0 || rateLimit > 100000000) {
+                std::cerr << "Server: Rate limit must be between 0 and 100000000 commands per second" << std::endl;
+                return false;
+            }
+        } else if (arg.rfind("--rate-burst=", 0) == 0) {
+            rateBurst = std::atoi(arg.c_str() + strlen("--rate-burst="));
+            if (rateBurst < 0 || rateBurst > 100000000) {
+                std::cerr << "Server: Rate burst must be between 0 and 100000000 commands" << std::endl;
+                return false;
+            }
+        } else if (arg == "--reactor") {
+            if (!IPC_HAVE_COROUTINES) {
+                std::cerr << "Server: --reactor needs a build with C++20 coroutines" << std::endl;
+                return false;
+            }
+            reactorEnabled = true;
+        } else if (arg.rfind("--log-level=", 0) == 0) {
+            if (!parseLogLevel(arg.substr(strlen("--log-level=")), logLevel)) {
+                std::cerr << "Server: Unknown log level: " << arg << std::endl;
+                return false;
+            }
+        } else {
+            std::cerr << "Usage: server [--transport=mmap|file|shm|uring] [--fsync] [--prealloc] [--takeover=ipc_server_N.bin]"
+                      << " [--capture=FILE] [--capture-size=MB] [--slots=N] [--channels=N] [--overflow=N]"
+                      << " [--workers=N] [--cache=N] [--max-clients=N] [--client-idle=S] [--weights=H,N,B]"
+                      << " [--rate-limit=N] [--rate-burst=N] [--cpus=LIST] [--numa-node=N] [--reactor]"
+                      << " [--wait=block|hybrid|spin] [--spin-us=N]"
+                      << " [--log-level=debug|info|warn|error]" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Function to take the published requests off the ring, scanning the
+// slots in ring order from `cursor`. Stores up to `limit` slot indices in
+// `slots` and returns how many were taken.
+int takePendingRequests(IpcChannel& channel, uint32_t& cursor, int* slots, int limit) {
+    // With an I/O engine the whole ring is read in one batch; a mapped ring
+    // is read word by word
+    int statuses[MAX_SLOT_COUNT];
+    bool prefetched = hasIoEngine(channel) && loadSlotStatuses(channel, statuses);
+    
+    int taken = 0;
+    for (uint32_t i = 0; i < channel.slotCount && taken < limit; i++) {
+        uint32_t slot = (cursor + i) % channel.slotCount;
+        int status = prefetched ? statuses[slot] : loadSlotStatus(channel, slot);
+        
+        // The client only waits for the response, so the pickup wakes nobody
+        if (status == SLOT_REQUEST &&
+            compareExchangeSlotStatus(channel, slot, SLOT_REQUEST, SLOT_PROCESSING, false)) {
+            slots[taken++] = static_cast<int>(slot);
+        }
+    }
+    if (taken > 0) {
+        cursor = (static_cast<uint32_t>(slots[taken - 1]) + 1) % channel.slotCount;
+    }
+    return taken;
+}
+
+// Function to hand the response back to the client that owns the slot.
+// The client gets a fresh lease to read it in, so a client that died
+// meanwhile does not keep the slot.
+bool completeRequest(IpcChannel& channel, uint32_t slot, const Message& response) {
+    IoBatch batch(channel);
+    batch.writePayload(slotOffset(slot), response);
+    batch.storeWord(slotLeaseOffset(slot, offsetof(Message, lease_expires)), leaseDeadline(SLOT_RESPONSE_LEASE_MS));
+    if (!batch.submit()) {
+        releaseSlot(channel, slot);
         return false;
     }
     
-    int r = read(fd, &msg, sizeof(Message));
-    if (r == -1) {
+    if (!compareExchangeSlotStatus(channel, slot, SLOT_PROCESSING, SLOT_RESPONSE)) {
+        // The client cancelled while we were processing; recycle the slot
+        releaseSlot(channel, slot);
         return false;
     }
+    return true;
+}
+
+// Function to give a client its private response channel.
+// Must be called with registrationMutex held. Returns the 1-based channel
+// or 0 when all channels are taken (the client then keeps answering in slots).
+int assignReplyChannel(IpcChannel& channel, int clientId, int sessionToken) {
+    if (freeReplyChannels.empty()) {
+        return 0;
+    }
     
-    if (r == 0) {
-        std::memset(&msg, 0, sizeof(Message));
-        return true;
+    uint32_t index = freeReplyChannels.back();
+    freeReplyChannels.pop_back();
+    std::lock_guard<std::mutex> lock(replyChannelLocks[index]);
+    storeWord(channel, channelWordOffset(channel, index, offsetof(ResponseChannel, head)), 0);
+    storeWord(channel, channelWordOffset(channel, index, offsetof(ResponseChannel, tail)), 0);
+    storeWord(channel, channelWordOffset(channel, index, offsetof(ResponseChannel, ownerToken)), sessionToken);
+    storeWord(channel, channelWordOffset(channel, index, offsetof(ResponseChannel, ownerId)), clientId);
+    
+    return static_cast<int>(index) + 1;
+}
+
+// Function to take a response channel back from an expired or evicted
+// session. Its owner finds the channel unowned and opens a new session.
+// Must be called with registrationMutex held.
+void releaseReplyChannel(IpcChannel& channel, int replyChannel) {
+    if (replyChannel <= 0) {
+        return;
     }
     
-    return (r == sizeof(Message));
+    uint32_t index = static_cast<uint32_t>(replyChannel - 1);
+    {
+        std::lock_guard<std::mutex> lock(replyChannelLocks[index]);
+        storeWord(channel, channelWordOffset(channel, index, offsetof(ResponseChannel, ownerId)), 0);
+        storeWord(channel, channelWordOffset(channel, index, offsetof(ResponseChannel, ownerToken)), 0);
+    }
+    freeReplyChannels.push_back(index);
+}
+
+// Function to check that a request comes from a live session and names the
+// channel we gave that session
+bool isActiveSession(int clientId, int sessionToken, int replyChannel) {
+    int assigned = 0;
+    return clientTable.find(clientId, sessionToken, heartbeatClockMs(), assigned) && assigned == replyChannel;
 }
 
-bool writeMessage(int fd, const Message& msg) {
-    if (lseek(fd, 0, SEEK_SET) == -1) {
+// Function to publish a response on a client's private channel.
+// Returns false if the client stopped draining it (the response is dropped).
+bool publishResponse(IpcChannel& channel, int replyChannel, const Message& response) {
+    uint32_t index = static_cast<uint32_t>(replyChannel - 1);
+    std::lock_guard<std::mutex> lock(replyChannelLocks[index]);
+    size_t headOffset = channelWordOffset(channel, index, offsetof(ResponseChannel, head));
+    size_t tailOffset = channelWordOffset(channel, index, offsetof(ResponseChannel, tail));
+    
+    // A channel whose session expired meanwhile now belongs to somebody else
+    int head = 0;
+    int tail = 0;
+    int owner = 0;
+    IoBatch positions(channel);
+    positions.loadWord(headOffset, head);
+    positions.loadWord(tailOffset, tail);
+    positions.loadWord(channelWordOffset(channel, index, offsetof(ResponseChannel, ownerId)), owner);
+    if (!positions.submit() || head - tail >= RESPONSE_RING_DEPTH || owner != response.client_id) {
+        return false;
+    }
+    
+    // Entry, head and the waiting flag in one batch; the flag is read after
+    // the head store, as the wakeup handshake needs
+    int waiting = 0;
+    IoBatch publish(channel);
+    publish.writePayload(responseEntryOffset(channel, index, head), response);
+    publish.storeWord(headOffset, head + 1);
+    publish.sync(responseChannelOffset(channel, index), sizeof(ResponseChannel));
+    publish.loadWord(channelWordOffset(channel, index, offsetof(ResponseChannel, clientWaiting)), waiting);
+    if (!publish.submit()) {
         return false;
     }
+    if (waiting) {
+        wakeWord(channel, headOffset);
+    }
+    return true;
+}
+
+// A request taken off the ring, waiting to be processed
+struct RequestTask {
+    uint32_t slot = 0;
+    int replyChannel = 0;   // 1-based private channel, 0 = answer in `slot`
+    Message msg{};
+    uint8_t opcode = 0xFF;  // command of a single request, 0xFF = not looked up yet
+    bool registered = false;   // registerClient() already ran for this request
+    bool delayServed = false;  // the reactor already waited out the command's delay
+    int priority = PRIORITY_NORMAL;   // class the scheduler served it in
+    int thread = 0;         // metrics block of the thread processing it
+    std::chrono::steady_clock::time_point takenAt;
+    std::chrono::steady_clock::time_point startedAt;
+    std::chrono::steady_clock::time_point respondingAt;
+};
+
+// Function to send the response in `task.msg` either through the request
+// slot or the client's private channel (`replyChannel` > 0, slot already
+// released). A response nobody will read gives its overflow chunk back.
+bool deliverResponse(IpcChannel& channel, RequestTask& task) {
+    const Message& response = task.msg;
+    task.respondingAt = std::chrono::steady_clock::now();
+    
+    if (task.replyChannel == 0) {
+        if (!completeRequest(channel, task.slot, response)) {
+            incrementCounter(metrics->thread(task.thread).dropped);
+            releaseMessageBody(channel, response);
+            return false;
+        }
+        return true;
+    }
     
-    int w = write(fd, &msg, sizeof(Message));
-    if (w == -1) {
+    if (!publishResponse(channel, task.replyChannel, response)) {
+        LOG_EVENT(LOG_WARN, "Server: Dropped response for client #%d: response channel is full",
+                  response.client_id);
+        incrementCounter(metrics->thread(task.thread).dropped);
+        releaseMessageBody(channel, response);
         return false;
     }
+    return true;
+}
+
+// Function to look up the session of a request, or open a new one: for a
+// hello without a session, for a session from an earlier server (restart),
+// and for clients that send a ping without saying hello first.
+// Fills in client_id, session_token and reply_channel of `msg`.
+void registerClient(IpcChannel& channel, Message& msg) {
+    int now = heartbeatClockMs();
+    int replyChannel = 0;
+    if (clientTable.find(msg.client_id, msg.session_token, now, replyChannel)) {
+        msg.reply_channel = replyChannel;
+        return;
+    }
     
-    fsync(fd);
-    return (w == sizeof(Message));
+    // Assign a new ID, a token and a private response channel
+    int evictedId = 0;
+    {
+        std::lock_guard<std::mutex> lock(registrationMutex);
+        int sessionToken = 0;
+        do {
+            sessionToken = static_cast<int>(tokenGenerator());
+        } while (sessionToken == 0);
+        
+        int evictedChannel = 0;
+        msg.client_id = clientTable.allocate(now, evictedId, evictedChannel);
+        releaseReplyChannel(channel, evictedChannel);
+        replyChannel = assignReplyChannel(channel, msg.client_id, sessionToken);
+        clientTable.publish(msg.client_id, sessionToken, replyChannel);
+        
+        msg.session_token = sessionToken;
+        msg.reply_channel = replyChannel;
+    }
+    clientCounter++;
+    
+    if (evictedId > 0) {
+        LOG_EVENT(LOG_WARN, "Server: Client table is full, evicted client #%d", evictedId);
+    }
+    storeWord(channel, CLIENT_COUNT_OFFSET, clientTable.liveCount());
+    LOG_EVENT(LOG_INFO, "Server: Client #%d connected. Total connected clients: %d",
+              msg.client_id, clientTable.liveCount());
 }
 
-bool isValidPingRequest(const char* text) {
-    if (text == nullptr) return false;
+// Function to expire sessions that have been idle for --client-idle,
+// sweeping part of the client table on every housekeeping tick
+void expireIdleClients(IpcChannel& channel) {
+    // The whole table is covered about every ten seconds
+    size_t budget = std::max<size_t>(1, clientTable.capacity() * SERVER_HEARTBEAT_INTERVAL_MS / 10000);
+    int expired = 0;
+    {
+        std::lock_guard<std::mutex> lock(registrationMutex);
+        clientTable.expireIdle(heartbeatClockMs(), clientIdleMs, budget,
+                               [&](int clientId, int replyChannel, uint64_t requests) {
+            releaseReplyChannel(channel, replyChannel);
+            LOG_EVENT(LOG_DEBUG, "Server: Expired idle client #%d after %llu requests", clientId,
+                      static_cast<unsigned long long>(requests));
+            expired++;
+        });
+    }
+    if (expired > 0) {
+        storeWord(channel, CLIENT_COUNT_OFFSET, clientTable.liveCount());
+    }
+}
+
+// Function to answer a session handshake with the client's ID, token,
+// response channel and the protocol version both sides speak. A hello
+// without a HelloBody comes from a text-only client.
+void processHello(IpcChannel& channel, RequestTask& task, std::string_view body) {
+    Message& msg = task.msg;
+    incrementCounter(metrics->thread(task.thread).hellos);
     
-    std::string request(text);
+    HelloBody offer{PROTOCOL_TEXT, PROTOCOL_TEXT};
+    if (body.size() == sizeof(HelloBody)) {
+        std::memcpy(&offer, body.data(), sizeof(offer));
+    }
+    releaseMessageBody(channel, msg);
     
-    // Remove leading and trailing whitespace
-    size_t start = request.find_first_not_of(" \t\n\r");
-    if (start == std::string::npos) return false;
+    uint16_t version = std::min(offer.maxVersion, PROTOCOL_VERSION);
+    msg.status = 2;
+    if (version < offer.minVersion || version < PROTOCOL_MIN_VERSION) {
+        LOG_EVENT(LOG_WARN, "Server: Rejected hello: client speaks protocol %u-%u, server %u-%u",
+                  offer.minVersion, offer.maxVersion, PROTOCOL_MIN_VERSION, PROTOCOL_VERSION);
+        msg.result = RESULT_UNSUPPORTED;
+        setMessageText(channel, msg, "ERROR: Unsupported protocol version");
+        deliverResponse(channel, task);
+        return;
+    }
     
-    size_t end = request.find_last_not_of(" \t\n\r");
-    request = request.substr(start, end - start + 1);
+    registerClient(channel, msg);
     
-    std::string lowerRequest = request;
-    std::transform(lowerRequest.begin(), lowerRequest.end(), lowerRequest.begin(),
-                  [](unsigned char c){ return std::tolower(c); });
+    HelloBody accepted{version, version};
+    msg.result = RESULT_OK;
+    setMessageBody(channel, msg, reinterpret_cast<const char*>(&accepted), sizeof(accepted));
+    if (!deliverResponse(channel, task)) {
+        return;
+    }
     
-    return lowerRequest == "ping";
+    LOG_EVENT(LOG_DEBUG, "Server: Opened session for client #%d (protocol %u)", msg.client_id, version);
 }
 
-// Function to find the maximum number of an existing server
-int findMaxServerNumber() {
-    int maxNumber = 0;
+// Command dispatch. Every command (Opcode, see ipc_common.h) has an entry
+// in COMMAND_TABLE, indexed by opcode, with its handler and declared cost.
+// Binary requests name the opcode directly. Text is mapped to an opcode
+// through COMMAND_INDEX, a small hash table built at compile time from the
+// command names, so a lookup is one hash and one compare whatever the
+// number of commands.
+const uint8_t OP_UNKNOWN = OP_COUNT;    // not a command
+const uint8_t OP_UNRESOLVED = 0xFF;     // not looked up yet
+
+// Where a command runs: cheap handlers answer on the thread that took the
+// request off the ring, since handing them to a worker costs more than the
+// work. Slow ones go to the worker pool (--workers=N) so the ring keeps
+// moving; without a pool everything runs on the main thread.
+enum HandlerCost {
+    COST_INLINE,
+    COST_POOL
+};
+
+// Whether a handler's response may be reused (see response_cache.h).
+// CACHE_SHARED responses depend only on the request, CACHE_PER_CLIENT ones
+// also on the client, which is registered before the lookup. Handlers with
+// side effects, delays or changing output stay CACHE_NONE, and so do those
+// cheaper than a lookup: ping logs every request and its pong is one
+// snprintf, less than hashing, probing and copying a cached one.
+enum CacheScope {
+    CACHE_NONE,
+    CACHE_SHARED,
+    CACHE_PER_CLIENT
+};
+
+// A handler writes its response text into `response` (at most `size` - 1
+// bytes, `length` starts at 0) and returns whether the command succeeded
+using CommandHandler = bool (*)(IpcChannel& channel, RequestTask& task, char* response, size_t size,
+                                size_t& length);
+
+struct CommandSpec {
+    Opcode opcode;
+    std::string_view name;
+    HandlerCost cost;
+    int delayMs;   // stall before the handler runs (simulated slow commands)
+    CacheScope cache;
+    CommandHandler handler;
+};
+
+const int TIMEOUT_DELAY_MS = 3000;   // answered late, but within the client's 5 s
+const int CRASH_FREEZE_MS = 6000;    // longer than the client waits
+
+// Function to register the client with its first command that needs an ID
+void ensureRegistered(IpcChannel& channel, RequestTask& task) {
+    if (!task.registered) {
+        registerClient(channel, task.msg);
+        task.registered = true;
+    }
+}
+
+// Function to stall a handler, cut short when the server shuts down
+void sleepWhileRunning(int milliseconds) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+    while (running && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(WAIT_POLL_INTERVAL_MS));
+    }
+}
+
+// Binary clients only look at the result code, so they get no pong text
+bool handlePing(IpcChannel& channel, RequestTask& task, char* response, size_t size, size_t& length) {
+    ensureRegistered(channel, task);
+    LOG_EVENT(LOG_DEBUG, "Server: Received 'ping' from client #%d", task.msg.client_id);
+    if (task.msg.type != MESSAGE_BINARY && !(task.msg.flags & FRAME_BINARY)) {
+        length = formatPong(response, size, task.msg.client_id);
+    }
+    return true;
+}
+
+size_t formatStatsReport(char* buffer, size_t size);
+
+bool handleStats(IpcChannel&, RequestTask&, char* response, size_t size, size_t& length) {
+    length = formatStatsReport(response, size);
+    return true;
+}
+
+bool handleError(IpcChannel&, RequestTask& task, char* response, size_t size, size_t& length) {
+    LOG_EVENT(LOG_DEBUG, "Server: Simulated processing error for client #%d", task.msg.client_id);
+    appendText(response, size, length, "ERROR: Simulated processing error");
+    return false;
+}
+
+bool handleTimeout(IpcChannel&, RequestTask& task, char* response, size_t size, size_t& length) {
+    LOG_EVENT(LOG_DEBUG, "Server: Delayed response to client #%d by %d ms", task.msg.client_id, TIMEOUT_DELAY_MS);
+    appendText(response, size, length, "OK: Delayed response");
+    return true;
+}
+
+// The response still goes out after the freeze: by then the client has
+// given up, so sending it recycles the slot instead of leaking it
+bool handleCrash(IpcChannel&, RequestTask& task, char* response, size_t size, size_t& length) {
+    LOG_EVENT(LOG_DEBUG, "Server: Simulated a freeze for client #%d", task.msg.client_id);
+    appendText(response, size, length, "OK: Recovered from simulated freeze");
+    return true;
+}
+
+bool handleInvalid(IpcChannel&, RequestTask&, char*, size_t, size_t&) {
+    return true;
+}
+
+constexpr CommandSpec COMMAND_TABLE[] = {
+    {OP_PING,    "ping",    COST_INLINE, 0,                CACHE_NONE,       handlePing},
+    {OP_STATS,   "stats",   COST_INLINE, 0,                CACHE_NONE,       handleStats},
+    {OP_ERROR,   "error",   COST_INLINE, 0,                CACHE_NONE,       handleError},
+    {OP_TIMEOUT, "timeout", COST_POOL,   TIMEOUT_DELAY_MS, CACHE_NONE,       handleTimeout},
+    {OP_CRASH,   "crash",   COST_POOL,   CRASH_FREEZE_MS,  CACHE_NONE,       handleCrash},
+    {OP_INVALID, "invalid", COST_INLINE, 0,                CACHE_SHARED,     handleInvalid},
+};
+
+constexpr bool isCommandTableOrdered() {
+    for (size_t i = 0; i < OP_COUNT; i++) {
+        if (COMMAND_TABLE[i].opcode != i) return false;
+    }
+    return true;
+}
+
+static_assert(sizeof(COMMAND_TABLE) / sizeof(COMMAND_TABLE[0]) == OP_COUNT, "every opcode needs a handler");
+static_assert(isCommandTableOrdered(), "COMMAND_TABLE must be indexed by opcode");
+static_assert(OP_COUNT <= MAX_METRIC_COMMANDS, "opcodes must fit the metrics counters");
+static_assert(PRIORITY_COUNT <= MAX_METRIC_PRIORITIES, "priority classes must fit the metrics histograms");
+
+// Case-insensitive FNV-1a, usable at compile time for the command names
+constexpr uint32_t commandHash(std::string_view text) {
+    uint32_t hash = 2166136261u;
+    for (char c : text) {
+        char lower = (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+        hash = (hash ^ static_cast<uint8_t>(lower)) * 16777619u;
+    }
+    return hash;
+}
+
+const size_t COMMAND_INDEX_SIZE = 16;   // power of two, well above OP_COUNT
+
+// Open-addressing table: opcode + 1 at the slot of its name's hash, 0 = empty
+struct CommandIndex {
+    uint8_t entries[COMMAND_INDEX_SIZE];
+};
+
+constexpr CommandIndex buildCommandIndex() {
+    CommandIndex index{};
+    for (const CommandSpec& command : COMMAND_TABLE) {
+        size_t position = commandHash(command.name) & (COMMAND_INDEX_SIZE - 1);
+        while (index.entries[position] != 0) {
+            position = (position + 1) & (COMMAND_INDEX_SIZE - 1);
+        }
+        index.entries[position] = static_cast<uint8_t>(command.opcode + 1);
+    }
+    return index;
+}
+
+constexpr CommandIndex COMMAND_INDEX = buildCommandIndex();
+
+// Function to check the opcode of a binary request or batch entry
+uint8_t binaryOpcode(int opcode) {
+    return (opcode >= 0 && opcode < OP_COUNT) ? static_cast<uint8_t>(opcode) : OP_UNKNOWN;
+}
+
+// Function to map request text to its opcode, or OP_UNKNOWN
+uint8_t lookupOpcode(std::string_view text) {
+    text = trimWhitespace(text);
+    size_t position = commandHash(text) & (COMMAND_INDEX_SIZE - 1);
     
-#if !PLATFORM_WINDOWS
-    DIR* dir = opendir(".");
-    if (dir) {
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != nullptr) {
-            std::string filename = entry->d_name;
-            if (filename.find(SERVER_FILE_PREFIX) == 0) {
-                // Extract the number from the filename
-                std::string numStr = filename.substr(strlen(SERVER_FILE_PREFIX));
-                size_t dotPos = numStr.find('.');
-                if (dotPos != std::string::npos) {
-                    numStr = numStr.substr(0, dotPos);
-                    try {
-                        int num = std::stoi(numStr);
-                        if (num > maxNumber) {
-                            maxNumber = num;
-                        }
-                    } catch (...) {
-                        // Ignore files with incorrect names
-                    }
-                }
-            }
+    while (COMMAND_INDEX.entries[position] != 0) {
+        uint8_t opcode = static_cast<uint8_t>(COMMAND_INDEX.entries[position] - 1);
+        if (equalsIgnoreCase(text, COMMAND_TABLE[opcode].name)) {
+            return opcode;
         }
-        closedir(dir);
+        position = (position + 1) & (COMMAND_INDEX_SIZE - 1);
     }
-#else
-    // For Windows
-    WIN32_FIND_DATA findFileData;
-    HANDLE hFind = FindFirstFile("*", &findFileData);
-    if (hFind != INVALID_HANDLE_VALUE) {
-        do {
-            std::string filename = findFileData.cFileName;
-            if (filename.find(SERVER_FILE_PREFIX) == 0) {
-                std::string numStr = filename.substr(strlen(SERVER_FILE_PREFIX));
-                size_t dotPos = numStr.find('.');
-                if (dotPos != std::string::npos) {
-                    numStr = numStr.substr(0, dotPos);
-                    try {
-                        int num = std::stoi(numStr);
-                        if (num > maxNumber) {
-                            maxNumber = num;
-                        }
-                    } catch (...) {
-                        // Ignore files with incorrect names
-                    }
-                }
-            }
-        } while (FindNextFile(hFind, &findFileData) != 0);
-        FindClose(hFind);
+    return OP_UNKNOWN;
+}
+
+// Function to run the handler for `opcode` on `request` (the command text
+// or binary body), or write the unknown-command error, and count the
+// command on the calling thread. Cacheable commands are answered from the
+// thread's response cache when the same request was seen before.
+bool runCommand(IpcChannel& channel, RequestTask& task, uint8_t opcode, std::string_view request, char* response,
+                size_t size, size_t& length) {
+    length = 0;
+    response[0] = '\0';
+    ThreadMetrics& counters = metrics->thread(task.thread);
+    
+    if (opcode >= OP_COUNT) {
+        incrementCounter(counters.invalid);
+        appendText(response, size, length, INVALID_REQUEST_RESPONSE);
+        return false;
     }
-#endif
     
-    return maxNumber;
+    incrementCounter(counters.commands[opcode]);
+    const CommandSpec& spec = COMMAND_TABLE[opcode];
+    if (spec.delayMs > 0 && !task.delayServed) {
+        sleepWhileRunning(spec.delayMs);
+    }
+    
+    ResponseCache& cache = responseCaches[task.thread];
+    if (spec.cache == CACHE_NONE || !cache.enabled()) {
+        return spec.handler(channel, task, response, size, length);
+    }
+    
+    if (spec.cache == CACHE_PER_CLIENT) {
+        ensureRegistered(channel, task);
+    }
+    CacheKey key{opcode, task.msg.type == MESSAGE_BINARY || (task.msg.flags & FRAME_BINARY) != 0,
+                 spec.cache == CACHE_PER_CLIENT ? task.msg.client_id : 0, request};
+    bool succeeded = false;
+    if (cache.lookup(key, response, size, length, succeeded)) {
+        incrementCounter(counters.cacheHits);
+        return succeeded;
+    }
+    
+    incrementCounter(counters.cacheMisses);
+    succeeded = spec.handler(channel, task, response, size, length);
+    cache.store(key, std::string_view(response, length), succeeded);
+    return succeeded;
 }
 
-// Function to remove the server file on exit
-void cleanupServerFile() {
-    if (unlink(currentFileName.c_str()) == 0) {
-        logEvent("Server: Removed IPC file: " + currentFileName);
+// Function to append one latency histogram line (nanoseconds shown in us)
+void appendLatencyLine(char* buffer, size_t size, size_t& length, const char* name,
+                       const LatencyHistogram& histogram) {
+    char line[160];
+    int count = std::snprintf(line, sizeof(line), "%-20s p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", name,
+                              histogram.percentile(50) / 1000.0, histogram.percentile(99) / 1000.0,
+                              histogram.percentile(99.9) / 1000.0, histogram.max() / 1000.0);
+    appendText(buffer, size, length, std::string_view(line, count > 0 ? static_cast<size_t>(count) : 0));
+}
+
+// Function to write the statistics report of all processing threads;
+// returns its length. Clients that do not fit are left out.
+size_t formatStatsReport(char* buffer, size_t size) {
+    MetricsSnapshot snapshot;
+    metrics->snapshot(snapshot);
+    
+    size_t length = 0;
+    char line[256];
+    int count = std::snprintf(line, sizeof(line),
+                              "Server #%d: %llu requests (%llu batches with %llu entries, %llu hello), "
+                              "%llu responses dropped\nCommands:",
+                              serverInstanceNumber,
+                              static_cast<unsigned long long>(snapshot.requests),
+                              static_cast<unsigned long long>(snapshot.batches),
+                              static_cast<unsigned long long>(snapshot.batchEntries),
+                              static_cast<unsigned long long>(snapshot.hellos),
+                              static_cast<unsigned long long>(snapshot.dropped));
+    appendText(buffer, size, length, std::string_view(line, count > 0 ? static_cast<size_t>(count) : 0));
+    
+    for (const CommandSpec& command : COMMAND_TABLE) {
+        count = std::snprintf(line, sizeof(line), " %.*s %llu", static_cast<int>(command.name.size()),
+                              command.name.data(), static_cast<unsigned long long>(snapshot.commands[command.opcode]));
+        appendText(buffer, size, length, std::string_view(line, count > 0 ? static_cast<size_t>(count) : 0));
+    }
+    count = std::snprintf(line, sizeof(line),
+                          " unknown %llu\nResponse cache: %llu hits, %llu misses\nRate limit: %llu requests demoted\n",
+                          static_cast<unsigned long long>(snapshot.invalid),
+                          static_cast<unsigned long long>(snapshot.cacheHits),
+                          static_cast<unsigned long long>(snapshot.cacheMisses),
+                          static_cast<unsigned long long>(snapshot.rateLimited));
+    appendText(buffer, size, length, std::string_view(line, count > 0 ? static_cast<size_t>(count) : 0));
+    
+    appendLatencyLine(buffer, size, length, "Queue wait (us):", snapshot.queueWait);
+    for (int priority : {PRIORITY_HIGH, PRIORITY_NORMAL, PRIORITY_BULK}) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "  %s:", priorityName(priority));
+        appendLatencyLine(buffer, size, length, name, snapshot.classQueueWait[priority]);
+    }
+    appendLatencyLine(buffer, size, length, "Processing (us):", snapshot.processing);
+    appendLatencyLine(buffer, size, length, "Response write (us):", snapshot.responseWrite);
+    
+    std::vector<std::pair<int, uint64_t>> clients;
+    clientTable.forEachSession([&](int clientId, uint64_t requests) { clients.emplace_back(clientId, requests); });
+    std::sort(clients.begin(), clients.end());
+    appendText(buffer, size, length, "Requests per client:");
+    for (const auto& client : clients) {
+        count = std::snprintf(line, sizeof(line), " #%d=%llu", client.first,
+                              static_cast<unsigned long long>(client.second));
+        if (count <= 0 || length + count + 4 >= size) {
+            appendText(buffer, size, length, " ...");
+            break;
+        }
+        appendText(buffer, size, length, std::string_view(line, count));
     }
+    return length;
 }
 
-int main() {
-    signal(SIGINT, signalHandler);
-    signal(SIGTERM, signalHandler);
+// Function to decide where a request runs, resolving the opcode of a
+// single command on the way so the processing thread need not look it up
+// again. Batches go to the pool as a whole; commands with a body in an
+// overflow chunk are looked up by whoever processes them.
+HandlerCost requestCost(RequestTask& task) {
+    const Message& msg = task.msg;
+    if (msg.type == MESSAGE_BATCH) {
+        return COST_POOL;
+    }
+    if (msg.type == MESSAGE_BINARY) {
+        task.opcode = binaryOpcode(msg.opcode);
+        return task.opcode < OP_COUNT ? COMMAND_TABLE[task.opcode].cost : COST_INLINE;
+    }
+    if (msg.type != MESSAGE_SINGLE) {
+        return COST_INLINE;
+    }
+    if (msg.flags & FRAME_OVERFLOW) {
+        return COST_POOL;
+    }
+    
+    task.opcode = lookupOpcode(messageText(msg.data, sizeof(msg.data)));
+    return task.opcode < OP_COUNT ? COMMAND_TABLE[task.opcode].cost : COST_INLINE;
+}
+
+// Function to answer every entry of a batch frame with one combined
+// response. Processing stops once the response is full; the client
+// resends whatever is left.
+void processBatch(IpcChannel& channel, RequestTask& task, std::string_view body) {
+    Message& msg = task.msg;
     
-    // Find the maximum number of an existing server
-    int maxServerNumber = findMaxServerNumber();
-    serverInstanceNumber = maxServerNumber + 1;
+    // The combined response may use an overflow chunk. If none is free when
+    // it is sent, the server falls back to the entries that fit in place.
+    char response[OVERFLOW_CHUNK_SIZE];
+    size_t capacity = channel.overflowCount > 0 ? sizeof(response) : sizeof(msg.data) - 1;
+    size_t used = 0;
+    size_t inlineUsed = 0;
+    int inlineCount = 0;
+    beginBatch(response, used);
+    inlineUsed = used;
     
-    // Create a filename with a sequential number
-    currentFileName = std::string(SERVER_FILE_PREFIX) + std::to_string(serverInstanceNumber) + ".bin";
-    logEvent("Server: Starting server #" + std::to_string(serverInstanceNumber) + 
-            " with file: " + currentFileName);
+    size_t position = 1;
+    int total = batchEntryCount(body);
+    bool binary = (msg.flags & FRAME_BINARY) != 0;
     
-    int fd = open(currentFileName.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-    if (fd == -1) {
-        // If the file already exists, try to open it
-        fd = open(currentFileName.c_str(), O_RDWR);
-        if (fd == -1) {
-            std::cerr << "Server: Failed to open IPC file: " << strerror(errno) << std::endl;
-            return 1;
+    for (int i = 0; i < total; i++) {
+        uint8_t result = 0;
+        std::string_view text;
+        if (!readBatchEntry(body, position, result, text)) {
+            break;
+        }
+        
+        char entry[sizeof(msg.data)];
+        size_t length = 0;
+        uint8_t opcode = binary ? binaryOpcode(text.empty() ? -1 : static_cast<uint8_t>(text[0]))
+                                : lookupOpcode(text);
+        uint8_t status = runCommand(channel, task, opcode, text, entry, sizeof(entry), length)
+                             ? BATCH_ENTRY_OK : BATCH_ENTRY_ERROR;
+        
+        if (!appendBatchEntry(response, capacity, used, status, std::string_view(entry, length))) {
+            break;
+        }
+        if (used < sizeof(msg.data)) {
+            inlineUsed = used;
+            inlineCount = i + 1;
         }
-        logEvent("Server: Using existing IPC file");
     }
     
-    // Initialize the file
-    long size = lseek(fd, 0, SEEK_END);
-    if (size < (long)sizeof(Message)) {
-        Message init{};
-        init.status = 0;
-        init.client_id = 0;
-        std::memset(init.data, 0, sizeof(init.data));
-        if (!writeMessage(fd, init)) {
-            std::cerr << "Server: Failed to initialize IPC file" << std::endl;
-            close(fd);
-            return 1;
+    LOG_EVENT(LOG_DEBUG, "Server: Received batch of %d requests from client #%d", total, msg.client_id);
+    ThreadMetrics& counters = metrics->thread(task.thread);
+    incrementCounter(counters.batches);
+    incrementCounter(counters.batchEntries, static_cast<uint64_t>(total));
+    
+    // Done with the request body; the message now carries the response
+    releaseMessageBody(channel, msg);
+    if (!setMessageBody(channel, msg, response, used)) {
+        response[0] = static_cast<char>(inlineCount);
+        setMessageBody(channel, msg, response, inlineUsed);
+    }
+    
+    int sent = static_cast<unsigned char>(response[0]);
+    
+    msg.status = 2;
+    if (!deliverResponse(channel, task)) {
+        return;
+    }
+    
+    LOG_EVENT(LOG_DEBUG, "Server: Sent %d of %d batch responses to client #%d", sent, total, msg.client_id);
+}
+
+// Function to validate and answer one request
+void serveRequest(IpcChannel& channel, RequestTask& task) {
+    Message& msg = task.msg;
+    
+    char scratch[OVERFLOW_CHUNK_SIZE];
+    std::string_view body;
+    if (!messageBody(channel, msg, scratch, body)) {
+        LOG_EVENT(LOG_WARN, "Server: Invalid message body from client #%d", msg.client_id);
+        msg.status = 2;
+        msg.type = MESSAGE_SINGLE;
+        setMessageText(channel, msg, "ERROR: Invalid message body");
+        deliverResponse(channel, task);
+        return;
+    }
+    
+    if (msg.type == MESSAGE_HELLO) {
+        processHello(channel, task, body);
+        return;
+    }
+    
+    if (msg.type == MESSAGE_BATCH) {
+        processBatch(channel, task, body);
+        return;
+    }
+    
+    // Binary requests name their command; text is looked up unless the
+    // main loop already did
+    bool binary = (msg.type == MESSAGE_BINARY);
+    std::string_view request = binary ? body : messageText(body.data(), body.size());
+    uint8_t opcode = task.opcode;
+    if (opcode == OP_UNRESOLVED) {
+        opcode = binary ? binaryOpcode(msg.opcode) : lookupOpcode(request);
+        task.opcode = opcode;
+    }
+    if (opcode >= OP_COUNT && !binary) {
+        LOG_EVENT(LOG_DEBUG, "Server: Invalid message from client #%d: \"%.*s\"",
+                  msg.client_id, static_cast<int>(request.size()), request.data());
+    } else if (opcode >= OP_COUNT) {
+        LOG_EVENT(LOG_DEBUG, "Server: Invalid opcode %d from client #%d", msg.opcode, msg.client_id);
+    }
+    
+    // `request` may point into the overflow chunk, so the body is released
+    // only once the handler is done with it
+    char response[OVERFLOW_CHUNK_SIZE];
+    size_t length = 0;
+    bool succeeded = runCommand(channel, task, opcode, request, response, sizeof(response), length);
+    releaseMessageBody(channel, msg);
+    if (binary) {
+        msg.result = opcode >= OP_COUNT ? RESULT_UNKNOWN_OPCODE : (succeeded ? RESULT_OK : RESULT_ERROR);
+    }
+    
+    // Long responses (stats) need an overflow chunk; without one they are
+    // cut off to what fits in place
+    msg.status = 2;
+    if (!setMessageBody(channel, msg, response, length)) {
+        setMessageBody(channel, msg, response, std::min(length, sizeof(msg.data) - 1));
+    }
+    
+    if (!deliverResponse(channel, task)) {
+        return;
+    }
+    
+    if (opcode == OP_PING) {
+        LOG_EVENT(LOG_DEBUG, "Server: Sent 'pong' to client #%d", msg.client_id);
+    }
+}
+
+// Wall time between two points of a request, in nanoseconds
+uint64_t elapsedNs(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count());
+}
+
+// Trace of every request (--capture), written by all processing threads
+TraceWriter traceWriter;
+std::atomic<bool> traceFullReported{false};
+
+int requestCommands(const Message& msg);
+
+// Function to fill in the trace record of a request from the request
+// itself, before its response overwrites the message
+void beginTraceRecord(const RequestTask& task, TraceRecord& record) {
+    const Message& msg = task.msg;
+    record.arrivalNs = traceWriter.sinceStart(task.takenAt);
+    record.clientId = msg.client_id;
+    record.length = static_cast<uint16_t>(std::clamp(msg.length, 0, 0xFFFF));
+    record.type = static_cast<uint8_t>(msg.type);
+    record.entries = static_cast<uint8_t>(requestCommands(msg));
+    record.priority = static_cast<uint8_t>(task.priority);
+    record.flags = (msg.type == MESSAGE_BINARY || (msg.flags & FRAME_BINARY)) ? TRACE_BINARY : 0;
+}
+
+// Function to complete the trace record once the response is delivered
+// and append it. serveRequest() resolved the command into `task.opcode`.
+void finishTraceRecord(const RequestTask& task, TraceRecord& record, std::chrono::steady_clock::time_point finishedAt) {
+    record.opcode = task.opcode;
+    record.serviceUs = static_cast<uint32_t>(std::min<uint64_t>(elapsedNs(task.takenAt, finishedAt) / 1000, UINT32_MAX));
+    if (!traceWriter.append(record) && !traceFullReported.exchange(true)) {
+        LOG_EVENT(LOG_WARN, "Server: Capture file %s is full, later requests are not recorded", captureFile.c_str());
+    }
+}
+
+// Function to process one request and deliver its response, then record
+// where the time went and update the load figures clients use to choose
+// a server. Runs on the main thread, or on pool worker `thread - 1`.
+void processRequest(IpcChannel& channel, RequestTask& task, int thread) {
+    task.thread = thread;
+    if (!task.delayServed) {
+        task.startedAt = std::chrono::steady_clock::now();   // a reactor delay counts as processing
+    }
+    task.respondingAt = std::chrono::steady_clock::now();
+    
+    TraceRecord record{};
+    bool capturing = traceWriter.enabled();
+    if (capturing) {
+        beginTraceRecord(task, record);
+    }
+    
+    serveRequest(channel, task);
+    
+    auto finishedAt = std::chrono::steady_clock::now();
+    if (capturing) {
+        finishTraceRecord(task, record, finishedAt);
+    }
+    metrics->recordRequest(thread, task.priority, elapsedNs(task.takenAt, task.startedAt),
+                           elapsedNs(task.startedAt, task.respondingAt), elapsedNs(task.respondingAt, finishedAt));
+    clientTable.countRequest(task.msg.client_id);
+    
+    fetchAddWord(channel, IN_FLIGHT_OFFSET, -1);
+    
+    // Moving average over roughly the last 8 requests. Concurrent workers
+    // may overwrite each other's update; this is an estimate, not a count.
+    int sample = static_cast<int>(std::chrono::duration_cast<std::chrono::microseconds>(
+        finishedAt - task.takenAt).count());
+    int average = 0;
+    loadWord(channel, LATENCY_US_OFFSET, average);
+    storeWord(channel, LATENCY_US_OFFSET, average + (sample - average) / 8);
+}
+
+// Function to count the requests waiting in the ring, for the load figures
+int countQueuedRequests(const IpcChannel& channel, const int* statuses) {
+    return static_cast<int>(std::count(statuses, statuses + channel.slotCount, static_cast<int>(SLOT_REQUEST)));
+}
+
+// Function to read the request in `slot` into a task. Requests from
+// clients with a private channel only need the slot until they are read,
+// so it goes back to the ring right away. Returns false if there is
+// nothing to answer.
+bool acceptRequest(IpcChannel& channel, int slot, RequestTask& task) {
+    Message msg{};
+    if (!readMessage(channel, slot, msg)) {
+        releaseSlot(channel, slot);
+        return false;
+    }
+    
+    int replyChannel = 0;
+    if (msg.reply_channel > 0) {
+        releaseSlot(channel, slot);
+        
+        if (!isActiveSession(msg.client_id, msg.session_token, msg.reply_channel)) {
+            LOG_EVENT(LOG_WARN, "Server: Ignored request from client #%d: unknown session or response channel %d",
+                      msg.client_id, msg.reply_channel);
+            releaseMessageBody(channel, msg);
+            return false;
         }
+        replyChannel = msg.reply_channel;
     }
     
-    logEvent("Server started.");
+    task.slot = static_cast<uint32_t>(slot);
+    task.replyChannel = replyChannel;
+    task.msg = msg;
+    task.takenAt = std::chrono::steady_clock::now();
+    fetchAddWord(channel, IN_FLIGHT_OFFSET, 1);
+    return true;
+}
+
+// Requests taken off the ring and waiting for the dispatcher, and the
+// per-client rate limits applied on the way in. Main thread only.
+RequestScheduler<RequestTask, PRIORITY_COUNT> scheduler;
+RateLimiter rateLimiter;
+
+// The scheduler holds at most this many requests per slot; beyond that
+// requests stay in the ring and clients get busy answers as before
+const size_t SCHEDULED_PER_SLOT = 4;
+
+// Function to count the commands in a request, which is what the
+// scheduler and the rate limit charge: a batch costs its entries
+// (estimated from its size when the body is in an overflow chunk)
+int requestCommands(const Message& msg) {
+    if (msg.type != MESSAGE_BATCH) {
+        return 1;
+    }
+    if (msg.flags & FRAME_OVERFLOW) {
+        return std::clamp(msg.length / 3, 1, static_cast<int>(BATCH_MAX_ENTRIES));
+    }
+    return std::max(1, batchEntryCount(std::string_view(msg.data, msg.length > 0 ? 1 : 0)));
+}
+
+// Function to choose the class a request is scheduled in: the one it asks
+// for, demoted to bulk while its client is over the rate limit. A hello is
+// always high, so a new client gets its session past any backlog.
+int schedulingClass(const RequestTask& task, int commands) {
+    const Message& msg = task.msg;
+    if (msg.type == MESSAGE_HELLO) {
+        return PRIORITY_HIGH;
+    }
+    int priority = (msg.priority >= 0 && msg.priority < PRIORITY_COUNT) ? msg.priority : PRIORITY_NORMAL;
+    if (priority == PRIORITY_BULK) {
+        return priority;
+    }
+    
+    int64_t nowUs = std::chrono::duration_cast<std::chrono::microseconds>(task.takenAt.time_since_epoch()).count();
+    if (!rateLimiter.admit(msg.client_id, nowUs, commands)) {
+        incrementCounter(metrics->thread(0).rateLimited);
+        return PRIORITY_BULK;
+    }
+    return priority;
+}
+
+// Function to move the published requests off the ring into the
+// scheduler, so whatever came in since the last pick competes by class
+// instead of by arrival. Returns the number of requests queued.
+int admitRequests(IpcChannel& channel, uint32_t& cursor) {
+    size_t limit = channel.slotCount * SCHEDULED_PER_SLOT;
+    if (scheduler.size() >= limit) {
+        return 0;
+    }
+    
+    int slots[MAX_SLOT_COUNT];
+    int room = static_cast<int>(std::min<size_t>(channel.slotCount, limit - scheduler.size()));
+    int taken = takePendingRequests(channel, cursor, slots, room);
+    int queued = 0;
+    for (int i = 0; i < taken; i++) {
+        RequestTask task;
+        if (!acceptRequest(channel, slots[i], task)) {
+            continue;
+        }
+        int commands = requestCommands(task.msg);
+        task.priority = schedulingClass(task, commands);
+        int priority = task.priority;
+        scheduler.push(std::move(task), priority, commands);
+        queued++;
+    }
+    return queued;
+}
+
+#if IPC_HAVE_COROUTINES
+// Function to answer a slow command once its delay is over, without
+// holding a thread while it waits
+Task<void> serveDelayedRequest(Reactor& reactor, IpcChannel& channel, RequestTask task) {
+    task.startedAt = std::chrono::steady_clock::now();
+    co_await reactor.sleepFor(COMMAND_TABLE[task.opcode].delayMs);
+    task.delayServed = true;
+    processRequest(channel, task, 0);
+}
+
+// Function to run the main loop as a coroutine (--reactor): waiting for
+// the doorbell and the delays of slow commands share the main thread.
+// In a handoff it returns once the requests it took are dispatched; the
+// reactor runs the delayed ones to the end.
+Task<void> serveRing(Reactor& reactor, IpcChannel& channel, WorkerPool<RequestTask>* pool) {
+    uint32_t cursor = 0;
     
     while (running) {
-        Message msg{};
+        int seen = 0;
+        if (!loadWord(channel, DOORBELL_OFFSET, seen)) {
+            co_await reactor.sleepFor(1000);
+            continue;
+        }
+        
+        if (!handoffRequested) {
+            admitRequests(channel, cursor);
+        }
+        RequestTask task;
+        if (!scheduler.pop(task)) {
+            if (handoffRequested) {
+                break;
+            }
+            co_await reactor.waitWord(channel, DOORBELL_OFFSET, seen, WAIT_POLL_INTERVAL_MS,
+                                      SERVER_SLEEPING_OFFSET, ANNOUNCE_FLAG);
+            continue;
+        }
+        
+        HandlerCost cost = requestCost(task);
+        if (task.opcode < OP_COUNT && COMMAND_TABLE[task.opcode].delayMs > 0) {
+            reactor.spawn(serveDelayedRequest(reactor, channel, std::move(task)));
+        } else if (pool && cost == COST_POOL) {
+            pool->submit(std::move(task));
+        } else {
+            processRequest(channel, task, 0);
+        }
+        
+        // A busy ring must not hold up delays that are due
+        if (reactor.hasDueWork()) {
+            co_await reactor.yield();
+        }
+    }
+}
+#endif
+
+// Function to remove the files of servers that crashed (or were killed)
+// without cleaning up, so they do not pile up and clients never try them.
+// Files of another layout version are left alone: their liveness words
+// cannot be read.
+void removeStaleServerFiles() {
+    for (const std::string& filename : listSharedFiles(transportMode)) {
+        if (filename.find(SERVER_FILE_PREFIX) != 0 || filename.find(".bin") == std::string::npos) {
+            continue;
+        }
+        
+        IpcChannel file;
+        if (!openSharedFile(file, filename, transportMode, false)) {
+            continue;
+        }
+        ServerHeader header{};
+        bool stale = readShared(file, 0, &header, sizeof(header)) && header.magic == IPC_MAGIC &&
+                     header.version == IPC_LAYOUT_VERSION && !isServerAlive(file);
+        closeChannel(file);
+        
+        if (stale && removeSharedFile(filename, transportMode)) {
+            LOG_EVENT(LOG_INFO, "Server: Removed stale IPC file: %s", filename.c_str());
+        }
+    }
+}
+
+// Function to pin the dispatcher (the main thread) to the first --cpus
+// entry and prefer the server's NUMA node for its memory. Runs before the
+// server file is created, so the pages the dispatcher touches first come
+// from its own node. Returns the server's node, -1 if it is not placed.
+int placeDispatcher() {
+    if (!serverCpus.empty() && !pinCurrentThread({serverCpus[0]})) {
+        LOG_EVENT(LOG_WARN, "Server: Cannot pin the dispatcher to CPU %d", serverCpus[0]);
+    }
+    int node = numaNode >= 0 ? numaNode : serverCpus.empty() ? -1 : numaNodeOfCpu(serverCpus[0]);
+    if (node >= 0 && !preferMemoryNode(node)) {
+        LOG_EVENT(LOG_WARN, "Server: Cannot prefer NUMA node %d for the server's memory", node);
+    }
+    if (!serverCpus.empty() || node >= 0) {
+        LOG_EVENT(LOG_INFO, "Server: Dispatcher on CPU %d, memory on NUMA node %d",
+                  serverCpus.empty() ? -1 : serverCpus[0], node);
+    }
+    return node;
+}
+
+// Function to pin pool worker `worker` to the --cpus entries after the
+// dispatcher's, round robin. With a single entry the workers share the
+// dispatcher's CPU, which they inherit from it.
+void placeWorker(int worker) {
+    if (serverCpus.size() > 1) {
+        int cpu = serverCpus[1 + static_cast<size_t>(worker) % (serverCpus.size() - 1)];
+        if (!pinCurrentThread({cpu})) {
+            LOG_EVENT(LOG_WARN, "Server: Cannot pin worker %d to CPU %d", worker, cpu);
+        }
+    }
+}
+
+// Function to move the pages of the server file already in memory to the
+// server's node (a file left behind or taken over was touched elsewhere)
+// and publish the node, so clients on the same node prefer this server
+void placeServerFile(IpcChannel& channel, int node) {
+    if (node >= 0 && channel.view != nullptr && !bindMemoryToNode(channel.view, channel.mappedSize, node)) {
+        LOG_EVENT(LOG_WARN, "Server: Cannot move the server file to NUMA node %d: %s", node, strerror(errno));
+    }
+    storeWord(channel, NUMA_NODE_OFFSET, node);
+}
+
+// Function to remove the server file on exit
+void cleanupServerFile() {
+    if (removeSharedFile(currentFileName, transportMode)) {
+        LOG_EVENT(LOG_INFO, "Server: Removed IPC file: %s", currentFileName.c_str());
+    }
+}
+
+// Function to create and initialize the server file, reusing a file of
+// the same name if one was left behind. With --prealloc the file is
+// reserved on disk (or in shared memory) and mapped with every page
+// faulted in, so the first requests do not pay for it.
+bool createServerFile(IpcChannel& channel) {
+    size_t fileSize = serverFileSize(slotCount, channelCount, overflowCount);
+    if (!openSharedFile(channel, currentFileName, transportMode, true, fileSize)) {
+        // If the file already exists, try to open it
+        if (!openSharedFile(channel, currentFileName, transportMode, false)) {
+            std::cerr << "Server: Failed to open IPC file: " << strerror(errno) << std::endl;
+            return false;
+        }
+        LOG_EVENT(LOG_INFO, "Server: Using existing IPC file");
+    }
+    if (preallocate && !preallocateFile(channel.fd, fileSize)) {
+        LOG_EVENT(LOG_WARN, "Server: Cannot preallocate the IPC file: %s", strerror(errno));
+    }
+    
+    // Initialize the file: header plus empty slots
+    if (!initializeServerFile(channel, slotCount, channelCount, overflowCount, syncWrites)) {
+        std::cerr << "Server: Failed to initialize IPC file" << std::endl;
+        closeChannel(channel);
+        return false;
+    }
+    
+    channel.prefault = preallocate;
+    if (!openChannel(channel, currentFileName, transportMode, syncWrites)) {
+        std::cerr << "Server: Failed to map IPC file: " << strerror(errno) << std::endl;
+        closeChannel(channel);
+        return false;
+    }
+    return true;
+}
+
+// Function to take over the file of a running server (--takeover), so a
+// restart never leaves clients without it. The CAS to SERVER_HANDOFF
+// asks the running server to hand over; it answers what it already took
+// and releases the file. A crashed server has nothing to hand over and
+// its file is taken right away. Slot, channel and chunk counts come from
+// the file.
+bool takeOverServerFile(IpcChannel& channel, const std::string& filename) {
+    channel.prefault = preallocate;
+    if (!openSharedFile(channel, filename, transportMode, false) ||
+        !openChannel(channel, filename, transportMode, syncWrites)) {
+        std::cerr << "Server: Cannot open " << filename << " to take it over" << std::endl;
+        closeChannel(channel);
+        return false;
+    }
+    
+    int predecessor = 0;
+    loadWord(channel, SERVER_PID_OFFSET, predecessor);
+    bool alive = isServerAlive(channel);
+    if (!compareExchangeWord(channel, SERVER_STATE_OFFSET, SERVER_RUNNING, SERVER_HANDOFF)) {
+        std::cerr << "Server: " << filename << " is stopped or already being taken over" << std::endl;
+        closeChannel(channel);
+        return false;
+    }
+    
+    if (alive) {
+        LOG_EVENT(LOG_INFO, "Server: Taking over %s from process %d", filename.c_str(), predecessor);
+        fetchAddWord(channel, DOORBELL_OFFSET, 1);
+        wakeWord(channel, DOORBELL_OFFSET);
         
-        // Wait for a request from a client
+        // Wait for the release. A predecessor that dies or stops
+        // heartbeating meanwhile has nothing left to hand over either.
         while (running) {
-            if (!readMessage(fd, msg)) {
-                std::this_thread::sleep_for(std::chrono::seconds(1));
-                continue;
+            int pid = 0;
+            int heartbeat = 0;
+            if (!loadWord(channel, SERVER_PID_OFFSET, pid) || pid == 0) {
+                break;
             }
-            
-            if (msg.status == 1) {
+            loadWord(channel, HEARTBEAT_OFFSET, heartbeat);
+            int32_t age = static_cast<int32_t>(static_cast<uint32_t>(heartbeatClockMs()) - static_cast<uint32_t>(heartbeat));
+            if (!isProcessAlive(pid) || age > SERVER_STALE_MS) {
+                LOG_EVENT(LOG_WARN, "Server: Process %d stopped without handing over %s", pid, filename.c_str());
                 break;
             }
-            
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    } else {
+        LOG_EVENT(LOG_INFO, "Server: Taking over %s left behind by process %d", filename.c_str(), predecessor);
+    }
+    
+    storeWord(channel, SERVER_PID_OFFSET, currentProcessId());
+    storeWord(channel, HEARTBEAT_OFFSET, heartbeatClockMs());
+    storeWord(channel, SERVER_SLEEPING_OFFSET, 0);
+    if (!running) {
+        closeChannel(channel);
+        return false;
+    }
+    
+    size_t fileSize = serverFileSize(channel.slotCount, channel.channelCount, channel.overflowCount);
+    if (preallocate && !preallocateFile(channel.fd, fileSize)) {
+        LOG_EVENT(LOG_WARN, "Server: Cannot preallocate the IPC file: %s", strerror(errno));
+    }
+    return true;
+}
+
+// Function to carry on where the predecessor stopped after a takeover.
+// Requests it took and never answered (it crashed) go back to the ring,
+// and sessions that still own a response channel are adopted, so their
+// clients go on without a new hello. Then the file is running again.
+void adoptServerFile(IpcChannel& channel) {
+    int requeued = 0;
+    for (uint32_t slot = 0; slot < channel.slotCount; slot++) {
+        int status = loadSlotStatus(channel, slot);
+        if (status == SLOT_PROCESSING &&
+            compareExchangeSlotStatus(channel, slot, SLOT_PROCESSING, SLOT_REQUEST, false)) {
+            requeued++;
+        } else if (status == SLOT_CANCELLED) {
+            releaseSlot(channel, slot);
+        }
+    }
+    
+    int now = heartbeatClockMs();
+    int adopted = 0;
+    freeReplyChannels.clear();
+    for (uint32_t index = channel.channelCount; index > 0; index--) {
+        size_t ownerOffset = channelWordOffset(channel, index - 1, offsetof(ResponseChannel, ownerId));
+        size_t tokenOffset = channelWordOffset(channel, index - 1, offsetof(ResponseChannel, ownerToken));
+        int ownerId = 0;
+        int ownerToken = 0;
+        loadWord(channel, ownerOffset, ownerId);
+        loadWord(channel, tokenOffset, ownerToken);
+        if (ownerId > 0 && clientTable.adopt(ownerId, ownerToken, static_cast<int>(index), now)) {
+            adopted++;
+            continue;
         }
         
-        if (!running) break;
+        // No room in a smaller table: the client will say hello again
+        storeWord(channel, ownerOffset, 0);
+        storeWord(channel, tokenOffset, 0);
+        freeReplyChannels.push_back(index - 1);
+    }
+    
+    storeWord(channel, IN_FLIGHT_OFFSET, 0);
+    storeWord(channel, CLIENT_COUNT_OFFSET, clientTable.liveCount());
+    storeWord(channel, SERVER_STATE_OFFSET, SERVER_RUNNING);
+    LOG_EVENT(LOG_INFO, "Server: Took over %s with %d sessions, %d unanswered requests back in the ring",
+              currentFileName.c_str(), adopted, requeued);
+}
+
+int main(int argc, char* argv[]) {
+    if (!parseArguments(argc, argv)) {
+        return 1;
+    }
+    
+    eventLog.setLevel(logLevel);
+    eventLog.start();
+    
+    signal(SIGINT, signalHandler);
+    signal(SIGTERM, signalHandler);
+    
+    uint32_t captureRecords = static_cast<uint32_t>((static_cast<size_t>(captureSizeMb) << 20) / sizeof(TraceRecord));
+    if (!captureFile.empty()) {
+        if (!traceWriter.open(captureFile, captureRecords)) {
+            std::cerr << "Server: Failed to create capture file " << captureFile << ": " << strerror(errno) << std::endl;
+            eventLog.stop();
+            return 1;
+        }
+        LOG_EVENT(LOG_INFO, "Server: Capturing requests to %s (room for %u)", captureFile.c_str(), captureRecords);
+    }
+    
+    int serverNode = placeDispatcher();
+    
+    // A file being taken over is ours before the sweep below could take
+    // it for the file of a dead server
+    IpcChannel channel;
+    bool takingOver = !takeoverFile.empty();
+    if (takingOver && !takeOverServerFile(channel, takeoverFile)) {
+        eventLog.stop();
+        return 1;
+    }
+    
+    removeStaleServerFiles();
+    
+    // Take the next server number from the registry. Only a new registry
+    // (or none at all) needs the directory scan for the highest number.
+    // A successor keeps the number of the file it took over.
+    IpcChannel registry;
+    bool hasRegistry = openRegistry(registry, transportMode, false) ||
+                       openRegistry(registry, transportMode, true, findMaxServerNumber());
+    if (takingOver) {
+        serverInstanceNumber = std::atoi(takeoverFile.c_str() + strlen(SERVER_FILE_PREFIX));
+        currentFileName = takeoverFile;
+        LOG_EVENT(LOG_INFO, "Server: Starting server #%d with file: %s (taken over)",
+                  serverInstanceNumber, currentFileName.c_str());
+    } else {
+        serverInstanceNumber = hasRegistry ? allocateServerNumber(registry) : 0;
+        if (serverInstanceNumber <= 0) {
+            serverInstanceNumber = findMaxServerNumber() + 1;
+        }
         
-        // Check if the message is "ping"
-        if (!isValidPingRequest(msg.data)) {
-            std::string receivedMsg(msg.data);
+        // Create a filename with a sequential number
+        currentFileName = std::string(SERVER_FILE_PREFIX) + std::to_string(serverInstanceNumber) + ".bin";
+        LOG_EVENT(LOG_INFO, "Server: Starting server #%d with file: %s",
+                  serverInstanceNumber, currentFileName.c_str());
+        if (!createServerFile(channel)) {
+            eventLog.stop();
+            return 1;
+        }
+    }
+    
+    placeServerFile(channel, serverNode);
+    if (preallocate && !lockChannelMemory(channel)) {
+        LOG_EVENT(LOG_WARN, "Server: Cannot lock the server file in memory (RLIMIT_MEMLOCK?): %s", strerror(errno));
+    }
+    
+    if (transportMode == TRANSPORT_URING && !hasIoEngine(channel)) {
+        LOG_EVENT(LOG_WARN, "Server: io_uring is not available, using plain file I/O");
+    }
+    
+    replyChannelLocks = std::make_unique<std::mutex[]>(channel.channelCount);
+    clientTable.reset(static_cast<size_t>(maxClients));
+    for (uint32_t index = channel.channelCount; index > 0; index--) {
+        freeReplyChannels.push_back(index - 1);
+    }
+    metrics = std::make_unique<ServerMetrics>(workerCount + 1);
+    responseCaches = std::make_unique<ResponseCache[]>(workerCount + 1);
+    for (int i = 0; i <= workerCount; i++) {
+        responseCaches[i].reset(static_cast<size_t>(cacheEntries));
+    }
+    scheduler.setWeights(classWeights);
+    rateLimiter.reset(clientTable.capacity(), rateLimit, rateBurst);
+    if (takingOver) {
+        adoptServerFile(channel);
+    }
+    
+    LOG_EVENT(LOG_INFO, "Server started with %u slots.", channel.slotCount);
+    
+    // Announce the server only now that its file is ready to be opened
+    int registryIndex = hasRegistry ? registerServer(registry, serverInstanceNumber) : -1;
+    if (hasRegistry && registryIndex < 0) {
+        LOG_EVENT(LOG_WARN, "Server: Registry is full, clients will find this server by directory scan");
+    }
+    
+    // Housekeeping: refresh the header heartbeat clients check liveness
+    // with, sample the queue depth for the load figures, reclaim slots
+    // abandoned by dead clients and keep the registry heartbeat fresh
+    std::thread housekeepingThread([&channel, &registry, registryIndex]() {
+        if (!serverCpus.empty()) {
+            pinCurrentThread(serverCpus);   // any listed CPU, not just the dispatcher's
+        }
+        int sinceHeartbeat = 0;
+        while (running) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(SERVER_HEARTBEAT_INTERVAL_MS));
+            storeWord(channel, HEARTBEAT_OFFSET, heartbeatClockMs());
             
-            logEvent("Server: Invalid message from client #" + 
-                    std::to_string(msg.client_id) + ": \"" + receivedMsg + "\"");
+            // One pass over the ring for the queue depth and the lease sweep
+            int statuses[MAX_SLOT_COUNT];
+            if (loadSlotStatuses(channel, statuses)) {
+                storeWord(channel, QUEUE_DEPTH_OFFSET, countQueuedRequests(channel, statuses));
+                for (uint32_t slot = 0; slot < channel.slotCount; slot++) {
+                    if ((statuses[slot] == SLOT_CLAIMED || statuses[slot] == SLOT_RESPONSE) &&
+                        reclaimAbandonedSlot(channel, slot, true)) {
+                        LOG_EVENT(LOG_WARN, "Server: Reclaimed slot %u abandoned by its client", slot);
+                    }
+                }
+            }
+            expireIdleClients(channel);
             
-            msg.status = 2;
-            msg.client_id = msg.client_id; // Preserve the client ID
-            std::strncpy(msg.data, "ERROR: Only 'ping' is accepted", sizeof(msg.data) - 1);
-            msg.data[sizeof(msg.data) - 1] = '\0';
+            // A successor asked for the file: stop taking requests and
+            // wake the main loop to wind down
+            int state = SERVER_RUNNING;
+            if (!handoffRequested && loadWord(channel, SERVER_STATE_OFFSET, state) && state == SERVER_HANDOFF) {
+                LOG_EVENT(LOG_INFO, "Server: A successor is taking over, answering the requests already taken");
+                handoffRequested = true;
+                fetchAddWord(channel, DOORBELL_OFFSET, 1);
+                wakeWord(channel, DOORBELL_OFFSET);
+            }
             
-            writeMessage(fd, msg);
-            continue;
+            sinceHeartbeat += SERVER_HEARTBEAT_INTERVAL_MS;
+            if (sinceHeartbeat >= REGISTRY_HEARTBEAT_MS) {
+                heartbeatServer(registry, registryIndex);
+                sinceHeartbeat = 0;
+            }
         }
+    });
+    
+    // Optional worker pool; without it requests are handled inline
+    std::unique_ptr<WorkerPool<RequestTask>> pool;
+    if (workerCount > 0) {
+        pool = std::make_unique<WorkerPool<RequestTask>>(
+            workerCount, channel.slotCount,
+            [&channel](RequestTask& task, int worker) { processRequest(channel, task, worker + 1); }, placeWorker);
+        LOG_EVENT(LOG_INFO, "Server: Started %d worker threads", workerCount);
+    }
+    
+    uint32_t cursor = 0;
+    
+#if IPC_HAVE_COROUTINES
+    if (reactorEnabled) {
+        LOG_EVENT(LOG_INFO, "Server: Running the main loop on the coroutine reactor");
+        Reactor reactor(running);
+        reactor.spawn(serveRing(reactor, channel, pool.get()));
+        reactor.run();
+    }
+#endif
+    
+    while (running && !reactorEnabled) {
+        RequestTask task;
+        bool taken = false;
         
-        // Assign an ID to the client if it's a new connection
-        bool isNewClient = false;
-        {
-            std::lock_guard<std::mutex> lock(clientMutex);
+        // Wait for a request from a client. New arrivals join the
+        // scheduler before every pick, so a high-priority request
+        // overtakes a bulk backlog. In a handoff the ring is left to the
+        // successor and only the requests already taken are answered.
+        while (running) {
+            int seen = 0;
+            if (!loadWord(channel, DOORBELL_OFFSET, seen)) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                continue;
+            }
             
-            // Check if this is a new client (client_id == 0)
-            if (msg.client_id == 0) {
-                // Assign a new ID
-                msg.client_id = nextClientId++;
-                connectedClients.insert(msg.client_id);
-                clientCounter = connectedClients.size();
-                isNewClient = true;
+            if (!handoffRequested) {
+                admitRequests(channel, cursor);
             }
-            // If client already has an ID but not in our set, add it
-            else if (msg.client_id > 0 && connectedClients.find(msg.client_id) == connectedClients.end()) {
-                connectedClients.insert(msg.client_id);
-                clientCounter = connectedClients.size();
-                isNewClient = true;
+            taken = scheduler.pop(task);
+            if (taken || handoffRequested) {
+                break;
+            }
+            
+            // Nothing pending: spin as the wait policy allows, then sleep
+            // until a client rings the doorbell
+            if (!spinOnWord(channel, DOORBELL_OFFSET, seen, WAIT_POLL_INTERVAL_MS)) {
+                storeWord(channel, SERVER_SLEEPING_OFFSET, 1);
+                waitWord(channel, DOORBELL_OFFSET, seen, WAIT_POLL_INTERVAL_MS);
+                storeWord(channel, SERVER_SLEEPING_OFFSET, 0);
             }
         }
         
-        if (isNewClient) {
-            logEvent("Server: Client #" + std::to_string(msg.client_id) + 
-                    " connected. Total connected clients: " + std::to_string(clientCounter.load()));
-        }
-        
-        // Process the ping request
-        logEvent("Server: Received 'ping' from client #" + std::to_string(msg.client_id));
-        
-        // Form a response
-        std::string response = "pong from server #" + std::to_string(serverInstanceNumber) +
-                              " to client #" + std::to_string(msg.client_id);
+        if (!running || !taken) break;
         
-        msg.status = 2;
-        std::strncpy(msg.data, response.c_str(), sizeof(msg.data) - 1);
-        msg.data[sizeof(msg.data) - 1] = '\0';
-        
-        if (!writeMessage(fd, msg)) {
-            continue;
+        if (pool && requestCost(task) == COST_POOL) {
+            pool->submit(std::move(task));
+        } else {
+            processRequest(channel, task, 0);
         }
-        
-        logEvent("Server: Sent 'pong' to client #" + std::to_string(msg.client_id));
-        
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    
+    // Let the workers finish what they already took off the ring
+    if (pool) {
+        pool->stop();
+    }
+    
+    if (traceWriter.enabled()) {
+        LOG_EVENT(LOG_INFO, "Server: Captured %d requests to %s, %llu more did not fit", traceWriter.recorded(),
+                  captureFile.c_str(), static_cast<unsigned long long>(traceWriter.dropped()));
+        traceWriter.close();
     }
     
     // Shutdown
-    logEvent("Server: Shutting down...");
+    LOG_EVENT(LOG_INFO, handoffRequested ? "Server: Handing over..." : "Server: Shutting down...");
+    running = false;
     
-    Message shutdownMsg{};
-    shutdownMsg.status = 0;
-    shutdownMsg.client_id = 0;
-    std::strncpy(shutdownMsg.data, "SERVER_SHUTDOWN", sizeof(shutdownMsg.data) - 1);
-    shutdownMsg.data[sizeof(shutdownMsg.data) - 1] = '\0';
-    writeMessage(fd, shutdownMsg);
+    deregisterServer(registry, registryIndex, serverInstanceNumber);
+    housekeepingThread.join();
+    closeChannel(registry);
     
-    close(fd);
-    cleanupServerFile();
+    // In a handoff the file stays for the successor and its clients
+    if (handoffRequested) {
+        storeWord(channel, SERVER_PID_OFFSET, 0);
+        closeChannel(channel);
+        LOG_EVENT(LOG_INFO, "Server #%d handed over to its successor", serverInstanceNumber);
+    } else {
+        storeWord(channel, SERVER_STATE_OFFSET, SERVER_STOPPED);
+        closeChannel(channel);
+        cleanupServerFile();
+        LOG_EVENT(LOG_INFO, "Server #%d stopped", serverInstanceNumber);
+    }
+    LOG_EVENT(LOG_INFO, "Total unique clients served: %d", clientCounter.load());
+    
+    // Final statistics, one log record per report line
+    char report[OVERFLOW_CHUNK_SIZE];
+    std::string_view remaining(report, formatStatsReport(report, sizeof(report)));
+    while (!remaining.empty()) {
+        size_t end = std::min(remaining.find('\n'), remaining.size());
+        LOG_EVENT(LOG_INFO, "%.*s", static_cast<int>(end), remaining.data());
+        remaining.remove_prefix(std::min(end + 1, remaining.size()));
+    }
     
-    logEvent("Server #" + std::to_string(serverInstanceNumber) + " stopped");
-    logEvent("Total unique clients served: " + std::to_string(clientCounter.load()));
+    // Flush whatever is still queued before exiting
+    eventLog.stop();
     
     return 0;
 }
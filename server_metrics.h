@@ -0,0 +1,121 @@
+#ifndef SERVER_METRICS_H
+#define SERVER_METRICS_H
+
+#include "latency_histogram.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+// Commands are counted by opcode; opcodes must stay below this
+const int MAX_METRIC_COMMANDS = 16;
+// Queue waits are recorded by priority class; classes must stay below this
+const int MAX_METRIC_PRIORITIES = 4;
+
+// Counters and latency histograms of one request-processing thread (the
+// main thread or a pool worker). Only the owning thread writes them, so the
+// counters are plain loads and stores instead of locked read-modify-writes,
+// and each thread's block starts on its own cache line so neighbours never
+// share one.
+struct alignas(64) ThreadMetrics {
+    std::atomic<uint64_t> requests{0};    // every message taken off the ring
+    std::atomic<uint64_t> commands[MAX_METRIC_COMMANDS] = {};   // by opcode, batch entries included
+    std::atomic<uint64_t> batches{0};
+    std::atomic<uint64_t> batchEntries{0};
+    std::atomic<uint64_t> hellos{0};
+    std::atomic<uint64_t> invalid{0};     // unknown commands and unreadable bodies
+    std::atomic<uint64_t> dropped{0};     // responses nobody could receive
+    std::atomic<uint64_t> cacheHits{0};   // cacheable commands answered from the response cache
+    std::atomic<uint64_t> cacheMisses{0};
+    std::atomic<uint64_t> rateLimited{0};   // requests demoted for going over the client's rate
+
+    // The histograms are bigger than a word; the owner and snapshot() take
+    // this lock, which is uncontended except while someone asks for stats.
+    // Requests per client are counted in the client table instead.
+    std::mutex lock;
+    LatencyHistogram queueWait[MAX_METRIC_PRIORITIES];   // taken off the ring -> processing starts (ns), by class
+    LatencyHistogram processing;      // processing starts -> response ready (ns)
+    LatencyHistogram responseWrite;   // response ready -> delivered (ns)
+};
+
+inline void incrementCounter(std::atomic<uint64_t>& counter, uint64_t delta = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+// Totals over all threads
+struct MetricsSnapshot {
+    uint64_t requests = 0;
+    uint64_t commands[MAX_METRIC_COMMANDS] = {};
+    uint64_t batches = 0;
+    uint64_t batchEntries = 0;
+    uint64_t hellos = 0;
+    uint64_t invalid = 0;
+    uint64_t dropped = 0;
+    uint64_t cacheHits = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t rateLimited = 0;
+    LatencyHistogram queueWait;       // all classes
+    LatencyHistogram classQueueWait[MAX_METRIC_PRIORITIES];
+    LatencyHistogram processing;
+    LatencyHistogram responseWrite;
+};
+
+class ServerMetrics {
+public:
+    explicit ServerMetrics(int threadCount)
+        : threads_(std::make_unique<ThreadMetrics[]>(threadCount)), threadCount_(threadCount) {}
+
+    ThreadMetrics& thread(int index) {
+        return threads_[index];
+    }
+
+    int threadCount() const {
+        return threadCount_;
+    }
+
+    // Function to record one answered request on the calling thread's block
+    void recordRequest(int thread, int priorityClass, uint64_t queueWaitNs, uint64_t processingNs,
+                       uint64_t responseWriteNs) {
+        ThreadMetrics& metrics = threads_[thread];
+        incrementCounter(metrics.requests);
+
+        std::lock_guard<std::mutex> guard(metrics.lock);
+        metrics.queueWait[priorityClass].record(queueWaitNs);
+        metrics.processing.record(processingNs);
+        metrics.responseWrite.record(responseWriteNs);
+    }
+
+    // Function to add up every thread's figures; `snapshot` must be empty
+    void snapshot(MetricsSnapshot& snapshot) {
+        for (int i = 0; i < threadCount_; i++) {
+            ThreadMetrics& metrics = threads_[i];
+            snapshot.requests += metrics.requests.load(std::memory_order_relaxed);
+            for (int command = 0; command < MAX_METRIC_COMMANDS; command++) {
+                snapshot.commands[command] += metrics.commands[command].load(std::memory_order_relaxed);
+            }
+            snapshot.batches += metrics.batches.load(std::memory_order_relaxed);
+            snapshot.batchEntries += metrics.batchEntries.load(std::memory_order_relaxed);
+            snapshot.hellos += metrics.hellos.load(std::memory_order_relaxed);
+            snapshot.invalid += metrics.invalid.load(std::memory_order_relaxed);
+            snapshot.dropped += metrics.dropped.load(std::memory_order_relaxed);
+            snapshot.cacheHits += metrics.cacheHits.load(std::memory_order_relaxed);
+            snapshot.cacheMisses += metrics.cacheMisses.load(std::memory_order_relaxed);
+            snapshot.rateLimited += metrics.rateLimited.load(std::memory_order_relaxed);
+
+            std::lock_guard<std::mutex> guard(metrics.lock);
+            for (int priority = 0; priority < MAX_METRIC_PRIORITIES; priority++) {
+                snapshot.queueWait.merge(metrics.queueWait[priority]);
+                snapshot.classQueueWait[priority].merge(metrics.queueWait[priority]);
+            }
+            snapshot.processing.merge(metrics.processing);
+            snapshot.responseWrite.merge(metrics.responseWrite);
+        }
+    }
+
+private:
+    std::unique_ptr<ThreadMetrics[]> threads_;
+    int threadCount_;
+};
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Per-worker task deque. The owner takes tasks from the front so requests
+// are served in arrival order; thieves take from the back, i.e. the work
+// the owner would reach last.
+template <typename Task>
+class WorkStealingQueue {
+public:
+    void push(Task&& task) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+    }
+
+    bool pop(Task& task) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tasks_.empty()) {
+            return false;
+        }
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+        return true;
+    }
+
+    bool steal(Task& task) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tasks_.empty()) {
+            return false;
+        }
+        task = std::move(tasks_.back());
+        tasks_.pop_back();
+        return true;
+    }
+
+private:
+    std::mutex mutex_;
+    std::deque<Task> tasks_;
+};
+
+// Fixed pool of worker threads fed by a single dispatcher.
+// submit() deals tasks round-robin onto the worker deques; an idle worker
+// steals from its neighbours before going to sleep. submit() blocks while
+// `capacity` tasks are already queued, which pushes back on the IPC ring.
+template <typename Task>
+class WorkerPool {
+public:
+    using Handler = std::function<void(Task&, int worker)>;
+    using Starter = std::function<void(int worker)>;
+
+    // `starter`, if set, runs first on every worker thread (e.g. to pin it)
+    WorkerPool(int workerCount, size_t capacity, Handler handler, Starter starter = nullptr)
+        : handler_(std::move(handler)), capacity_(capacity) {
+        for (int i = 0; i < workerCount; i++) {
+            queues_.push_back(std::make_unique<WorkStealingQueue<Task>>());
+        }
+        for (int i = 0; i < workerCount; i++) {
+            threads_.emplace_back([this, i, starter]() {
+                if (starter) {
+                    starter(i);
+                }
+                workerLoop(i);
+            });
+        }
+    }
+
+    ~WorkerPool() {
+        stop();
+    }
+
+    void submit(Task&& task) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            spaceAvailable_.wait(lock, [this]() { return pending_ < capacity_ || stopping_; });
+            pending_++;
+        }
+        queues_[nextQueue_]->push(std::move(task));
+        nextQueue_ = (nextQueue_ + 1) % queues_.size();
+        workAvailable_.notify_one();
+    }
+
+    // Drains the queued tasks, then joins the workers
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                return;
+            }
+            stopping_ = true;
+        }
+        workAvailable_.notify_all();
+        spaceAvailable_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    int size() const {
+        return static_cast<int>(queues_.size());
+    }
+
+private:
+    bool takeTask(int worker, Task& task) {
+        if (queues_[worker]->pop(task)) {
+            return true;
+        }
+        for (size_t i = 1; i < queues_.size(); i++) {
+            if (queues_[(worker + i) % queues_.size()]->steal(task)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(int worker) {
+        while (true) {
+            Task task;
+            if (takeTask(worker, task)) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    pending_--;
+                }
+                spaceAvailable_.notify_one();
+                handler_(task, worker);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (stopping_ && pending_ == 0) {
+                break;
+            }
+            // pending_ counts tasks not yet taken, so a wakeup is never lost:
+            // submit() increments it under the lock before pushing
+            workAvailable_.wait(lock, [this]() { return pending_ > 0 || stopping_; });
+        }
+    }
+
+    Handler handler_;
+    size_t capacity_;
+    std::vector<std::unique_ptr<WorkStealingQueue<Task>>> queues_;
+    std::vector<std::thread> threads_;
+    size_t nextQueue_ = 0;   // only touched by the dispatcher thread
+
+    std::mutex mutex_;
+    std::condition_variable workAvailable_;
+    std::condition_variable spaceAvailable_;
+    size_t pending_ = 0;
+    bool stopping_ = false;
+};
+
+#endif